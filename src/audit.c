@@ -0,0 +1,352 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file audit.c
+ * @brief offline verification of reader transcripts against a set of keys
+ *
+ * Each transcript line is five HEX fields, separated by spaces or commas:
+ *
+ *   CSN(8) CC(8) NR(4) MAC(4) TMAC(4)
+ *
+ * CSN is in the order printed when a card is found. For each record the
+ * reader MAC over CC.NR and the tag MAC over CC.NR.0^32 are recomputed
+ * under every key until one matches. The file is memory mapped and split
+ * between one thread per core. Each thread caches diversified keys per CSN,
+ * because the same cards show up again and again in site logs.
+ *
+ * Key files have one key per line: KEY [e] [NAME], where 'e' marks ELITE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "audit.h"
+#include "hex.h"
+#include "iclass.h"
+#include "job.h"
+#include "mac.h"
+
+// loclass includes
+#include "cipher.h"
+#include "elite_crack.h"
+
+#define AUDIT_CACHE		4096	// diversified key cache entries per thread (power of 2)
+#define AUDIT_OUTBUF		0x10000
+
+typedef struct {
+  bool used;
+  uint8_t csn[8];
+  uint8_t div_keys[AUDIT_MAXKEYS][8];
+} audit_cache;
+
+typedef struct {
+  audit_keyset *set;
+  const char *start, *end;
+  audit_cache *cache;
+  bool threaded;		// running on its own thread
+  unsigned long records, bad, unmatched, tag_fail;
+  unsigned long matched[AUDIT_MAXKEYS];
+  char out[AUDIT_OUTBUF];
+  size_t outlen;
+} audit_worker;
+
+static pthread_mutex_t Out_lock= PTHREAD_MUTEX_INITIALIZER;
+
+bool audit_add_key(audit_keyset *set, uint8_t *key, bool elite, char *name)
+{
+  audit_key *k;
+
+  if(set->count >= AUDIT_MAXKEYS)
+    return true;
+  k= &set->keys[set->count++];
+  memcpy(k->key, key, 8);
+  k->elite= elite;
+  snprintf(k->name, sizeof(k->name), "%s", name);
+  if(elite)
+    hash2(k->key, k->keytable);
+  return false;
+}
+
+// load key file - return false if OK or true if failed
+bool audit_load_keys(audit_keyset *set, char *filename)
+{
+  char line[256], *hex, *tok, *name;
+  uint8_t key[8];
+  bool elite;
+  FILE *f;
+
+  if(!(f= fopen(filename, "r")))
+    return true;
+  while(fgets(line, sizeof(line), f))
+    {
+    if(!(hex= strtok(line, " \t\r\n")) || *hex == '#')
+      continue;
+    elite= false;
+    name= hex;
+    while((tok= strtok(NULL, " \t\r\n")))
+      if(!strcasecmp(tok, "e"))
+        elite= true;
+      else
+        name= tok;
+    if(job_hex(hex, key, 8) || audit_add_key(set, key, elite, name))
+      {
+      fclose(f);
+      return true;
+      }
+    }
+  fclose(f);
+  return false;
+}
+
+// parse len bytes of HEX at *p, skipping leading separators - return false if OK
+static bool audit_field(const char **p, const char *end, uint8_t *data, int len)
+{
+  const char *s= *p;
+
+  while(s < end && (*s == ' ' || *s == '\t' || *s == ','))
+    ++s;
+  if(end - s < len * 2 || hex_decode(s, len * 2, data) < 0)
+    return true;
+  *p= s + len * 2;
+  return false;
+}
+
+// parse transcript record CSN CC NR MAC TMAC from p to end - return false if OK or true if failed
+bool audit_parse(const char *p, const char *end, uint8_t *uid, uint8_t *cc_nr, uint8_t *mac, uint8_t *tmac)
+{
+  return audit_field(&p, end, uid, 8) || audit_field(&p, end, cc_nr, 8) || audit_field(&p, end, &cc_nr[8], 4)
+         || audit_field(&p, end, mac, 4) || audit_field(&p, end, tmac, 4);
+}
+
+static void audit_output(audit_worker *w, const char *line, size_t len)
+{
+  if(w->outlen + len > AUDIT_OUTBUF)
+    {
+    pthread_mutex_lock(&Out_lock);
+    fwrite(w->out, 1, w->outlen, stdout);
+    pthread_mutex_unlock(&Out_lock);
+    w->outlen= 0;
+    }
+  memcpy(&w->out[w->outlen], line, len);
+  w->outlen += len;
+}
+
+// return diversified keys for CSN, calculating and caching them if needed
+static uint8_t (*audit_div_keys(audit_worker *w, uint8_t *csn))[8]
+{
+  audit_cache *c;
+  unsigned int h;
+  int i;
+
+  for(h= 0, i= 0 ; i < 8 ; ++i)
+    h= h * 31 + csn[i];
+  c= &w->cache[h & (AUDIT_CACHE - 1)];
+  if(c->used && !memcmp(c->csn, csn, 8))
+    return c->div_keys;
+  for(i= 0 ; i < w->set->count ; ++i)
+    if(w->set->keys[i].elite)
+      divkey_elite_table(csn, w->set->keys[i].keytable, c->div_keys[i]);
+    else
+      iclass_diversify(csn, w->set->keys[i].key, c->div_keys[i]);
+  memcpy(c->csn, csn, 8);
+  c->used= true;
+  return c->div_keys;
+}
+
+static void audit_record(audit_worker *w, const char *p, const char *end)
+{
+  uint8_t uid[8], csn[8], cc_nr[12], mac[4], tmac[4], calc[4], (*div_keys)[8];
+  iclass_mac_ctx ctx;
+  char line[128];
+  int i, n, match= -1;
+  bool tag_fail= false;
+
+  if(audit_parse(p, end, uid, cc_nr, mac, tmac))
+    {
+    ++w->bad;
+    return;
+    }
+  ++w->records;
+
+  // iClass stores uid LSB first but libnfc reverses it
+  for(i= 0 ; i < 8 ; ++i)
+    csn[i]= uid[7 - i];
+  div_keys= audit_div_keys(w, csn);
+  for(i= 0 ; i < w->set->count && match < 0 ; ++i)
+    {
+    iclass_mac_init(&ctx, div_keys[i]);
+    iclass_mac_update(&ctx, cc_nr, 12);
+    iclass_mac_final(&ctx, calc);
+    if(memcmp(calc, mac, 4))
+      continue;
+    // reader knew the key - did the card? (TMAC carries on from the same cipher state)
+    iclass_mac_final(&ctx, calc);
+    if(memcmp(calc, tmac, 4))
+      tag_fail= true;
+    match= i;
+    }
+
+  hex_encode(uid, 8, line);
+  line[16]= ' ';
+  hex_encode(cc_nr, 8, &line[17]);
+  n= 33;
+  if(match < 0)
+    {
+    ++w->unmatched;
+    n += sprintf(&line[n], " NONE\n");
+    }
+  else
+    {
+    ++w->matched[match];
+    if(tag_fail)
+      ++w->tag_fail;
+    n += snprintf(&line[n], sizeof(line) - n, " %s%s\n", w->set->keys[match].name, tag_fail ? " TMAC-FAIL" : "");
+    }
+  audit_output(w, line, n);
+}
+
+static void *audit_thread(void *arg)
+{
+  audit_worker *w= (audit_worker *) arg;
+  const char *p, *eol;
+
+  for(p= w->start ; p < w->end ; p= eol + 1)
+    {
+    if(!(eol= memchr(p, '\n', w->end - p)))
+      eol= w->end;
+    while(p < eol && isspace((unsigned char) *p))
+      ++p;
+    if(p < eol && *p != '#')
+      audit_record(w, p, eol);
+    }
+  pthread_mutex_lock(&Out_lock);
+  fwrite(w->out, 1, w->outlen, stdout);
+  pthread_mutex_unlock(&Out_lock);
+  return NULL;
+}
+
+// verify all transcripts in file - return number of unmatched records or -1 if failed
+int audit_transcripts(audit_keyset *set, char *filename)
+{
+  audit_worker *workers;
+  pthread_t *threads;
+  struct stat st;
+  const char *map, *p;
+  unsigned long records= 0, bad= 0, unmatched= 0, tag_fail= 0, matched;
+  int fd, i, j, nthreads;
+
+  if(!set->count)
+    return -1;
+  if((fd= open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    return -1;
+  if(!st.st_size)
+    {
+    close(fd);
+    return 0;
+    }
+  map= mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return -1;
+  posix_madvise((void *) map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+  if((nthreads= (int) sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    nthreads= 1;
+  workers= calloc(nthreads, sizeof(audit_worker));
+  threads= calloc(nthreads, sizeof(pthread_t));
+  if(!workers || !threads)
+    return -1;
+
+  // split at line boundaries
+  for(i= 0, p= map ; i < nthreads ; ++i)
+    {
+    workers[i].set= set;
+    workers[i].start= p;
+    if(i == nthreads - 1)
+      p= map + st.st_size;
+    else
+      {
+      p= map + st.st_size / nthreads * (i + 1);
+      if(p < workers[i].start)
+        p= workers[i].start;
+      while(p < map + st.st_size && *p != '\n')
+        ++p;
+      }
+    workers[i].end= p;
+    if(!(workers[i].cache= calloc(AUDIT_CACHE, sizeof(audit_cache))))
+      return -1;
+    }
+  for(i= 0 ; i < nthreads ; ++i)
+    if(!(workers[i].threaded= !pthread_create(&threads[i], NULL, audit_thread, &workers[i])))
+      audit_thread(&workers[i]);
+  for(i= 0 ; i < nthreads ; ++i)
+    if(workers[i].threaded)
+      pthread_join(threads[i], NULL);
+
+  for(i= 0 ; i < nthreads ; ++i)
+    {
+    records += workers[i].records;
+    bad += workers[i].bad;
+    unmatched += workers[i].unmatched;
+    tag_fail += workers[i].tag_fail;
+    free(workers[i].cache);
+    }
+  fflush(stdout);
+  fprintf(stderr, "\n  %lu records, %lu unreadable, %lu no key, %lu TMAC failures (%d threads)\n", records, bad, unmatched, tag_fail, nthreads);
+  for(j= 0 ; j < set->count ; ++j)
+    {
+    for(matched= 0, i= 0 ; i < nthreads ; ++i)
+      matched += workers[i].matched[j];
+    fprintf(stderr, "    %-32s %lu\n", set->keys[j].name, matched);
+    }
+  munmap((void *) map, st.st_size);
+  free(workers);
+  free(threads);
+  return (int) (unmatched > 0x7fffffff ? 0x7fffffff : unmatched);
+}
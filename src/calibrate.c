@@ -0,0 +1,193 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file calibrate.c
+ * @brief sweep reader timing settings and pick the fastest reliable one
+ *
+ * Every setting gets the same number of cycles. Each cycle switches the field
+ * off and on, so it starts from a freshly powered card, then does select, header
+ * read, DEBIT authentication, READ of a block and UPDATE of that block with what
+ * it already holds. A setting is reliable if every cycle works, and of those the
+ * one with the lowest 95th percentile cycle time wins.
+ *
+ * The transceive timeout, Type B setup before select and READ4 are swept first
+ * (with the UPDATE timeout at the default). Then the UPDATE timeout is swept with
+ * the winner of that. Reader errors are expected with short timeouts, so they
+ * aren't printed while calibrating.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "calibrate.h"
+
+typedef struct {
+  iclass_timing timing;
+  int ok;			// cycles that worked
+  double p50, p95, max;		// cycle time in ms, over cycles that worked
+} calibrate_result;
+
+// transceive timeouts to try, in ms (-1 is libnfc default)
+static const int Timeouts[]= { -1, 500, 200, 100, 50, 30, 20, 10 };
+static const int Update_timeouts[]= { -1, 500, 200, 100, 50, 30, 20 };
+
+static int calibrate_cmp(const void *a, const void *b)
+{
+  double x= *(const double *) a, y= *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+// one select, header, AUTH, READ and UPDATE cycle - return false if OK or true if failed
+static bool calibrate_cycle(nfc_device *pnd, uint8_t *key, bool elite, int block, bool update)
+{
+  iclass_card_info info;
+  nfc_target nt;
+  uint8_t data[8];
+
+  return !iclass_select(pnd, &nt) || iclass_read_info(pnd, &info) || !iclass_authenticate(pnd, nt, key, elite, true, true)
+    || iclass_read(pnd, block, data) || (update && iclass_write(pnd, block, data));
+}
+
+static void calibrate_setting(nfc_device *pnd, uint8_t *key, bool elite, int cycles, int block, bool update, calibrate_result *r)
+{
+  static double times[CALIBRATE_MAXCYCLES];
+  struct timespec start, end;
+  int i;
+
+  iclass_set_timing(pnd, &r->timing);
+  r->ok= 0;
+  for(i= 0 ; i < cycles ; ++i)
+    {
+    nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false);
+    nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, true);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(calibrate_cycle(pnd, key, elite, block, update))
+      continue;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    times[r->ok++]= (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    }
+  r->p50= r->p95= r->max= 0.0;
+  if(r->ok)
+    {
+    qsort(times, r->ok, sizeof(double), calibrate_cmp);
+    r->p50= times[(r->ok - 1) / 2];
+    r->p95= times[(r->ok * 95 + 99) / 100 - 1];
+    r->max= times[r->ok - 1];
+    }
+  printf("    timeout=%-4d update=%-4d typeb=%d read4=%d  %4d/%-4d  %7.1f  %7.1f  %7.1f\n", r->timing.timeout, r->timing.update_timeout,
+    r->timing.typeb_setup, r->timing.read4, r->ok, cycles, r->p50, r->p95, r->max);
+  fflush(stdout);
+}
+
+// return true if a is better than b - more cycles working, then faster
+static bool calibrate_better(calibrate_result *a, calibrate_result *b)
+{
+  if(a->ok != b->ok)
+    return a->ok > b->ok;
+  if(a->p95 != b->p95)
+    return a->p95 < b->p95;
+  return a->p50 < b->p50;
+}
+
+// sweep timing of reader with the card in the field, authenticating with key
+// the last APP1 block is READ and rewritten each cycle (UPDATE is left out if it's locked
+// or not a data block)
+// return false if a setting worked every time (best is then set) or true if none did
+bool calibrate_reader(nfc_device *pnd, uint8_t *key, bool elite, int cycles, iclass_timing *best)
+{
+  calibrate_result r, winner;
+  iclass_card_info info;
+  nfc_target nt;
+  bool update;
+  int typeb, read4, block;
+  size_t i;
+
+  // card has to work with the settings we have now
+  iclass_set_timing(pnd, &Default_timing);
+  if(!iclass_select(pnd, &nt) || iclass_read_info(pnd, &info) || !iclass_authenticate(pnd, nt, key, elite, true, true))
+    {
+    printf("\n  No card, or card doesn't take the key!\n");
+    return true;
+    }
+  block= info.app1_limit;
+  // only ever rewrite a data block - an odd config can put app1_limit on a key block
+  if(block < 6 || block > info.app2_limit)
+    {
+    update= false;
+    printf("\n  Block 0x%02x is not a data block - calibrating without UPDATE\n", block);
+    }
+  else if(!(update= !iclass_block_locked(&info, block)))
+    printf("\n  Block 0x%02x is locked - calibrating without UPDATE\n", block);
+  printf("\n  %d cycles per setting, READ%s block 0x%02x\n\n", cycles, update ? " and UPDATE" : "", block);
+  printf("    setting                              ok/cycles  p50 ms   p95 ms   max ms\n");
+
+  RF_Quiet= true;
+  winner.ok= -1;
+  for(typeb= 1 ; typeb >= 0 ; --typeb)
+    for(read4= 1 ; read4 >= 0 ; --read4)
+      for(i= 0 ; i < sizeof(Timeouts) / sizeof(Timeouts[0]) ; ++i)
+        {
+        r.timing= Default_timing;
+        r.timing.timeout= Timeouts[i];
+        r.timing.typeb_setup= typeb;
+        r.timing.read4= read4;
+        calibrate_setting(pnd, key, elite, cycles, block, update, &r);
+        if(calibrate_better(&r, &winner))
+          winner= r;
+        }
+  printf("\n");
+  for(i= 1 ; i < sizeof(Update_timeouts) / sizeof(Update_timeouts[0]) && update ; ++i)
+    {
+    r.timing= winner.timing;
+    r.timing.update_timeout= Update_timeouts[i];
+    calibrate_setting(pnd, key, elite, cycles, block, update, &r);
+    if(calibrate_better(&r, &winner))
+      winner= r;
+    }
+  RF_Quiet= false;
+
+  *best= winner.timing;
+  iclass_set_timing(pnd, best);
+  return winner.ok < cycles;
+}
@@ -0,0 +1,405 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file convert.c
+ * @brief streaming conversion of card dumps between file formats
+ *
+ * Formats:
+ *
+ *   bin   raw 8 byte blocks from block 0 (as written by -o)
+ *   hex   HEX digits, white space ignored - a single line on output
+ *   eml   Proxmark emulator file - one block of HEX per line
+ *   json  Proxmark JSON dump - card header fields and a "blocks" object
+ *
+ * The input format is given, or worked out from the data: JSON starts with '{',
+ * HEX and EML are nothing but HEX and white space, anything else is raw. A raw
+ * dump can look like either, so it should be given as bin. Everything goes
+ * through fixed size buffers a block at a time, so memory use doesn't depend on
+ * the size of the input, and HEX goes through the tables in hex.c. JSON blocks
+ * must be in order, as they are when Proxmark writes them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "convert.h"
+#include "hex.h"
+
+#define CONVERT_BUF		0x10000
+#define CONVERT_MAXSTR		64	// longest JSON string we look at
+
+static const char *Formats[]= { "bin", "hex", "eml", "json" };
+
+// JSON names of header blocks 0 to 5
+static const char *Header_names[]= { "CSN", "Configuration", "Epurse", "Kd", "Kc", "AIA" };
+
+typedef struct {
+  int fd;
+  uint8_t buf[CONVERT_BUF];
+  size_t len, pos;
+} conv_in;
+
+typedef struct {
+  int fd;
+  int format;
+  char buf[CONVERT_BUF];
+  size_t len;
+  unsigned long blocks;
+  uint8_t header[6][8];		// JSON header blocks, held until the Card section is written
+} conv_out;
+
+// return index of format name or -1 if unknown
+int convert_format(char *name)
+{
+  int i;
+
+  for(i= 0 ; i < CONVERT_FORMATS ; ++i)
+    if(!strcasecmp(name, Formats[i]))
+      return i;
+  return -1;
+}
+
+// refill input buffer - return false at end of input (or error)
+static bool conv_fill(conv_in *in)
+{
+  ssize_t len;
+
+  while((len= read(in->fd, in->buf, CONVERT_BUF)) < 0 && errno == EINTR)
+    ;
+  in->pos= 0;
+  in->len= len > 0 ? (size_t) len : 0;
+  return in->len > 0;
+}
+
+// next input byte or -1 at end
+static inline int conv_getc(conv_in *in)
+{
+  if(in->pos == in->len && !conv_fill(in))
+    return -1;
+  return in->buf[in->pos++];
+}
+
+// return false if OK
+static bool conv_flush(conv_out *out)
+{
+  size_t done= 0;
+  ssize_t len;
+
+  while(done < out->len)
+    {
+    if((len= write(out->fd, &out->buf[done], out->len - done)) < 0)
+      {
+      if(errno == EINTR)
+        continue;
+      return true;
+      }
+    done += len;
+    }
+  out->len= 0;
+  return false;
+}
+
+// return false if OK
+static bool conv_put(conv_out *out, const char *data, size_t len)
+{
+  if(out->len + len > CONVERT_BUF && conv_flush(out))
+    return true;
+  memcpy(&out->buf[out->len], data, len);
+  out->len += len;
+  return false;
+}
+
+static bool conv_puts(conv_out *out, const char *str)
+{
+  return conv_put(out, str, strlen(str));
+}
+
+// write one JSON "n": "HEX" pair
+static bool conv_json_block(conv_out *out, unsigned long blockno, uint8_t *block)
+{
+  char line[64];
+  int n;
+
+  n= sprintf(line, "%s    \"%lu\": \"", blockno ? ",\n" : "", blockno);
+  hex_encode(block, 8, &line[n]);
+  n += 16;
+  line[n++]= '"';
+  return conv_put(out, line, n);
+}
+
+// write JSON up to the start of "blocks" followed by any held header blocks
+static bool conv_json_header(conv_out *out)
+{
+  char line[64];
+  unsigned long i;
+  int n;
+
+  if(conv_puts(out, "{\n  \"Created\": \"nfc-iclass\",\n  \"FileType\": \"iclass\",\n  \"Card\": {"))
+    return true;
+  for(i= 0 ; i < out->blocks && i < 6 ; ++i)
+    {
+    n= sprintf(line, "%s\n    \"%s\": \"", i ? "," : "", Header_names[i]);
+    hex_encode(out->header[i], 8, &line[n]);
+    n += 16;
+    line[n++]= '"';
+    if(conv_put(out, line, n))
+      return true;
+    }
+  if(conv_puts(out, "\n  },\n  \"blocks\": {\n"))
+    return true;
+  for(i= 0 ; i < out->blocks && i < 6 ; ++i)
+    if(conv_json_block(out, i, out->header[i]))
+      return true;
+  return false;
+}
+
+// write one block in output format - return false if OK
+static bool conv_block(conv_out *out, uint8_t *block)
+{
+  char line[17];
+
+  switch(out->format)
+    {
+    case CONVERT_BIN:
+      ++out->blocks;
+      return conv_put(out, (char *) block, 8);
+    case CONVERT_HEX:
+    case CONVERT_EML:
+      ++out->blocks;
+      hex_encode(block, 8, line);
+      line[16]= '\n';
+      return conv_put(out, line, out->format == CONVERT_EML ? 17 : 16);
+    default:
+      if(out->blocks < 6)
+        {
+        memcpy(out->header[out->blocks++], block, 8);
+        return out->blocks == 6 && conv_json_header(out);
+        }
+      return conv_json_block(out, out->blocks++, block);
+    }
+}
+
+// finish off output - return false if OK
+static bool conv_finish(conv_out *out)
+{
+  if(out->format == CONVERT_HEX && out->blocks && conv_puts(out, "\n"))
+    return true;
+  if(out->format == CONVERT_JSON)
+    {
+    if(out->blocks < 6 && conv_json_header(out))
+      return true;
+    if(conv_puts(out, "\n  }\n}\n"))
+      return true;
+    }
+  return conv_flush(out);
+}
+
+static bool conv_parse_bin(conv_in *in, conv_out *out)
+{
+  uint8_t block[8];
+  int c, n= 0;
+
+  while((c= conv_getc(in)) >= 0)
+    {
+    block[n++]= (uint8_t) c;
+    if(n == 8)
+      {
+      if(conv_block(out, block))
+        return true;
+      n= 0;
+      }
+    }
+  // dumps are whole blocks
+  return n != 0;
+}
+
+// HEX and EML - any white space is ignored
+static bool conv_parse_hex(conv_in *in, conv_out *out)
+{
+  uint8_t block[8];
+  int c, v, nibbles= 0;
+
+  while((c= conv_getc(in)) >= 0)
+    {
+    if((v= Hex_nibbles[c]) == HEX_SPACE)
+      continue;
+    if(v == HEX_BAD)
+      return true;
+    if(nibbles & 1)
+      block[nibbles / 2] |= v;
+    else
+      block[nibbles / 2]= v << 4;
+    if(++nibbles == 16)
+      {
+      if(conv_block(out, block))
+        return true;
+      nibbles= 0;
+      }
+    }
+  return nibbles != 0;
+}
+
+// just enough JSON to find the "blocks" object and take its "n": "HEX" pairs in order
+static bool conv_parse_json(conv_in *in, conv_out *out)
+{
+  char str[CONVERT_MAXSTR + 1], key[CONVERT_MAXSTR + 1]= "";
+  int c, len, depth= 0, blocks_depth= -1;
+  bool value= false;
+  uint8_t block[8];
+  char *end;
+
+  while((c= conv_getc(in)) >= 0)
+    switch(c)
+      {
+      case '{':
+      case '[':
+        ++depth;
+        if(c == '{' && value && depth == 2 && !strcmp(key, "blocks"))
+          blocks_depth= depth;
+        value= false;
+        break;
+
+      case '}':
+      case ']':
+        if(depth == blocks_depth)
+          blocks_depth= -1;
+        --depth;
+        value= false;
+        break;
+
+      case ':':
+        value= true;
+        break;
+
+      case ',':
+        value= false;
+        break;
+
+      case '"':
+        for(len= 0 ; (c= conv_getc(in)) >= 0 && c != '"' ; )
+          {
+          if(c == '\\' && (c= conv_getc(in)) < 0)
+            break;
+          if(len < CONVERT_MAXSTR)
+            str[len++]= (char) c;
+          }
+        if(c < 0)
+          return true;
+        str[len]= '\0';
+        if(!value)
+          strcpy(key, str);
+        else if(depth == blocks_depth)
+          {
+          if(strtoul(key, &end, 10) != out->blocks || *end || !*key)
+            return true;
+          if(len != 16 || hex_decode(str, 16, block) != 8 || conv_block(out, block))
+            return true;
+          }
+        value= false;
+        break;
+      }
+  return depth != 0;
+}
+
+// convert dump infile in informat (-1 to detect it) to outfile in format ("-" for stdin / stdout)
+// return false if OK or true if failed
+bool convert_dump(char *infile, char *outfile, int informat, int format)
+{
+  static conv_in in;
+  static conv_out out;
+  bool ret;
+  size_t i;
+
+  memset(&out, 0, sizeof(out));
+  out.format= format;
+  in.len= in.pos= 0;
+  if((in.fd= strcmp(infile, "-") ? open(infile, O_RDONLY) : STDIN_FILENO) < 0)
+    return true;
+  if((out.fd= strcmp(outfile, "-") ? open(outfile, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) : STDOUT_FILENO) < 0)
+    {
+    close(in.fd);
+    return true;
+    }
+
+  // unless told, sniff first buffer - JSON starts with '{', HEX/EML is nothing but HEX and white space
+  conv_fill(&in);
+  if(informat < 0)
+    {
+    for(i= 0 ; i < in.len && Hex_nibbles[in.buf[i]] == HEX_SPACE ; ++i)
+      ;
+    if(i < in.len && in.buf[i] == '{')
+      informat= CONVERT_JSON;
+    else
+      {
+      for( ; i < in.len && Hex_nibbles[in.buf[i]] != HEX_BAD ; ++i)
+        ;
+      informat= i == in.len && in.len ? CONVERT_HEX : CONVERT_BIN;
+      }
+    }
+  switch(informat)
+    {
+    case CONVERT_JSON:
+      ret= conv_parse_json(&in, &out);
+      break;
+
+    case CONVERT_HEX:
+    case CONVERT_EML:
+      ret= conv_parse_hex(&in, &out);
+      break;
+
+    default:
+      ret= conv_parse_bin(&in, &out);
+      break;
+    }
+  if(!ret)
+    ret= conv_finish(&out);
+  if(in.fd != STDIN_FILENO)
+    close(in.fd);
+  if(out.fd != STDOUT_FILENO && close(out.fd) < 0)
+    ret= true;
+  return ret;
+}
@@ -0,0 +1,448 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file credential.c
+ * @brief offline decoding of access control credentials from card dumps
+ *
+ * The list file has one dump path per line (dumps as written by -o). For
+ * each dump the HID access control blocks are decoded:
+ *
+ *   block 6   credential config (encryption in byte 7, PIN length in byte 6)
+ *   block 7   Wiegand data, right aligned behind a leading sentinel bit
+ *   block 9   PIN as BCD nibbles
+ *
+ * Blocks 7 and 9 are DES or 3DES encrypted with the transport key when
+ * block 6 says so. Wiegand data is matched against a table of formats by
+ * length and parity. The list is split between one thread per core; each
+ * thread reads a batch of dumps, then decrypts the batch, then decodes it,
+ * so the file reads and the cipher work don't interleave record by record.
+ * Output is CSV on stdout, one row per dump.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "credential.h"
+#include "hex.h"
+#include "iclass.h"
+#include "store.h"
+
+#define CRED_BATCH		256	// dumps read per batch
+#define CRED_OUTBUF		0x10000
+#define CRED_MAXPARITY		3
+
+// parity bit check - bits are numbered from 0 == first sent
+typedef struct {
+  int pos;			// parity bit
+  bool odd;
+  int from, to;			// bits covered
+  bool skip3;			// skip every third bit, starting with from + 2
+} cred_parity;
+
+typedef struct {
+  const char *name;
+  int bits;
+  int fc_pos, fc_len;		// facility code (fc_len 0 == none)
+  int cn_pos, cn_len;		// card number
+  int nparity;
+  cred_parity parity[CRED_MAXPARITY];
+} cred_format;
+
+// formats sharing a length and parity are all listed, fields are taken from the first
+static const cred_format Formats[]= {
+  { "H10301", 26, 1, 8, 9, 16, 2, { { 0, false, 1, 12, false }, { 25, true, 13, 24, false } } },
+  { "H10306", 34, 1, 16, 17, 16, 2, { { 0, false, 1, 16, false }, { 33, true, 17, 32, false } } },
+  { "C1k35s", 35, 2, 12, 14, 20, 3, { { 1, false, 2, 33, true }, { 34, true, 1, 32, true }, { 0, true, 1, 34, false } } },
+  { "H10304", 37, 1, 16, 17, 19, 2, { { 0, false, 1, 18, false }, { 36, true, 18, 35, false } } },
+  { "H10302", 37, 0, 0, 1, 35, 2, { { 0, false, 1, 18, false }, { 36, true, 18, 35, false } } },
+  { "C1k48s", 48, 2, 22, 24, 23, 3, { { 1, false, 2, 45, true }, { 47, true, 3, 46, true }, { 0, true, 1, 47, false } } },
+};
+#define CRED_FORMATS		(sizeof(Formats) / sizeof(Formats[0]))
+
+// parity masks, built from Formats before the threads start
+static uint64_t Masks[CRED_FORMATS][CRED_MAXPARITY];
+
+typedef struct {
+  const char *name;		// path in list file (not terminated)
+  int namelen;
+  bool ok;			// dump read
+  bool nokey;			// encrypted but no transport key
+  uint8_t blocks[10][8];
+} cred_record;
+
+typedef struct {
+  const char *start, *end;
+  DES_key_schedule *ks1, *ks2;
+  cred_record *batch;
+  bool threaded;		// running on its own thread
+  unsigned long records, bad, encrypted, nokey, unknown;
+  char out[CRED_OUTBUF];
+  size_t outlen;
+} cred_worker;
+
+static pthread_mutex_t Out_lock= PTHREAD_MUTEX_INITIALIZER;
+
+static int cred_parity64(uint64_t x)
+{
+  x ^= x >> 32;
+  x ^= x >> 16;
+  x ^= x >> 8;
+  x ^= x >> 4;
+  x ^= x >> 2;
+  x ^= x >> 1;
+  return (int) (x & 1);
+}
+
+// bit n (0 == first sent) of a Wiegand value bits long
+static uint64_t cred_bit(int bits, int n)
+{
+  return 1ULL << (bits - 1 - n);
+}
+
+static uint64_t cred_field(uint64_t value, int bits, int pos, int len)
+{
+  return (value >> (bits - pos - len)) & ((1ULL << len) - 1);
+}
+
+static void cred_build_masks(void)
+{
+  const cred_parity *p;
+  unsigned int f;
+  int i, j;
+
+  for(f= 0 ; f < CRED_FORMATS ; ++f)
+    for(i= 0 ; i < Formats[f].nparity ; ++i)
+      {
+      p= &Formats[f].parity[i];
+      Masks[f][i]= 0;
+      for(j= p->from ; j <= p->to ; ++j)
+        if(!p->skip3 || (j - p->from) % 3 != 2)
+          Masks[f][i] |= cred_bit(Formats[f].bits, j);
+      }
+}
+
+static bool cred_format_ok(unsigned int f, uint64_t value)
+{
+  const cred_parity *p;
+  int i;
+
+  for(i= 0 ; i < Formats[f].nparity ; ++i)
+    {
+    p= &Formats[f].parity[i];
+    if((cred_parity64(value & Masks[f][i]) ^ ((value & cred_bit(Formats[f].bits, p->pos)) != 0)) != p->odd)
+      return false;
+    }
+  return true;
+}
+
+static void cred_output(cred_worker *w, const char *line, size_t len)
+{
+  if(w->outlen + len > CRED_OUTBUF)
+    {
+    pthread_mutex_lock(&Out_lock);
+    fwrite(w->out, 1, w->outlen, stdout);
+    pthread_mutex_unlock(&Out_lock);
+    w->outlen= 0;
+    }
+  memcpy(&w->out[w->outlen], line, len);
+  w->outlen += len;
+}
+
+// read blocks 0 to 9 of dump, from the dump store if there is one - return false if OK
+static bool cred_read(cred_record *r)
+{
+  char path[PATH_MAX];
+  int fd;
+  ssize_t len;
+
+  if(store_active())
+    return store_get(r->name, r->namelen, (uint8_t *) r->blocks, sizeof(r->blocks)) < (int) sizeof(r->blocks);
+  if(r->namelen >= PATH_MAX)
+    return true;
+  memcpy(path, r->name, r->namelen);
+  path[r->namelen]= '\0';
+  if((fd= open(path, O_RDONLY)) < 0)
+    return true;
+  len= pread(fd, r->blocks, sizeof(r->blocks), 0);
+  close(fd);
+  return len != sizeof(r->blocks);
+}
+
+static void cred_decrypt(cred_worker *w, cred_record *r)
+{
+  uint8_t *config= r->blocks[6], plain[8];
+  int i;
+
+  if(!(config[7] & MASK_ENCRYPTED))
+    return;
+  ++w->encrypted;
+  if(!w->ks1)
+    {
+    r->nokey= true;
+    ++w->nokey;
+    return;
+    }
+  for(i= 7 ; i <= 9 ; i += 2)
+    {
+    if(config[7] & MASK_3DES)
+      DES_ecb2_encrypt((DES_cblock *) r->blocks[i], (DES_cblock *) plain, w->ks1, w->ks2, DES_DECRYPT);
+    else
+      DES_ecb_encrypt((DES_cblock *) r->blocks[i], (DES_cblock *) plain, w->ks1, DES_DECRYPT);
+    memcpy(r->blocks[i], plain, 8);
+    }
+}
+
+static void cred_decode(cred_worker *w, cred_record *r)
+{
+  char line[PATH_MAX * 2 + 256];
+  uint8_t *config= r->blocks[6];
+  uint64_t value= 0;
+  unsigned int f;
+  int i, n= 0, bits= 0, pinlen, first= -1, namelen= r->namelen < PATH_MAX ? r->namelen : PATH_MAX - 1;
+  const char *enc;
+
+  // quote path if it would break the CSV
+  if(memchr(r->name, ',', namelen) || memchr(r->name, '"', namelen))
+    {
+    line[n++]= '"';
+    for(i= 0 ; i < namelen ; ++i)
+      {
+      if(r->name[i] == '"')
+        line[n++]= '"';
+      line[n++]= r->name[i];
+      }
+    line[n++]= '"';
+    }
+  else
+    {
+    memcpy(line, r->name, namelen);
+    n= namelen;
+    }
+  if(!r->ok)
+    {
+    ++w->bad;
+    n += sprintf(&line[n], ",,,,UNREADABLE,,,,\n");
+    cred_output(w, line, n);
+    return;
+    }
+  ++w->records;
+  line[n++]= ',';
+  hex_encode(r->blocks[0], 8, &line[n]);
+  n += 16;
+  enc= !(config[7] & MASK_ENCRYPTED) ? "none" : config[7] & MASK_3DES ? "3DES" : "DES";
+  if(r->nokey)
+    {
+    n += sprintf(&line[n], ",%s,,NOKEY,,,,\n", enc);
+    cred_output(w, line, n);
+    return;
+    }
+
+  // Wiegand bits follow the highest set (sentinel) bit
+  for(i= 0 ; i < 8 ; ++i)
+    value= value << 8 | r->blocks[7][i];
+  for(bits= 63 ; bits >= 0 && !(value & (1ULL << bits)) ; --bits)
+    ;
+  if(bits > 0)
+    value &= (1ULL << bits) - 1;
+  else
+    bits= 0;
+  n += sprintf(&line[n], ",%s,%d,", enc, bits);
+  if(!bits)
+    n += sprintf(&line[n], "NONE");
+  else
+    for(f= 0 ; f < CRED_FORMATS ; ++f)
+      if(Formats[f].bits == bits && cred_format_ok(f, value))
+        {
+        n += sprintf(&line[n], "%s%s", first < 0 ? "" : "/", Formats[f].name);
+        if(first < 0)
+          first= (int) f;
+        }
+  if(bits && first < 0)
+    {
+    ++w->unknown;
+    n += sprintf(&line[n], "UNKNOWN");
+    }
+  line[n++]= ',';
+  if(first >= 0 && Formats[first].fc_len)
+    n += sprintf(&line[n], "%llu", (unsigned long long) cred_field(value, bits, Formats[first].fc_pos, Formats[first].fc_len));
+  line[n++]= ',';
+  if(first >= 0)
+    n += sprintf(&line[n], "%llu", (unsigned long long) cred_field(value, bits, Formats[first].cn_pos, Formats[first].cn_len));
+  line[n++]= ',';
+  pinlen= config[6] & MASK_PIN_LENGTH;
+  for(i= 0 ; i < pinlen && i < 16 ; ++i)
+    line[n++]= "0123456789abcdef"[(r->blocks[9][i / 2] >> (i & 1 ? 0 : 4)) & 0x0f];
+  line[n++]= ',';
+  for(i= 0 ; i < bits ; ++i)
+    line[n++]= value & cred_bit(bits, i) ? '1' : '0';
+  line[n++]= '\n';
+  cred_output(w, line, n);
+}
+
+static void cred_batch(cred_worker *w, int count)
+{
+  int i;
+
+  for(i= 0 ; i < count ; ++i)
+    if((w->batch[i].ok= !cred_read(&w->batch[i])))
+      cred_decrypt(w, &w->batch[i]);
+  for(i= 0 ; i < count ; ++i)
+    cred_decode(w, &w->batch[i]);
+}
+
+static void *cred_thread(void *arg)
+{
+  cred_worker *w= (cred_worker *) arg;
+  const char *p, *eol, *q;
+  int count= 0;
+
+  for(p= w->start ; p < w->end ; p= eol + 1)
+    {
+    if(!(eol= memchr(p, '\n', w->end - p)))
+      eol= w->end;
+    while(p < eol && isspace((unsigned char) *p))
+      ++p;
+    for(q= eol ; q > p && isspace((unsigned char) q[-1]) ; --q)
+      ;
+    if(q == p || *p == '#')
+      continue;
+    w->batch[count].name= p;
+    w->batch[count].namelen= (int) (q - p);
+    w->batch[count].nokey= false;
+    if(++count == CRED_BATCH)
+      {
+      cred_batch(w, count);
+      count= 0;
+      }
+    }
+  cred_batch(w, count);
+  pthread_mutex_lock(&Out_lock);
+  fwrite(w->out, 1, w->outlen, stdout);
+  pthread_mutex_unlock(&Out_lock);
+  return NULL;
+}
+
+// decode credentials from every dump in listfile - return number of unreadable dumps or -1 if failed
+// ks1 and ks2 are the transport key schedules, or NULL if we don't have it
+int credential_decode(char *listfile, DES_key_schedule *ks1, DES_key_schedule *ks2)
+{
+  cred_worker *workers;
+  pthread_t *threads;
+  struct stat st;
+  const char *map, *p;
+  unsigned long records= 0, bad= 0, encrypted= 0, nokey= 0, unknown= 0;
+  int fd, i, nthreads;
+
+  if((fd= open(listfile, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    return -1;
+  if(!st.st_size)
+    {
+    close(fd);
+    return 0;
+    }
+  map= mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return -1;
+  posix_madvise((void *) map, st.st_size, POSIX_MADV_SEQUENTIAL);
+  cred_build_masks();
+
+  if((nthreads= (int) sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    nthreads= 1;
+  workers= calloc(nthreads, sizeof(cred_worker));
+  threads= calloc(nthreads, sizeof(pthread_t));
+  if(!workers || !threads)
+    return -1;
+
+  // split at line boundaries
+  for(i= 0, p= map ; i < nthreads ; ++i)
+    {
+    workers[i].ks1= ks1;
+    workers[i].ks2= ks2;
+    workers[i].start= p;
+    if(i == nthreads - 1)
+      p= map + st.st_size;
+    else
+      {
+      p= map + st.st_size / nthreads * (i + 1);
+      if(p < workers[i].start)
+        p= workers[i].start;
+      while(p < map + st.st_size && *p != '\n')
+        ++p;
+      }
+    workers[i].end= p;
+    if(!(workers[i].batch= calloc(CRED_BATCH, sizeof(cred_record))))
+      return -1;
+    }
+
+  printf("file,csn,encryption,bits,format,facility,card,pin,wiegand\n");
+  fflush(stdout);
+  for(i= 0 ; i < nthreads ; ++i)
+    if(!(workers[i].threaded= !pthread_create(&threads[i], NULL, cred_thread, &workers[i])))
+      cred_thread(&workers[i]);
+  for(i= 0 ; i < nthreads ; ++i)
+    if(workers[i].threaded)
+      pthread_join(threads[i], NULL);
+
+  for(i= 0 ; i < nthreads ; ++i)
+    {
+    records += workers[i].records;
+    bad += workers[i].bad;
+    encrypted += workers[i].encrypted;
+    nokey += workers[i].nokey;
+    unknown += workers[i].unknown;
+    free(workers[i].batch);
+    }
+  fflush(stdout);
+  fprintf(stderr, "\n  %lu dumps, %lu unreadable, %lu encrypted, %lu no transport key, %lu unknown format (%d threads)\n", records, bad, encrypted, nokey, unknown, nthreads);
+  munmap((void *) map, st.st_size);
+  free(workers);
+  free(threads);
+  return (int) (bad > 0x7fffffff ? 0x7fffffff : bad);
+}
@@ -38,6 +38,10 @@
  * @file iclass.c
  * @brief provide samples structs and functions to manipulate HID iClass (Picopass) tags using libnfc
  */
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
 #include "iclass.h"
 
 // loclass includes
@@ -46,11 +50,20 @@
 #include "cipher.h"
 #include "elite_crack.h"
 
+#include "trace.h"
+#include "mac.h"
+#include "keycache.h"
+#include "metrics.h"
+#include "prefetch.h"
+#include "keyservice.h"
+
 // system
 #include <stdio.h> 
 #include <string.h>
+#include <strings.h>
 #include <nfc/nfc.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 static const nfc_modulation nmiClass = {
   .nmt = NMT_ISO14443BICLASS,
@@ -62,14 +75,35 @@ static const nfc_modulation nmTypeB = {
   .nbr = NBR_106,
 };
 
-// global iclass diversified key
-static unsigned char Div_key[8];
-static unsigned char KeyType;
-static unsigned char Uid[8];
+// state of the card on one reader - a clone has two readers going at once
+typedef struct {
+  nfc_device *pnd;
+  bool used;
+  unsigned char div_key[8]; // diversified key of last authentication
+  iclass_mac_ctx key_mac; // cipher loaded with div_key, copied for each MAC
+  unsigned char keytype;
+  int service_key; // KEYSERVICE_KEY_* authenticated with, if the key service does the MACs
+  unsigned char uid[8];
+  iclass_card_info card_info; // header of selected card, for write lock checks
+  bool no_read4; // reader or card doesn't do READ4
+  int book; // book of a 32K card selected with PAGESEL - cards come up in book 0
+  iclass_timing timing;
+} iclass_session;
+
+static iclass_session Sessions[ICLASS_MAXREADERS];
+static pthread_mutex_t Session_lock= PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t Divkey_lock= PTHREAD_MUTEX_INITIALIZER;
+static bool Poll_ready= false; // reader left in iClass mode by a full select
+static bool Poll_have= false; // Poll_acsn is the card seen by the last poll
+static uint8_t Poll_acsn[8];
 bool Elite_Override= false;
+bool Key_Diversified= false; // re-key data is already diversified (e.g. from a pre-staged image)
+bool RF_Quiet= false; // don't report libnfc errors (calibration provokes them)
+// what readers got before timing profiles
+const iclass_timing Default_timing= { -1, -1, true, true };
 
-// iclass config card descriptors
-char * Config_cards[]=  {
+// iclass config card descriptors - more can be added at run time (see iclass_add_config)
+char * Config_cards[MAX_CONFIGS + 1]=  {
                         "AV1",
                         "AV2",
                         "AV3",
@@ -86,7 +120,7 @@ char * Config_cards[]=  {
                         NULL
                         };
 
-char * Config_types[]=  {
+char * Config_types[MAX_CONFIGS + 1]=  {
                         "Audio/Visual #1 - Beep ON, LED Off, Flash GREEN on read",
                         "Audio/Visual #2 - Beep ON, LED RED, Host must flash GREEN",
                         "Audio/Visual #3 - Beep ON, LED Off, Host must flash RED and/or GREEN",
@@ -103,7 +137,7 @@ char * Config_types[]=  {
                         NULL
                         };
 
-uint8_t * Config_block6[]= {
+uint8_t * Config_block6[MAX_CONFIGS + 1]= {
                         "\x00\x00\x00\x00\x00\x00\xBF\x18",
                         "\x00\x00\x00\x00\x00\x00\x87\x18",
                         "\x00\x00\x00\x00\x00\x00\xBF\x18",
@@ -120,7 +154,7 @@ uint8_t * Config_block6[]= {
                         NULL
                         };
 
-uint8_t * Config_block7[]= {
+uint8_t * Config_block7[MAX_CONFIGS + 1]= {
                         "\xAC\x00\xA8\x8F\xA7\x80\xA9\x01",
                         "\xAC\x00\xA8\x1F\xA7\x80\xA9\x01",
                         "\xAC\x00\xA8\x0F\xA9\x03\xA7\x80",
@@ -162,6 +196,17 @@ uint8_t Card_App2_Limit[]= {
 			0xff,
                         };
 
+uint8_t Card_Books[]= {
+			1,
+			2,
+			1,
+			1,
+			1,
+			1,
+			1,
+			2,
+                        };
+
 char * Coding[]=	{
 			"ISO 14443 type B only",			// 00
 			"ISO 14443-2 Type B / ISO 15693",		// 01
@@ -179,66 +224,337 @@ void iclass_add_crc(uint8_t *buffer, uint8_t length)
   buffer[length + 1]= (unsigned char) (crc & 0x00ff);
 }
 
+// iClass CRC is CRC-16/CCITT (reflected) with preset 0xE012, sent LSB first
+// the result is byte swapped, so MSB here is the first byte on the air
 unsigned int iclass_crc16(unsigned char *data_p, unsigned char length)
 {
         unsigned char i;
-        unsigned int data;
-        unsigned int crc = 0xffff;
+        unsigned int crc = 0xe012;
 
-        if (length == 0)
-                return (~crc);
-
-        do
+        while (length--)
                 {
-                for (i=0, data=(unsigned int)0xff & *data_p++; i < 8; i++, data >>= 1)
+                crc ^= (unsigned int)0xff & *data_p++;
+                for (i= 0; i < 8; i++)
                         {
-                        if ((crc & 0x0001) ^ (data & 0x0001))
+                        if (crc & 0x0001)
                                 crc = (crc >> 1) ^ 0x8408;
                         else  crc >>= 1;
+                        }
                 }
-                }
-        while (--length);
+        return (((crc << 8) & 0xff00) | (crc >> 8 & 0xff));
+}
 
-        crc = ~crc;
-        data = crc;
-        crc = (crc << 8) | (data >> 8 & 0xff);
-        crc = crc ^ 0xBC3;
-        return (crc);
+// check CRC that follows length bytes of card response - return true if OK
+bool iclass_crc_ok(uint8_t *buffer, uint8_t length)
+{
+  uint16_t crc;
+
+  crc= iclass_crc16(buffer, length);
+  return buffer[length] == ((crc >> 8) & 0x00ff) && buffer[length + 1] == (crc & 0x00ff);
 }
 
-bool
-iclass_select(nfc_device *pnd, nfc_target *nt)
+// latency histogram for frame tx
+static metric_histogram iclass_rf_metric(const uint8_t *tx, size_t txlen)
+{
+  switch(tx[0])
+    {
+    case ICLASS_ACTIVATE_ALL:
+      return METRIC_RF_ACTALL;
+    case ICLASS_SELECT:
+      // same command code - IDENTIFY has no block number
+      return txlen == 1 ? METRIC_RF_IDENTIFY : METRIC_RF_READ;
+    case ICLASS_ANTICOL:
+      return METRIC_RF_ANTICOL;
+    case KEYTYPE_DEBIT:
+    case KEYTYPE_CREDIT:
+      return METRIC_RF_READCHECK;
+    case ICLASS_CHECK:
+      return METRIC_RF_CHECK;
+    case ICLASS_READ4:
+      return METRIC_RF_READ4;
+    case ICLASS_UPDATE:
+      return METRIC_RF_UPDATE;
+    case ICLASS_HALT:
+      return METRIC_RF_HALT;
+    default:
+      return METRIC_RF_OTHER;
+    }
+}
+
+// state for reader pnd - a reader gets its session on first use
+static iclass_session *iclass_session_get(nfc_device *pnd)
+{
+  int i;
+
+  for(i= 0 ; i < ICLASS_MAXREADERS ; ++i)
+    if(__atomic_load_n(&Sessions[i].used, __ATOMIC_ACQUIRE) && Sessions[i].pnd == pnd)
+      return &Sessions[i];
+  pthread_mutex_lock(&Session_lock);
+  for(i= 0 ; i < ICLASS_MAXREADERS ; ++i)
+    if(!Sessions[i].used || Sessions[i].pnd == pnd)
+      break;
+  // never more readers open than sessions
+  if(i == ICLASS_MAXREADERS)
+    abort();
+  if(!Sessions[i].used)
+    {
+    Sessions[i].pnd= pnd;
+    Sessions[i].timing= Default_timing;
+    __atomic_store_n(&Sessions[i].used, true, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock(&Session_lock);
+  return &Sessions[i];
+}
+
+// forget the last card on pnd - a newly selected card hasn't had its header read
+static void iclass_new_card(nfc_device *pnd)
+{
+  iclass_session *s= iclass_session_get(pnd);
+
+  s->card_info.valid= false;
+  s->book= 0;
+}
+
+// use timing for reader pnd from now on
+void iclass_set_timing(nfc_device *pnd, const iclass_timing *timing)
+{
+  iclass_session *s= iclass_session_get(pnd);
+
+  s->timing= *timing;
+  s->no_read4= !timing->read4;
+}
+
+// all card traffic goes through here so it can be traced or replayed
+// quiet is for probes where no answer is a normal result
+// timeout -1 is the reader's timing profile timeout
+static int iclass_exchange(nfc_device *pnd, const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen, int timeout, bool quiet)
 {
+  uint64_t start;
+  int ret;
+
+  if(trace_replaying())
+    return trace_replay_transceive(tx, txlen, rx, rxlen);
+  if(timeout == -1)
+    timeout= iclass_session_get(pnd)->timing.timeout;
+  trace_record(TRACE_TX, (int) txlen, tx, txlen);
+  start= metrics_now();
+  ret= nfc_initiator_transceive_bytes(pnd, tx, txlen, rx, rxlen, timeout);
+  metrics_observe(iclass_rf_metric(tx, txlen), start);
+  if(ret < 0 && !quiet && !RF_Quiet)
+    {
+    metrics_inc(METRIC_RF_ERRORS);
+    nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+    }
+  trace_record(TRACE_RX, ret, rx, ret > 0 ? ret : 0);
+  return ret;
+}
+
+static int iclass_transceive(nfc_device *pnd, const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen, int timeout)
+{
+  return iclass_exchange(pnd, tx, txlen, rx, rxlen, timeout, false);
+}
+
+// return libnfc result of iClass select
+static int iclass_select_target(nfc_device *pnd, nfc_target *nt)
+{
+  int ret;
+
   // Let the device only try once to find a tag
-  if (nfc_device_set_property_bool(pnd, NP_INFINITE_SELECT, false) < 0)
-    return false;
+  if ((ret= nfc_device_set_property_bool(pnd, NP_INFINITE_SELECT, false)) < 0)
+    return ret;
 
   // set up for type B
-  if (nfc_initiator_select_passive_target(pnd, nmTypeB, NULL, 0, nt) < 0)
-    return false;
+  if (iclass_session_get(pnd)->timing.typeb_setup && (ret= nfc_initiator_select_passive_target(pnd, nmTypeB, NULL, 0, nt)) < 0)
+    return ret;
 
   // Try to find an iClass
-  if (nfc_initiator_select_passive_target(pnd, nmiClass, NULL, 0, nt) <= 0)
-    return false;
+  return nfc_initiator_select_passive_target(pnd, nmiClass, NULL, 0, nt);
+}
+
+bool
+iclass_select(nfc_device *pnd, nfc_target *nt)
+{
+  uint64_t start;
+  int ret;
+
+  iclass_new_card(pnd);
+  if(trace_replaying())
+    return trace_replay_select(nt->nti.nhi.abtUID) > 0;
+
+  start= metrics_now();
+  ret= iclass_select_target(pnd, nt);
+  metrics_observe(METRIC_RF_SELECT, start);
+  trace_record(TRACE_SELECT, ret, nt->nti.nhi.abtUID, ret > 0 ? 8 : 0);
+  return ret > 0;
+}
+
+// wake every card in the field that isn't halted
+static void iclass_actall(nfc_device *pnd)
+{
+  uint8_t command[1], tmp[2];
+
+  // answered with SOF only, so there's nothing to check
+  command[0]= ICLASS_ACTIVATE_ALL;
+  iclass_exchange(pnd, command, 1, tmp, sizeof(tmp), -1, true);
+}
+
+// ACTALL + IDENTIFY - get ACSN of a card in the field
+// return false if OK or true if no card answered
+static bool iclass_identify(nfc_device *pnd, uint8_t *acsn)
+{
+  uint8_t command[1], tmp[10];
+
+  iclass_actall(pnd);
+  command[0]= ICLASS_SELECT;
+  // two cards answering at once will garble the CRC
+  if(iclass_exchange(pnd, command, 1, tmp, sizeof(tmp), -1, true) != 10 || !iclass_crc_ok(tmp, 8))
+    return true;
+  memcpy(acsn, tmp, 8);
+  return false;
+}
+
+// SELECT card by ACSN - any other active card drops back to idle
+// return false if OK or true if failed
+static bool iclass_anticol(nfc_device *pnd, uint8_t *acsn, uint8_t *uid)
+{
+  uint8_t command[9], tmp[10];
+  int i;
+
+  command[0]= ICLASS_ANTICOL;
+  memcpy(&command[1], acsn, 8);
+  if(iclass_exchange(pnd, command, 9, tmp, sizeof(tmp), -1, true) != 10 || !iclass_crc_ok(tmp, 8))
+    return true;
+  // libnfc order
+  for(i= 0 ; i < 8 ; ++i)
+    uid[i]= tmp[7 - i];
+  return false;
+}
+
+// put selected card to sleep until it leaves the field
+void iclass_halt(nfc_device *pnd)
+{
+  uint8_t command[1], tmp[2];
+
+  command[0]= ICLASS_HALT;
+  iclass_exchange(pnd, command, 1, tmp, sizeof(tmp), -1, true);
+}
+
+// find every card in the field, up to max - return number found
+//
+// the reader can't resolve bit collisions for us, so each pass lets whichever
+// card answers IDENTIFY cleanly (good CRC) win, SELECTs it
+// and HALTs it so it stays quiet for the next pass. When nobody is left the
+// field is cycled so the halted cards come back for iclass_select_tag().
+int iclass_inventory(nfc_device *pnd, iclass_tag *tags, int max)
+{
+  uint8_t acsn[8], uid[8];
+  nfc_target nt;
+  int n= 0, misses= 0, i;
+
+  // libnfc select sets the reader up for iClass - it will often fail on a
+  // stack of cards, but that doesn't matter as we do our own anticollision
+  iclass_select(pnd, &nt);
+  while(n < max && misses < ICLASS_INVENTORY_RETRIES)
+    {
+    if(iclass_identify(pnd, acsn) || iclass_anticol(pnd, acsn, uid))
+      {
+      ++misses;
+      continue;
+      }
+    misses= 0;
+    for(i= 0 ; i < n ; ++i)
+      if(!memcmp(tags[i].uid, uid, 8))
+        break;
+    if(i == n)
+      {
+      memcpy(tags[n].acsn, acsn, 8);
+      memcpy(tags[n].uid, uid, 8);
+      ++n;
+      }
+    iclass_halt(pnd);
+    }
+  if(!trace_replaying())
+    {
+    nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, false);
+    nfc_device_set_property_bool(pnd, NP_ACTIVATE_FIELD, true);
+    }
+  return n;
+}
+
+// make tag the selected card and fill in nt as iclass_select() would
+// return TRUE if selected or FALSE if failed
+bool iclass_select_tag(nfc_device *pnd, iclass_tag *tag, nfc_target *nt)
+{
+  uint8_t uid[8];
 
+  iclass_new_card(pnd);
+  // libnfc select puts the reader back in iClass mode (and selects any old card)
+  iclass_select(pnd, nt);
+  iclass_actall(pnd);
+  if(iclass_anticol(pnd, tag->acsn, uid) || memcmp(uid, tag->uid, 8))
+    return false;
+  memcpy(nt->nti.nhi.abtUID, uid, 8);
   return true;
 }
 
+// cheap card arrival check for tight polling loops
+//
+// iclass_select() sets the reader up for type B and then iClass on every call.
+// Here that's done once, after which a poll is just ACTALL + IDENTIFY, and the
+// ACSN is compared with the last card seen to spot the same card still sitting
+// there without selecting it again. A new card gets a SELECT so it can be used
+// straight away.
+int iclass_poll(nfc_device *pnd, nfc_target *nt)
+{
+  uint8_t acsn[8], uid[8];
+
+  if(!Poll_ready)
+    {
+    if(!iclass_select(pnd, nt))
+      return ICLASS_POLL_NONE;
+    Poll_ready= true;
+    }
+  if(iclass_identify(pnd, acsn))
+    {
+    Poll_have= false;
+    return ICLASS_POLL_NONE;
+    }
+  if(Poll_have && !memcmp(acsn, Poll_acsn, 8))
+    return ICLASS_POLL_SAME;
+  if(iclass_anticol(pnd, acsn, uid))
+    {
+    Poll_have= false;
+    return ICLASS_POLL_NONE;
+    }
+  memcpy(Poll_acsn, acsn, 8);
+  Poll_have= true;
+  iclass_new_card(pnd);
+  memcpy(nt->nti.nhi.abtUID, uid, 8);
+  return ICLASS_POLL_NEW;
+}
+
 // return TRUE if auth OK or FALSE if failed
 bool
 iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bool diversify, bool debit_key)
 {
-  static uint8_t     update[14], data[10], nonce[16];
-  static uint8_t     tmac[4], challenge[16], confirm[10];
-  static uint8_t  mac[4], uid[8];
+  iclass_session *s= iclass_session_get(pnd);
+  uint8_t     update[14], data[10], nonce[16];
+  uint8_t     tmac[4], challenge[16], confirm[10];
+  uint8_t  mac[4], uid[8], macs[8];
+  iclass_mac_ctx  ctx;
+  uint64_t start;
   int     i;
+  bool remote= keyservice_active();
 
-  // calculate diversified key
-  if(diversify)
+  // iClass stores uid LSB first but libnfc reverses it
+  for(i= 0 ; i < 8 ; ++i)
+    uid[i]= nt.nti.nhi.abtUID[7 - i];
+
+  // calculate diversified key - the key service keeps it to itself
+  if(remote)
+    s->service_key= debit_key ? KEYSERVICE_KEY_DEBIT : KEYSERVICE_KEY_CREDIT;
+  else if(diversify)
     {
-    // iClass stores uid LSB first but libnfc reverses it
-    for(i= 0 ; i < 8 ; ++i)
-      uid[i]= nt.nti.nhi.abtUID[7 - i];
 #if DEBUG
     printf("UID:");
     for(i= 0 ; i < 8 ; ++i)
@@ -249,33 +565,31 @@ iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bo
       printf("%02x", (unsigned char) key[i]);
     printf("\n");
 #endif
-    if(elite)
-      divkey_elite((uint8_t *) uid, (uint8_t *) key, (uint8_t *) Div_key);
-    else
-      diversifyKey((uint8_t *) uid, (uint8_t *) key, (uint8_t *) Div_key);
+    iclass_divkey((uint8_t *) uid, (uint8_t *) key, elite, (uint8_t *) s->div_key);
     }
   else
-    memcpy(Div_key, key, 8);
+    memcpy(s->div_key, key, 8);
 #if DEBUG
   printf("Div KEY:");
   for(i= 0 ; i < 8 ; ++i)
-    printf("%02x", (unsigned char) Div_key[i]);
+    printf("%02x", (unsigned char) s->div_key[i]);
   printf("\n");
 #endif
+  if(!remote)
+    iclass_mac_init(&s->key_mac, s->div_key);
 
   // save for re-keying
-  memcpy(Uid, uid, 8);
+  memcpy(s->uid, uid, 8);
 
   // get card challenge (block 2)
   // 88 is 'debit key'
   // 18 is 'credit key'
   if(debit_key)
-    data[0]= KeyType= (unsigned char) KEYTYPE_DEBIT;
+    data[0]= s->keytype= (unsigned char) KEYTYPE_DEBIT;
   else
-    data[0]= KeyType= (unsigned char) KEYTYPE_CREDIT;
+    data[0]= s->keytype= (unsigned char) KEYTYPE_CREDIT;
   data[1]= 0x02; // block 2
-  if (nfc_initiator_transceive_bytes(pnd, (uint8_t *) data, 2, (uint8_t *)challenge, 8, -1) < 0) {
-    nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+  if (iclass_transceive(pnd, (uint8_t *) data, 2, (uint8_t *)challenge, 8, -1) < 0) {
     return false;
   }
 #if DEBUG
@@ -285,7 +599,23 @@ iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bo
   printf("\n");
 #endif
 
-  doReaderMAC((uint8_t *) challenge, (uint8_t *) Div_key, (uint8_t *) mac);
+  // nR = 0 - keep the cipher state after the reader MAC, it runs straight on into the TMAC
+  memset(&challenge[8], 0x00, 4);
+  start= metrics_now();
+  if(remote)
+    {
+    // service works out the card's answer as well
+    if(keyservice_auth(s->service_key, uid, challenge, macs))
+      return false;
+    memcpy(mac, macs, 4);
+    }
+  else
+    {
+    ctx= s->key_mac;
+    iclass_mac_update(&ctx, challenge, 12);
+    iclass_mac_final(&ctx, mac);
+    }
+  metrics_observe(METRIC_CRYPTO_MAC, start);
 
 #if DEBUG
   printf("MAC: ");
@@ -296,7 +626,7 @@ iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bo
 
   // send NR
   // nR = 0, MAC(k1, cC · nR)
-  nonce[0]= 0x05; // iclass AUTH
+  nonce[0]= ICLASS_CHECK; // iclass AUTH
   memset(&nonce[1], 0x00, 4); // our challenge is all 00
   memcpy(&nonce[5], mac, 4); // plus MAC
 
@@ -306,8 +636,7 @@ iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bo
     printf("%02X", (unsigned char) nonce[i]);
   printf("\n");
 #endif
-  if (nfc_initiator_transceive_bytes(pnd, (uint8_t *)nonce, 9, (uint8_t *)tmac, 4, -1) < 0) {
-    nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+  if (iclass_transceive(pnd, (uint8_t *)nonce, 9, (uint8_t *)tmac, 4, -1) < 0) {
     return false;
   }
 
@@ -319,10 +648,11 @@ iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bo
 #endif
 
   // TMAC should be MAC(k1, cC · nR · 0 32)
-  // calculate that and compare
-  memcpy(nonce, challenge, 8);
-  memset(&challenge[8], 0x00, 8); // both tag and reader are all 00
-  doMAC_N((uint8_t *) challenge, (uint8_t) 16, (uint8_t *) Div_key, (uint8_t *) mac);
+  // which is the next 32 bits from the context used for the reader MAC
+  if(remote)
+    memcpy(mac, &macs[4], 4);
+  else
+    iclass_mac_final(&ctx, mac);
 
 #if DEBUG
   printf("(MAC): ");
@@ -349,7 +679,9 @@ iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bo
      if(update[i] != 0xff)
        update[i]--;
    // calculate mac
-   doMAC_N((uint8_t *)&update[1], (uint8_t) 9, (uint8_t *) Div_key, (uint8_t *) mac);
+   ctx= s->key_mac;
+   iclass_mac_update(&ctx, &update[1], 9);
+   iclass_mac_final(&ctx, mac);
    memcpy(&update[10], mac, 4);
 
 #if DEBUG
@@ -359,8 +691,7 @@ iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bo
    printf("\n");
 #endif
 
-  if (nfc_initiator_transceive_bytes(pnd, (uint8_t *) update, 14, (uint8_t *)confirm, 10, 30000) < 0) {
-    nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+  if (iclass_transceive(pnd, (uint8_t *) update, 14, (uint8_t *)confirm, 10, 30000) < 0) {
     return false;
   }
 
@@ -377,102 +708,265 @@ iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bo
 // return false if read OK or true if failed
 bool iclass_read(nfc_device *pnd, uint8_t block, uint8_t *buff)
 {
-  uint8_t command[4], tmp[10], error;
+  int budget= ICLASS_READ_RETRIES;
+
+  return iclass_read_checked(pnd, block, buff, &budget) < 0;
+}
+
+// read block and check CRC, re-reading on a bad CRC while budget lasts
+// return number of re-reads needed, or -1 if no good copy (buff then holds the last one read)
+int iclass_read_checked(nfc_device *pnd, uint8_t block, uint8_t *buff, int *budget)
+{
+  uint8_t command[4], tmp[10];
+  int retries;
 
   command[0]= ICLASS_READ_BLOCK;
   command[1]= block;
   iclass_add_crc(command, 2);
-  if (nfc_initiator_transceive_bytes(pnd, (uint8_t *) command, 4, tmp, 10, -1) < 0) {
-    nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+  for(retries= 0 ; ; ++retries)
+    {
+    if (iclass_transceive(pnd, (uint8_t *) command, 4, tmp, 10, -1) == 10) {
+      memcpy(buff, tmp, 8);
+      if(iclass_crc_ok(tmp, 8))
+        return retries;
+    }
+    if(retries >= ICLASS_READ_RETRIES || *budget <= 0)
+      {
+      metrics_inc(METRIC_READ_FAILURES);
+      return -1;
+      }
+    --*budget;
+    metrics_inc(METRIC_READ_RETRIES);
+    }
+}
+
+// read 4 consecutive blocks into buff[32]
+// return false if read OK or true if failed
+bool iclass_read4(nfc_device *pnd, uint8_t block, uint8_t *buff)
+{
+  uint8_t command[4], tmp[34];
+
+  command[0]= ICLASS_READ4;
+  command[1]= block;
+  iclass_add_crc(command, 2);
+  if (iclass_exchange(pnd, (uint8_t *) command, 4, tmp, 34, -1, true) != 34) {
+    iclass_session_get(pnd)->no_read4= true;
     return true;
   }
-  // todo: check CRC
-  memcpy(buff, tmp, 8);
-  return false;
+  memcpy(buff, tmp, 32);
+  return !iclass_crc_ok(tmp, 32);
 }
 
-// return false if write OK or true if failed
-bool iclass_write(nfc_device *pnd, uint8_t blockno, uint8_t *data)
+// can the reader and card on pnd be asked for READ4?
+bool iclass_has_read4(nfc_device *pnd)
 {
-  int i;
+  return !iclass_session_get(pnd)->no_read4;
+}
 
-  static unsigned char update[16], mac[4], tmp[10], newdata[8];
-  char error;
+// build complete UPDATE frame (command, block, data, MAC, CRC) for the card on pnd in frame[16]
+// return false if OK or true if block can't be written with current key
+bool iclass_update_frame(nfc_device *pnd, uint8_t blockno, uint8_t *data, uint8_t *frame)
+{
+  iclass_session *s= iclass_session_get(pnd);
+  uint8_t tmp[8], newdata[8];
+  iclass_mac_ctx ctx;
+  uint64_t start;
 
   // special case - write to block 3 or 4 is a re-key (normally to Elite)
   // which can only be done if we know the current key
-  if(blockno == 3 && KeyType != KEYTYPE_DEBIT)
+  if(blockno == 3 && s->keytype != KEYTYPE_DEBIT)
+          return true;
+  if(blockno == 4 && s->keytype != KEYTYPE_CREDIT)
           return true;
-  if(blockno == 4 && KeyType != KEYTYPE_CREDIT)
+  // don't waste RF time on blocks the card will refuse
+  if(iclass_block_locked(&s->card_info, blockno))
           return true;
+  frame[0]= ICLASS_UPDATE;
+  frame[1]= blockno;
+  // key service holds the keys - the new key is its REKEY key and data is ignored
+  if(keyservice_active())
+          {
+          start= metrics_now();
+          if(blockno == 3 || blockno == 4)
+                  {
+                  if(keyservice_rekey(s->service_key, s->uid, blockno, &frame[2]))
+                          return true;
+                  }
+          else
+                  {
+                  memcpy(&frame[2], data, 8);
+                  if(keyservice_update(s->service_key, s->uid, &frame[1], &frame[10]))
+                          return true;
+                  }
+          metrics_observe(METRIC_CRYPTO_MAC, start);
+          iclass_add_crc(frame, 14);
+          return false;
+          }
   if(blockno == 3 || blockno == 4)
           {
           // calculate new diversified key (need override to allow re-key back to normal!)
-          if(!Elite_Override)
-                  divkey_elite((uint8_t *) Uid, (uint8_t *) data, (uint8_t *) tmp);
+          if(Key_Diversified)
+                  memcpy(tmp, data, 8);
           else
-                  diversifyKey((uint8_t *) Uid, (uint8_t *) data, (uint8_t *) tmp);
+                  iclass_divkey((uint8_t *) s->uid, (uint8_t *) data, !Elite_Override, (uint8_t *) tmp);
           // xor with current key
-          xorstring(newdata, tmp, Div_key, 8);
+          xorstring(newdata, tmp, s->div_key, 8);
 
 #if DEBUG
+          int i;
           printf("\nWRITING NEW KEY: ");
           for(i= 0 ; i < 8 ; ++i)
             printf("%02X", newdata[i]);
           printf("\n");
-#endif 
+#endif
           }
 
-  update[0]= ICLASS_UPDATE;
-  update[1]= blockno;
   if(blockno == 3 || blockno == 4)
-          memcpy(&update[2], newdata, 8);
+          memcpy(&frame[2], newdata, 8);
   else
-          memcpy(&update[2], data, 8);
-  doMAC_N((uint8_t *) &update[1], (uint8_t) 9, (uint8_t *) Div_key, (uint8_t *) mac);
-  memcpy(&update[10], mac, 4);
-  iclass_add_crc(update, 14);
-  if (nfc_initiator_transceive_bytes(pnd, (uint8_t *) update, 16, tmp, 10, -1) < 0) {
-    nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+          memcpy(&frame[2], data, 8);
+  start= metrics_now();
+  ctx= s->key_mac;
+  iclass_mac_update(&ctx, &frame[1], 9);
+  iclass_mac_final(&ctx, &frame[10]);
+  metrics_observe(METRIC_CRYPTO_MAC, start);
+  iclass_add_crc(frame, 14);
+  return false;
+}
+
+// build UPDATE frame for a card in personalisation mode in frame[16]
+// the card checks no MAC and stores key blocks as they are, so keys must already be diversified
+void iclass_personalise_frame(uint8_t blockno, uint8_t *data, uint8_t *frame)
+{
+  frame[0]= ICLASS_UPDATE;
+  frame[1]= blockno;
+  memcpy(&frame[2], data, 8);
+  memset(&frame[10], 0x00, 4);
+  iclass_add_crc(frame, 14);
+}
+
+// send UPDATE frame built by iclass_update_frame() and check echo against data
+// return false if write OK or true if failed
+bool iclass_write_frame(nfc_device *pnd, uint8_t *frame, uint8_t *data)
+{
+  uint8_t tmp[10];
+
+  // EEPROM write - some readers need longer
+  if (iclass_transceive(pnd, frame, 16, tmp, 10, iclass_session_get(pnd)->timing.update_timeout) < 0) {
+    metrics_inc(METRIC_WRITE_FAILURES);
     return true;
   }
 
   // verify can't ever see result of key block writes
-  if(blockno == 3 || blockno == 4)
+  if(frame[1] == 3 || frame[1] == 4)
           return false;
-  return (memcmp(data, tmp, 8) != 0);
+  if(memcmp(data, tmp, 8))
+    {
+    metrics_inc(METRIC_WRITE_FAILURES);
+    return true;
+    }
+  return false;
 }
 
+// return false if write OK or true if failed
+bool iclass_write(nfc_device *pnd, uint8_t blockno, uint8_t *data)
+{
+  uint8_t update[16];
+
+  if(iclass_update_frame(pnd, blockno, data, update))
+    return true;
+  return iclass_write_frame(pnd, update, data);
+}
 
-// print card details and return number of blocks in application 1 (debit key protected)
-uint8_t iclass_print_type(nfc_device *pnd, int *app2_limit)
+// read blocks 0 to 5 in as few exchanges as possible and decode them
+// return false if read OK or true if failed (info limits are then 0xff)
+bool iclass_read_info(nfc_device *pnd, iclass_card_info *info)
 {
-  uint8_t type, data[8];
-  int i, app1_limit;
+  iclass_session *s= iclass_session_get(pnd);
+  uint8_t *data= info->header[1];
+  int i;
 
-  if(iclass_read(pnd, 1, data))
-    return 0;
+  memset(info, 0x00, sizeof(*info));
+  info->app1_limit= info->app2_limit= 0xff;
 
-  printf("\n");
+  // READ4 0 + READ4 2 gets the lot, otherwise (or on a bad CRC) one block at a time
+  if(s->no_read4 || iclass_read4(pnd, 0, info->header[0]) || iclass_read4(pnd, 2, info->header[2]))
+    {
+    for(i= 0 ; i < 6 ; ++i)
+      if(iclass_read(pnd, i, info->header[i]))
+        {
+        s->card_info= *info;
+        return true;
+        }
+    }
 
   // get 3 config bits
-  type= (data[4] & 0x10) >> 2;
-  type |= (data[5] & 0x80) >> 6;
-  type |= (data[5] & 0x20) >> 5;
-  printf("  %s\n", Card_Types[(int) type]);
-  app1_limit= (int) data[0] - 5; // minus header blocks
-  *app2_limit= Card_App2_Limit[(int) type];
-
-  printf("  %s Mode\n", data[7] & 0x80 ? "Personalisation" : "Application");
-  printf("  Keys %sLocked\n", data[7] & 0x08 ? "Un" : "");
-  printf("  APP1 Blocks: %d\n", app1_limit); 
-  printf("  APP2 Blocks: %d\n", (*app2_limit - app1_limit) - 5); // minus app1 and header
+  info->type= (data[4] & 0x10) >> 2;
+  info->type |= (data[5] & 0x80) >> 6;
+  info->type |= (data[5] & 0x20) >> 5;
+  info->app1_limit= data[0];
+  info->app2_limit= Card_App2_Limit[(int) info->type];
+  info->books= Card_Books[(int) info->type];
+  info->book= s->book;
+  info->personalisation= data[7] & FUSE_PERSONALISATION;
+  info->keys_locked= !(data[7] & FUSE_KEYS_UNLOCKED);
+  info->write_lock= data[3];
+  info->valid= true;
+  s->card_info= *info;
+  return false;
+}
+
+// switch a 32K card to the other 16K book without selecting it again
+// the card drops its authentication, so read the book's header and authenticate again
+// return false if OK or true if failed
+bool iclass_select_book(nfc_device *pnd, uint8_t book)
+{
+  iclass_session *s= iclass_session_get(pnd);
+  uint8_t command[4], tmp[10];
+
+  s->card_info.valid= false;
+  command[0]= ICLASS_PAGESEL;
+  command[1]= book;
+  iclass_add_crc(command, 2);
+  // card answers with block 1 of the new book
+  if(iclass_transceive(pnd, command, 4, tmp, 10, -1) != 10 || !iclass_crc_ok(tmp, 8))
+    return true;
+  s->book= book;
+  return false;
+}
+
+// print card details
+void iclass_print_info(iclass_card_info *info)
+{
+  int i, app1_blocks= info->app1_limit - 5; // minus header blocks
+
+  printf("\n");
+  printf("  %s\n", Card_Types[(int) info->type]);
+  if(info->books > 1)
+    printf("  Book: %d\n", info->book);
+  printf("  %s Mode\n", info->personalisation ? "Personalisation" : "Application");
+  printf("  Keys %sLocked\n", info->keys_locked ? "" : "Un");
+  printf("  APP1 Blocks: %d\n", app1_blocks); 
+  printf("  APP2 Blocks: %d\n", (info->app2_limit - app1_blocks) - 5); // minus app1 and header
   printf("\n  Block write locks: \n\n");
-  printf("     Chip:    %s\n\n", data[3] >> 7 & 0x01 ? "R/W" : "R/O");
+  printf("     Chip:    %s\n\n", info->write_lock >> 7 & 0x01 ? "R/W" : "R/O");
   for(i= 0 ; i < 7 ; ++i)
-    printf("    Block: %02x %s\n", i + 6, data[3] >> i & 0x01 ? "R/W" : "R/O");
+    printf("    Block: %02x %s\n", i + 6, info->write_lock >> i & 0x01 ? "R/W" : "R/O");
+}
 
-  return data[0];
+// return true if header says block can't be written (unknown header is assumed writeable)
+bool iclass_block_locked(iclass_card_info *info, uint8_t blockno)
+{
+  // personalisation mode ignores locks
+  if(!info->valid || info->personalisation)
+    return false;
+  if(blockno == 3 || blockno == 4)
+    return info->keys_locked;
+  if(blockno < 6)
+    return false;
+  if(!(info->write_lock & 0x80))
+    return true;
+  return blockno <= 12 && !(info->write_lock >> (blockno - 6) & 0x01);
 }
 
 // print description of block
@@ -528,49 +1022,184 @@ void iclass_print_configs(void)
     printf("\n");
 }
 
+// return index of named CONFIG card or -1 if not found
+int iclass_find_config(char *name)
+{
+  int i;
+
+  for(i= 0 ; Config_cards[i] != NULL ; ++i)
+    if(!strcasecmp(name, Config_cards[i]))
+      return i;
+  return -1;
+}
+
+// add (or replace) CONFIG card definition - return index or -1 if failed
+int iclass_add_config(char *name, char *description, uint8_t *block6, uint8_t *block7)
+{
+  uint8_t *data;
+  int i;
+
+  if((i= iclass_find_config(name)) < 0)
+    {
+    for(i= 0 ; Config_cards[i] != NULL ; ++i)
+      ;
+    if(i >= MAX_CONFIGS)
+      return -1;
+    }
+  if(!(data= malloc(16)))
+    return -1;
+  memcpy(data, block6, 8);
+  memcpy(&data[8], block7, 8);
+  Config_cards[i]= strdup(name);
+  Config_types[i]= strdup(description);
+  Config_block6[i]= data;
+  Config_block7[i]= &data[8];
+  if(!Config_cards[i] || !Config_types[i])
+    return -1;
+  return i;
+}
+
+// fill data with contents of block for CONFIG card
+// KEYROLL cards are 3DES encrypted from block 0x0d upwards so need the keyroll key and schedules
+void iclass_config_block(int config, uint8_t blockno, uint8_t *kr, DES_key_schedule *ks1, DES_key_schedule *ks2, uint8_t *data)
+{
+  uint8_t plain[8];
+  uint64_t start;
+
+  if(blockno == 6 || blockno == 7)
+    {
+    memcpy(data, blockno == 6 ? Config_block6[config] : Config_block7[config], 8);
+    return;
+    }
+  if(strncmp(Config_cards[config], "KR", 2) || blockno < 0x0d)
+    {
+    memcpy(data, Config_block_other, 8);
+    return;
+    }
+  switch(blockno)
+    {
+    case 0x0d:
+      memcpy(plain, kr, 8);
+      break;
+    case 0x14:
+      plain[0]= 0x15;
+      memcpy(&plain[1], kr, 7);
+      break;
+    case 0x15:
+      memset(plain, 0xff, 8);
+      plain[0]= kr[7];
+      break;
+    default:
+      memcpy(plain, Config_block_other, 8);
+      break;
+    }
+  start= metrics_now();
+  DES_ecb2_encrypt((DES_cblock *) plain, (DES_cblock *) data, ks1, ks2, DES_ENCRYPT);
+  metrics_observe(METRIC_CRYPTO_DES, start);
+}
+
 // at some point this went missing from loclass, so re-creating it here
 void doMAC_N(uint8_t *address_data_p, uint8_t address_data_size, uint8_t *div_key_p, uint8_t mac[4])
 {
-        uint8_t *address_data;
-        uint8_t div_key[8];
-        address_data = (uint8_t*) malloc(address_data_size);
-	if(address_data == NULL)
-	  {
-	    printf("malloc failed!\n");
-	    return;
-	  }
-
-        memcpy(address_data, address_data_p, address_data_size);
-        memcpy(div_key, div_key_p, 8);
-
-        reverse_arraybytes(address_data, address_data_size);
-        BitstreamIn bitstream = {address_data, address_data_size * 8, 0};
-        uint8_t dest []= {0,0,0,0,0,0,0,0};
-        BitstreamOut out = { dest, sizeof(dest)*8, 0 };
-        MAC(div_key, bitstream, &out);
-        //The output MAC must also be reversed
-        reverse_arraybytes(dest, sizeof(dest));
-        memcpy(mac, dest, 4);
-        free(address_data);
-        return;
-}
-
-// keep temporary key
-uint8_t Key_sel_p[8]= { 0 };
-void divkey_elite(uint8_t *CSN, uint8_t   *KEY, uint8_t *div_key){
-        uint8_t keytable[128] = {0};
+        iclass_mac_ctx ctx;
+
+        iclass_mac_init(&ctx, div_key_p);
+        iclass_mac_update(&ctx, address_data_p, address_data_size);
+        iclass_mac_final(&ctx, mac);
+}
+
+// loclass diversifyKey() shares a static DES context, so do our own for threads
+void iclass_diversify(uint8_t *CSN, uint8_t *KEY, uint8_t *div_key)
+{
+        DES_key_schedule ks;
+        DES_cblock crypted;
+
+        DES_set_key_unchecked((DES_cblock *) KEY, &ks);
+        DES_ecb_encrypt((DES_cblock *) CSN, &crypted, &ks, DES_ENCRYPT);
+        hash0(x_bytes_to_num(crypted, 8), div_key);
+}
+
+#ifndef LEAN
+// hash2 only depends on the master key so callers doing many CSNs should do it once
+// (and from one thread only - loclass hash2() isn't thread safe)
+void divkey_elite_table(uint8_t *CSN, uint8_t *keytable, uint8_t *div_key)
+{
         uint8_t key_index[8] = {0};
         uint8_t key_sel[8] = { 0 };
+        uint8_t key_sel_p[8] = { 0 };
         uint8_t i;
-        hash2(KEY, keytable);
+
         hash1(CSN, key_index);
         for(i = 0; i < 8 ; i++)
                 key_sel[i] = keytable[key_index[i]] & 0xFF;
 
         //Permute from iclass format to standard format
-        permutekey_rev(key_sel, Key_sel_p);
-        diversifyKey(CSN, Key_sel_p, div_key);
+        permutekey_rev(key_sel, key_sel_p);
+        iclass_diversify(CSN, key_sel_p, div_key);
+}
+
+void divkey_elite(uint8_t *CSN, uint8_t   *KEY, uint8_t *div_key){
+        uint8_t keytable[128] = {0};
+
+        hash2(KEY, keytable);
+        divkey_elite_table(CSN, keytable, div_key);
         }
+#endif // LEAN
+
+// diversify KEY for CSN - ELITE keys go through the on-disk cache if there is one
+// (plain diversification is a single DES, which is cheaper than a lookup)
+static void iclass_divkey_cached(uint8_t *CSN, uint8_t *KEY, bool elite, uint8_t *div_key)
+{
+#ifndef LEAN
+        static uint8_t last_key[8], keyid[8];
+        static bool got_keyid= false;
+#endif
+
+        if(!elite)
+                {
+                iclass_diversify(CSN, KEY, div_key);
+                return;
+                }
+#ifdef LEAN
+        // no hash1/hash2 in the lean build and main() refuses ELITE keys - never write a wrong key
+        abort();
+#else
+        if(!keycache_active())
+                {
+                divkey_elite(CSN, KEY, div_key);
+                return;
+                }
+        if(!got_keyid || memcmp(last_key, KEY, 8))
+                {
+                memcpy(last_key, KEY, 8);
+                keycache_keyid(KEY, keyid);
+                got_keyid= true;
+                }
+        if(keycache_lookup(keyid, CSN, elite, div_key))
+                return;
+        divkey_elite(CSN, KEY, div_key);
+        keycache_store(keyid, CSN, elite, div_key);
+#endif // LEAN
+}
+
+// diversify KEY for CSN on the calling thread
+void iclass_divkey_now(uint8_t *CSN, uint8_t *KEY, bool elite, uint8_t *div_key)
+{
+        uint64_t start= metrics_now();
+
+        // the prefetch worker and the main thread share the keyid cache above
+        pthread_mutex_lock(&Divkey_lock);
+        iclass_divkey_cached(CSN, KEY, elite, div_key);
+        pthread_mutex_unlock(&Divkey_lock);
+        metrics_observe(METRIC_CRYPTO_DIVKEY, start);
+}
+
+// diversify KEY for CSN - usually already done by the prefetch worker since the card was selected
+void iclass_divkey(uint8_t *CSN, uint8_t *KEY, bool elite, uint8_t *div_key)
+{
+        if(!prefetch_take(CSN, KEY, elite, div_key))
+                iclass_divkey_now(CSN, KEY, elite, div_key);
+}
 
 void xorstring(uint8_t *target, uint8_t *src1, uint8_t *src2, uint8_t length)
 {
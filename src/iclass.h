@@ -45,12 +45,29 @@
 
 #include <nfc/nfc-types.h>
 #include "cipherutils.h"
+#include <openssl/des.h>
 
 #define ICLASS_ACTIVATE_ALL		0x0A
 #define ICLASS_SELECT			0x0C
 #define ICLASS_READ_BLOCK		0x0C
+#define ICLASS_CHECK			0x05
+#define ICLASS_READ4			0x06
 #define ICLASS_ANTICOL			0x81
 #define ICLASS_UPDATE			0x87
+#define ICLASS_PAGESEL			0x84
+#define ICLASS_HALT			0x00
+
+#define ICLASS_MAXTAGS			16	// most cards an inventory will find
+#define ICLASS_MAXREADERS		2	// readers open at once (clone source and target)
+#define ICLASS_READ_RETRIES		3	// re-reads of a block with a bad CRC
+#define ICLASS_INVENTORY_RETRIES	8	// IDENTIFY/SELECT failures in a row before giving up
+#define ICLASS_BOOKS			2	// books on a 32K card
+#define ICLASS_BOOK_BLOCKS		0x100	// blocks per book - book n starts at block n * this in a dump
+
+// iclass_poll() results
+#define ICLASS_POLL_NONE		0	// no card
+#define ICLASS_POLL_NEW			1	// card arrived and is selected
+#define ICLASS_POLL_SAME		2	// card from last poll still there (not selected)
 
 #define KEYTYPE_DEBIT   0x88
 #define KEYTYPE_CREDIT  0x18
@@ -61,27 +78,85 @@
 #define MASK_ENCRYPTED                  0x01    // 0 == DISABLED, 1 == ENABLED (byte 7)
 #define MASK_3DES                       0x02    // 0 == DES, 1 == TDES (byte 7)
 
+// block 1 (configuration) fuse bits (byte 7)
+#define FUSE_PERSONALISATION            0x80    // 1 == personalisation mode, 0 == application mode
+#define FUSE_KEYS_UNLOCKED              0x08    // 0 == keys (blocks 3 & 4) can't be written
+
 //#define DEBUG true
 
+// card header (blocks 0 to 5) decoded once per select
+typedef struct {
+  uint8_t header[6][8];		// raw blocks - keys (3 & 4) read back as FF
+  bool valid;			// header read OK
+  uint8_t type;			// 3 config bits, index into Card_Types
+  int app1_limit;		// last block of APP1
+  int app2_limit;		// last block of APP2
+  int books;			// 2 for a 32K card, otherwise 1
+  int book;			// book the header was read from
+  bool personalisation;		// card in personalisation mode
+  bool keys_locked;		// key blocks can't be written
+  uint8_t write_lock;		// bit n clear == block 6 + n read only, bit 7 clear == chip read only
+} iclass_card_info;
+
+// reader timing - readers differ, so each can have its own (see timing.c)
+typedef struct {
+  int timeout;			// transceive timeout in ms, -1 for libnfc default
+  int update_timeout;		// UPDATE timeout in ms, -1 for same as timeout
+  bool typeb_setup;		// select Type B before iClass (some readers need it)
+  bool read4;			// read header with READ4
+} iclass_timing;
+
+// card found by iclass_inventory()
+typedef struct {
+  uint8_t acsn[8];		// anticollision CSN (as sent to SELECT)
+  uint8_t uid[8];		// CSN in libnfc order (as nfc_target abtUID)
+} iclass_tag;
+
 // config card descriptors
+#define MAX_CONFIGS			64
 extern char * Config_cards[];
 extern char * Config_types[];
 extern uint8_t * Config_block6[];
 extern uint8_t * Config_block7[];
 extern uint8_t * Config_block_other;
 extern bool Elite_Override;
+extern bool Key_Diversified;
+extern bool RF_Quiet;
+extern const iclass_timing Default_timing;
 
 void iclass_add_crc(uint8_t *buffer, uint8_t length);
+void iclass_set_timing(nfc_device *pnd, const iclass_timing *timing);
 unsigned int iclass_crc16(unsigned char *data_p, unsigned char length);
+bool iclass_crc_ok(uint8_t *buffer, uint8_t length);
 bool iclass_select(nfc_device *pnd, nfc_target *nt);
+int iclass_inventory(nfc_device *pnd, iclass_tag *tags, int max);
+bool iclass_select_tag(nfc_device *pnd, iclass_tag *tag, nfc_target *nt);
+void iclass_halt(nfc_device *pnd);
+int iclass_poll(nfc_device *pnd, nfc_target *nt);
 bool iclass_authenticate(nfc_device *pnd, nfc_target nt, uint8_t *key, bool elite, bool diversify, bool debit_key);
 bool iclass_read(nfc_device *pnd, uint8_t block, uint8_t *buff);
+int iclass_read_checked(nfc_device *pnd, uint8_t block, uint8_t *buff, int *budget);
 bool iclass_write(nfc_device *pnd, uint8_t blockno, uint8_t *data);
-uint8_t iclass_print_type(nfc_device *pnd, int *app2_limit);
+bool iclass_update_frame(nfc_device *pnd, uint8_t blockno, uint8_t *data, uint8_t *frame);
+bool iclass_write_frame(nfc_device *pnd, uint8_t *frame, uint8_t *data);
+void iclass_personalise_frame(uint8_t blockno, uint8_t *data, uint8_t *frame);
+bool iclass_read4(nfc_device *pnd, uint8_t block, uint8_t *buff);
+bool iclass_has_read4(nfc_device *pnd);
+bool iclass_read_info(nfc_device *pnd, iclass_card_info *info);
+bool iclass_select_book(nfc_device *pnd, uint8_t book);
+void iclass_print_info(iclass_card_info *info);
+bool iclass_block_locked(iclass_card_info *info, uint8_t blockno);
 void iclass_print_blocktype(uint8_t block, uint8_t limit, uint8_t *data);
 void iclass_print_configs(void);
+int iclass_find_config(char *name);
+int iclass_add_config(char *name, char *description, uint8_t *block6, uint8_t *block7);
+void iclass_config_block(int config, uint8_t blockno, uint8_t *kr, DES_key_schedule *ks1, DES_key_schedule *ks2, uint8_t *data);
 // stuff that should be in loclass
 void doMAC_N(uint8_t *address_data_p, uint8_t address_data_size, uint8_t *div_key_p, uint8_t mac[4]);
 void divkey_elite(uint8_t *CSN, uint8_t   *KEY, uint8_t *div_key);
+void divkey_elite_table(uint8_t *CSN, uint8_t *keytable, uint8_t *div_key);
+void iclass_diversify(uint8_t *CSN, uint8_t *KEY, uint8_t *div_key);
+void iclass_divkey(uint8_t *CSN, uint8_t *KEY, bool elite, uint8_t *div_key);
+void iclass_divkey_now(uint8_t *CSN, uint8_t *KEY, bool elite, uint8_t *div_key);
 void xorstring(uint8_t *target, uint8_t *src1, uint8_t *src2, uint8_t length);
 #endif // _ICLASS_H_
@@ -0,0 +1,297 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file image.c
+ * @brief offline generation of complete card images for pre-staging
+ *
+ * Builds one image per CSN from a template image and a job: header from the
+ * template, diversified keys in blocks 3/4, then CONFIG card (including the
+ * 3DES KEYROLL blocks) and WRITE data. Images are the same format as -o dumps
+ * and are built on all CPU cores. Writing a staged image to a card then only
+ * needs MACs for the UPDATE frames.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "iclass.h"
+#include "hex.h"
+#include "nfc-utils.h"
+
+// loclass includes
+#include "elite_crack.h"
+
+// key that will be used for block 3 or 4 of every image
+typedef struct {
+  bool set;
+  bool elite;
+  uint8_t key[8];
+  uint8_t keytable[128];	// elite hash2 is done once per key, not per CSN
+} image_key;
+
+typedef struct {
+  iclass_job *job;
+  DES_key_schedule *ks1, *ks2;
+  uint8_t template[IMAGE_MAXSIZE];
+  int len;
+  image_key keys[2];		// block 3 (debit) and 4 (credit)
+  uint8_t *csns;
+  int count;
+  int next;			// next CSN to process
+  int failed;
+  pthread_mutex_t lock;
+} image_ctx;
+
+// load staged image for card - return length or -1 if failed
+// book 1 of a 32K card follows book 0 at IMAGE_MAXSIZE, as in a dump of both books
+int image_load(char *template, char *uid, uint8_t *image)
+{
+  char path[1024];
+  int fd, len;
+
+  job_path(path, sizeof(path), template, uid);
+  if((fd= open(path, O_RDONLY)) < 0)
+    return -1;
+  len= read(fd, image, IMAGE_MAXLOAD);
+  close(fd);
+  if(len < 6 * 8 || len % 8)
+    return -1;
+  return len;
+}
+
+static void image_set_key(image_key *k, uint8_t *key, bool elite)
+{
+  k->set= true;
+  k->elite= elite;
+  memcpy(k->key, key, 8);
+  if(elite)
+    hash2(k->key, k->keytable);
+}
+
+// build image for one card - uid is in libnfc order
+static void image_build(image_ctx *ctx, uint8_t *uid, uint8_t *image)
+{
+  iclass_job *job= ctx->job;
+  uint8_t csn[8];
+  int i, app1_limit, last;
+
+  memcpy(image, ctx->template, ctx->len);
+  last= ctx->len / 8 - 1;
+
+  // iClass stores uid LSB first but libnfc reverses it
+  for(i= 0 ; i < 8 ; ++i)
+    csn[i]= uid[7 - i];
+  memcpy(image, csn, 8);
+
+  for(i= 0 ; i < 2 ; ++i)
+    if(ctx->keys[i].set)
+      {
+      if(ctx->keys[i].elite)
+        divkey_elite_table(csn, ctx->keys[i].keytable, &image[(3 + i) * 8]);
+      else
+        iclass_diversify(csn, ctx->keys[i].key, &image[(3 + i) * 8]);
+      }
+
+  app1_limit= image[8];
+  if(app1_limit > last)
+    app1_limit= last;
+  if(job->config >= 0)
+    for(i= 6 ; i <= app1_limit ; ++i)
+      iclass_config_block(job->config, i, job->got_kr ? job->kr : NULL, ctx->ks1, ctx->ks2, &image[i * 8]);
+
+  if(job->writeblock && job->writeblock <= (unsigned int) last)
+    memcpy(&image[job->writeblock * 8], job->writedata, MIN(job->writelen, ctx->len - (int) job->writeblock * 8));
+}
+
+static void *image_worker(void *arg)
+{
+  image_ctx *ctx= (image_ctx *) arg;
+  uint8_t image[IMAGE_MAXSIZE], *uid;
+  char hex[17], path[1024];
+  int n, fd;
+
+  for(;;)
+    {
+    pthread_mutex_lock(&ctx->lock);
+    n= ctx->next++;
+    pthread_mutex_unlock(&ctx->lock);
+    if(n >= ctx->count)
+      break;
+
+    uid= &ctx->csns[n * 8];
+    image_build(ctx, uid, image);
+    hex_encode(uid, 8, hex);
+    hex[16]= '\0';
+    job_path(path, sizeof(path), ctx->job->dumpfile, hex);
+    if((fd= open(path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) < 0 || write(fd, image, ctx->len) != ctx->len)
+      {
+      fprintf(stderr, "  %s: write failed!\n", path);
+      pthread_mutex_lock(&ctx->lock);
+      ctx->failed++;
+      pthread_mutex_unlock(&ctx->lock);
+      }
+    if(fd >= 0)
+      close(fd);
+    }
+  return NULL;
+}
+
+// read CSN list - one 16 digit HEX UID per line, as printed when a card is found
+static int image_read_csns(char *csnfile, image_ctx *ctx)
+{
+  char line[256], *p;
+  int size= 0;
+  uint8_t *tmp;
+  FILE *f;
+
+  if(!(f= fopen(csnfile, "r")))
+    return -1;
+  ctx->count= 0;
+  while(fgets(line, sizeof(line), f))
+    {
+    for(p= line ; isspace((unsigned char) *p) ; ++p)
+      ;
+    if(!*p || *p == '#')
+      continue;
+    p[strcspn(p, " \t\r\n")]= '\0';
+    if(ctx->count == size)
+      {
+      size= size ? size * 2 : 1024;
+      if(!(tmp= realloc(ctx->csns, size * 8)))
+        {
+        fprintf(stderr, "  out of memory reading CSN list\n");
+        fclose(f);
+        return -1;
+        }
+      ctx->csns= tmp;
+      }
+    if(job_hex(p, &ctx->csns[ctx->count * 8], 8))
+      {
+      fprintf(stderr, "  bad CSN: %s\n", p);
+      fclose(f);
+      return -1;
+      }
+    ctx->count++;
+    }
+  fclose(f);
+  return ctx->count;
+}
+
+// generate one image per CSN in csnfile - return number of failures or -1 if can't start
+int image_generate(iclass_job *job, char *csnfile, uint8_t *default_kd, DES_key_schedule *ks1, DES_key_schedule *ks2)
+{
+  static image_ctx ctx;
+  pthread_t *threads;
+  int i, fd, nthreads;
+
+  if(!job->template || !job->dumpfile || !strstr(job->dumpfile, "%s"))
+    {
+    fprintf(stderr, "Need TEMPLATE image and output file with '%%s' for UID!\n");
+    return -1;
+    }
+  if((fd= open(job->template, O_RDONLY)) < 0)
+    {
+    fprintf(stderr, "Can't open TEMPLATE image!\n");
+    return -1;
+    }
+  ctx.len= read(fd, ctx.template, IMAGE_MAXSIZE);
+  close(fd);
+  if(ctx.len < 6 * 8 || ctx.len % 8)
+    {
+    fprintf(stderr, "TEMPLATE image must be at least 6 8 byte blocks!\n");
+    return -1;
+    }
+  if(job->config >= 0 && !strncmp(Config_cards[job->config], "KR", 2) && (!job->got_kr || ctx.template[8] < 0x16 || ctx.len <= 0x16 * 8))
+    {
+    fprintf(stderr, "KEYROLL card needs KEYROLL key and APP1 of at least 0x16 blocks!\n");
+    return -1;
+    }
+
+  ctx.job= job;
+  ctx.ks1= ks1;
+  ctx.ks2= ks2;
+  ctx.next= 0;
+  ctx.failed= 0;
+  // block 3 gets new DEBIT key if re-keying, otherwise current one
+  if(job->rekey && !job->got_kc)
+    image_set_key(&ctx.keys[0], job->krekey, job->rekey_elite);
+  else
+    image_set_key(&ctx.keys[0], job->got_kd ? job->kd : default_kd, job->elite);
+  if(job->rekey && job->got_kc)
+    image_set_key(&ctx.keys[1], job->krekey, job->rekey_elite);
+  else if(job->got_kc)
+    image_set_key(&ctx.keys[1], job->kc, job->elite);
+
+  if(image_read_csns(csnfile, &ctx) < 0)
+    {
+    fprintf(stderr, "Can't read CSN list!\n");
+    return -1;
+    }
+
+  if((nthreads= (int) sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    nthreads= 1;
+  if(!(threads= malloc(nthreads * sizeof(pthread_t))))
+    return -1;
+  pthread_mutex_init(&ctx.lock, NULL);
+  for(i= 0 ; i < nthreads ; ++i)
+    if(pthread_create(&threads[i], NULL, image_worker, &ctx))
+      break;
+  nthreads= i;
+  // do the work ourselves if we couldn't start any threads
+  if(!nthreads)
+    image_worker(&ctx);
+  for(i= 0 ; i < nthreads ; ++i)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&ctx.lock);
+  free(threads);
+
+  printf("\n  %d images built from %s using %d threads, %d failed\n", ctx.count, job->template, nthreads ? nthreads : 1, ctx.failed);
+  free(ctx.csns);
+  ctx.csns= NULL;
+  return ctx.failed;
+}
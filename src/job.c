@@ -0,0 +1,413 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file job.c
+ * @brief JOB file parser
+ *
+ * A JOB file describes what to do to every card presented, so a batch can be
+ * run from a single invocation. It can also define new CONFIG cards:
+ *
+ *   # comments start with '#' or ';'
+ *   [config LOCK]
+ *   description = Keypad lockout
+ *   block6 = 000000000000BF18
+ *   block7 = AE01000000000000
+ *
+ *   [card]
+ *   debit_key = AFA785A7DAB33378
+ *   credit_key = 0DC442031337D00F
+ *   elite = no
+ *   config = LOCK
+ *   keyroll_key = F00FBEEBD00BEEEE
+ *   write = 8 aabbccddaabbccdd
+ *   rekey = DEADBEEFCAFEF00D
+ *   rekey_elite = yes
+ *   verify = readback
+ *   book = all
+ *   manufacture = commit
+ *   dump = /tmp/iclass-%s.icd
+ *   template = /tmp/blank.icd
+ *   image = /tmp/staged/%s.icd
+ *   golden = /var/lib/iclass/golden/%s.icd
+ *   key_cache = /var/cache/iclass.keys
+ *   journal = /var/lib/iclass/rekey.journal
+ *   metrics = /var/lib/node_exporter/iclass.prom
+ *   cards = 100
+ *   inventory = yes
+ *   fast_poll = yes
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "job.h"
+#include "iclass.h"
+#include "hex.h"
+
+#define MAXLINE (MAXWRITE * 2 + 256)
+
+// CONFIG card definition being parsed
+static char Config_name[16], Config_desc[128];
+static uint8_t Config_data[2][8];
+static int Config_got;
+
+void job_init(iclass_job *job)
+{
+  memset(job, 0x00, sizeof(*job));
+  job->config= -1;
+  job->rekey_elite= true;
+  job->verify= VERIFY_ECHO;
+  job->book= BOOK_CURRENT;
+}
+
+// substitute UID for '%s' so each card gets its own file
+void job_path(char *path, size_t len, char *template, char *uid)
+{
+  char *p;
+
+  if((p= strstr(template, "%s")))
+    snprintf(path, len, "%.*s%s%s", (int) (p - template), template, uid, p + 2);
+  else
+    snprintf(path, len, "%s", template);
+}
+
+// convert len bytes of HEX - return false if OK or true if failed
+bool job_hex(char *hex, uint8_t *data, int len)
+{
+  return strlen(hex) != (size_t) len * 2 || hex_decode(hex, len * 2, data) < 0;
+}
+
+static bool job_bool(char *value)
+{
+  return !strcasecmp(value, "yes") || !strcasecmp(value, "true") || !strcmp(value, "1");
+}
+
+// book is 0 or 1, or "all" for both books of a 32K card - return false if OK or true if invalid
+bool job_book(char *value, int *book)
+{
+  if(!strcasecmp(value, "all"))
+    *book= BOOK_ALL;
+  else if(!strcmp(value, "0") || !strcmp(value, "1"))
+    *book= atoi(value);
+  else
+    return true;
+  return false;
+}
+
+// manufacture is "keep" or "commit" - return false if OK or true if invalid
+bool job_manufacture(char *value, int *manufacture)
+{
+  if(!strcasecmp(value, "keep"))
+    *manufacture= MANUFACTURE_KEEP;
+  else if(!strcasecmp(value, "commit"))
+    *manufacture= MANUFACTURE_COMMIT;
+  else
+    return true;
+  return false;
+}
+
+// register CONFIG card from completed [config] section
+static bool job_add_config(int line)
+{
+  if(!Config_name[0])
+    return false;
+  if(Config_got != 3)
+    {
+    fprintf(stderr, "JOB line %d: CONFIG card %s needs block6 and block7\n", line, Config_name);
+    return true;
+    }
+  if(iclass_add_config(Config_name, Config_desc, Config_data[0], Config_data[1]) < 0)
+    {
+    fprintf(stderr, "JOB line %d: can't add CONFIG card %s\n", line, Config_name);
+    return true;
+    }
+  Config_name[0]= '\0';
+  return false;
+}
+
+// WRITE data is a HEX string or the name of a binary file
+static bool job_write(iclass_job *job, char *value)
+{
+  unsigned int block;
+  char *p;
+  int fd, len;
+
+  if(sscanf(value, "%x", &block) != 1 || block < 5)
+    return true;
+  for(p= value ; *p && !isspace((unsigned char) *p) ; ++p)
+    ;
+  while(isspace((unsigned char) *p))
+    ++p;
+  if(!*p)
+    return true;
+  if((fd= open(p, O_RDONLY)) >= 0)
+    {
+    len= read(fd, job->writedata, MAXWRITE);
+    close(fd);
+    }
+  else
+    {
+    len= strlen(p) / 2;
+    if(len > MAXWRITE || job_hex(p, job->writedata, len))
+      return true;
+    }
+  if(len <= 0 || len % 8)
+    return true;
+  job->writeblock= block;
+  job->writelen= len;
+  return false;
+}
+
+static bool job_card_key(iclass_job *job, char *key, char *value)
+{
+  if(!strcasecmp(key, "debit_key"))
+    {
+    job->got_kd= true;
+    return job_hex(value, job->kd, 8);
+    }
+  if(!strcasecmp(key, "credit_key"))
+    {
+    job->got_kc= true;
+    return job_hex(value, job->kc, 8);
+    }
+  if(!strcasecmp(key, "keyroll_key"))
+    {
+    job->got_kr= true;
+    return job_hex(value, job->kr, 8);
+    }
+  if(!strcasecmp(key, "rekey"))
+    {
+    job->rekey= true;
+    return job_hex(value, job->krekey, 8);
+    }
+  if(!strcasecmp(key, "elite"))
+    {
+    job->elite= job_bool(value);
+    return false;
+    }
+  if(!strcasecmp(key, "rekey_elite"))
+    {
+    job->rekey_elite= job_bool(value);
+    return false;
+    }
+  if(!strcasecmp(key, "config"))
+    {
+    job->config= iclass_find_config(value);
+    return job->config < 0;
+    }
+  if(!strcasecmp(key, "write"))
+    return job_write(job, value);
+  if(!strcasecmp(key, "verify"))
+    {
+    if(!strcasecmp(value, "echo"))
+      job->verify= VERIFY_ECHO;
+    else if(!strcasecmp(value, "readback"))
+      job->verify= VERIFY_READBACK;
+    else
+      return true;
+    return false;
+    }
+  if(!strcasecmp(key, "book"))
+    return job_book(value, &job->book);
+  if(!strcasecmp(key, "manufacture"))
+    return job_manufacture(value, &job->manufacture);
+  if(!strcasecmp(key, "dump"))
+    {
+    job->dumpfile= strdup(value);
+    return job->dumpfile == NULL;
+    }
+  if(!strcasecmp(key, "template"))
+    {
+    job->template= strdup(value);
+    return job->template == NULL;
+    }
+  if(!strcasecmp(key, "image"))
+    {
+    job->image= strdup(value);
+    return job->image == NULL;
+    }
+  if(!strcasecmp(key, "golden"))
+    {
+    job->golden= strdup(value);
+    return job->golden == NULL;
+    }
+  if(!strcasecmp(key, "key_cache"))
+    {
+    job->keycache= strdup(value);
+    return job->keycache == NULL;
+    }
+  if(!strcasecmp(key, "journal"))
+    {
+    job->journal= strdup(value);
+    return job->journal == NULL;
+    }
+  if(!strcasecmp(key, "metrics"))
+    {
+    job->metrics= strdup(value);
+    return job->metrics == NULL;
+    }
+  if(!strcasecmp(key, "cards"))
+    {
+    job->cards= atoi(value);
+    return job->cards < 0;
+    }
+  if(!strcasecmp(key, "inventory"))
+    {
+    job->inventory= job_bool(value);
+    return false;
+    }
+  if(!strcasecmp(key, "fast_poll"))
+    {
+    job->fast_poll= job_bool(value);
+    return false;
+    }
+  return true;
+}
+
+static bool job_config_key(char *key, char *value)
+{
+  if(!strcasecmp(key, "description"))
+    {
+    snprintf(Config_desc, sizeof(Config_desc), "%s", value);
+    return false;
+    }
+  if(!strcasecmp(key, "block6") && !job_hex(value, Config_data[0], 8))
+    {
+    Config_got |= 1;
+    return false;
+    }
+  if(!strcasecmp(key, "block7") && !job_hex(value, Config_data[1], 8))
+    {
+    Config_got |= 2;
+    return false;
+    }
+  return true;
+}
+
+static char *job_trim(char *s)
+{
+  char *e;
+
+  while(isspace((unsigned char) *s))
+    ++s;
+  e= s + strlen(s);
+  while(e > s && isspace((unsigned char) e[-1]))
+    *--e= '\0';
+  return s;
+}
+
+// parse JOB file into job - return false if OK or true if failed
+bool job_load(char *filename, iclass_job *job)
+{
+  static char buff[MAXLINE];
+  char *line, *key, *value, *p;
+  bool card= false, ret= false;
+  int lineno= 0;
+  FILE *f;
+
+  if(!(f= fopen(filename, "r")))
+    {
+    fprintf(stderr, "Can't open JOB file %s\n", filename);
+    return true;
+    }
+
+  Config_name[0]= '\0';
+  while(!ret && fgets(buff, sizeof(buff), f))
+    {
+    ++lineno;
+    line= job_trim(buff);
+    if(!*line || *line == '#' || *line == ';')
+      continue;
+    if(*line == '[')
+      {
+      if((ret= job_add_config(lineno)))
+        break;
+      if(!(p= strchr(line, ']')))
+        ret= true;
+      else
+        {
+        *p= '\0';
+        line= job_trim(line + 1);
+        card= !strcasecmp(line, "card");
+        if(!card)
+          {
+          if(strncasecmp(line, "config", 6) || !*(p= job_trim(line + 6)) || strlen(p) >= sizeof(Config_name))
+            ret= true;
+          else
+            {
+            strcpy(Config_name, p);
+            strcpy(Config_desc, p);
+            Config_got= 0;
+            }
+          }
+        }
+      if(ret)
+        fprintf(stderr, "JOB line %d: bad section\n", lineno);
+      continue;
+      }
+    if(!(p= strchr(line, '=')))
+      {
+      fprintf(stderr, "JOB line %d: expected KEY = VALUE\n", lineno);
+      ret= true;
+      break;
+      }
+    *p= '\0';
+    key= job_trim(line);
+    value= job_trim(p + 1);
+    if(card)
+      ret= job_card_key(job, key, value);
+    else if(Config_name[0])
+      ret= job_config_key(key, value);
+    else
+      ret= true;
+    if(ret)
+      fprintf(stderr, "JOB line %d: bad value for %s\n", lineno, key);
+    }
+  if(!ret)
+    ret= job_add_config(lineno);
+  fclose(f);
+  return ret;
+}
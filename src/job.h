@@ -0,0 +1,99 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file job.h
+ * @brief per-card job description shared by the command line and JOB files
+ */
+
+#ifndef _JOB_H_
+#  define _JOB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAXWRITE 2000 // 0xff * 8 byte blocks - 5 * 8 byte reserved blocks
+
+// verify policy for writes
+#define VERIFY_ECHO		0	// UPDATE response must match data written
+#define VERIFY_READBACK		1	// as ECHO plus re-read every written block
+
+// book policy for 32K cards
+#define BOOK_CURRENT		-1	// the book the card comes up in, no book selection
+#define BOOK_ALL		-2	// every book the card has, in one session
+
+// manufacturing of blank cards in personalisation mode
+#define MANUFACTURE_NONE	0	// normal authenticated job
+#define MANUFACTURE_KEEP	1	// write image, card stays in personalisation mode
+#define MANUFACTURE_COMMIT	2	// write image, then switch card to application mode
+
+typedef struct {
+  uint8_t kd[8];		// DEBIT key
+  uint8_t kc[8];		// CREDIT key
+  uint8_t kr[8];		// KEYROLL key for CONFIG card
+  uint8_t krekey[8];		// new key for re-key
+  bool got_kd, got_kc, got_kr;
+  bool elite;			// AUTH keys are ELITE
+  bool rekey;
+  bool rekey_elite;		// new key is ELITE
+  int config;			// CONFIG card index or -1 for none
+  unsigned int writeblock;	// first block to WRITE or 0 for none
+  uint8_t writedata[MAXWRITE];
+  int writelen;
+  int verify;			// VERIFY_*
+  int book;			// book of a 32K card to use, or BOOK_*
+  int manufacture;		// MANUFACTURE_*
+  char *dumpfile;		// output file - '%s' is replaced by card UID
+  char *template;		// TEMPLATE image for pre-staging
+  char *image;			// pre-staged image to write - '%s' is replaced by card UID
+  char *golden;			// image to verify card against - '%s' is replaced by card UID
+  char *keycache;		// diversified key cache file
+  char *journal;		// re-key campaign journal file
+  char *metrics;		// OpenMetrics export - FILE, unix:PATH or tcp:PORT
+  int cards;			// number of cards to process, 0 for no limit
+  bool inventory;		// process every card in the field, not just the first
+  bool fast_poll;		// poll with iclass_poll() instead of full selects
+} iclass_job;
+
+void job_init(iclass_job *job);
+bool job_load(char *filename, iclass_job *job);
+bool job_hex(char *hex, uint8_t *data, int len);
+bool job_book(char *value, int *book);
+bool job_manufacture(char *value, int *manufacture);
+void job_path(char *path, size_t len, char *template, char *uid);
+#endif // _JOB_H_
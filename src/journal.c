@@ -0,0 +1,292 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file journal.c
+ * @brief write-ahead journal for re-key campaigns
+ *
+ * The echo of a key block write can't be checked, so if the field drops
+ * during a re-key there's no telling which key the card was left with. Before
+ * the write a PENDING record holding the old and new diversified keys is
+ * appended and synced. Once the new key has been proved by authenticating
+ * with it a DONE record follows. When the card turns up again only those two
+ * keys need trying.
+ *
+ * The file is a 16 byte header ("ICJL" version(1) reserved(11)) followed by
+ * 32 byte records:
+ *
+ *   csn(8) old_key(8) new_key(8) block(1) state(1) reserved(4) crc(2)
+ *
+ * On open the whole file is replayed into a hash table, the last record for
+ * a CSN and block winning. A record that fails its CRC is skipped, and the
+ * records after it still count. Only a partial record at the very end, left
+ * by a crash, is cut off. Records are written at a tracked offset and a failed
+ * append is truncated away, so a full disk can't misalign the ones after it.
+ * DONE records aren't synced - if one is lost the card is just probed
+ * again. Diversified keys are secret, so the file is created readable by its
+ * owner only, and it is locked so two campaigns can't share it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "iclass.h"
+
+#define JOURNAL_VERSION		1
+#define JOURNAL_HEADER		16
+#define JOURNAL_RECORD		32
+#define JOURNAL_MINSIZE		1024	// initial hash table size (power of 2)
+
+static int Fd= -1;
+static off_t End;		// where the next record goes
+static journal_entry *Table= NULL;
+static uint32_t Size= 0, Used= 0;
+
+static uint32_t journal_hash(uint8_t *csn, uint8_t block)
+{
+  uint32_t h= block;
+  int i;
+
+  for(i= 0 ; i < 8 ; ++i)
+    h= h * 31 + csn[i];
+  return h;
+}
+
+// find slot for csn/block in table - matching entry or empty slot (state 0)
+static journal_entry *journal_slot(journal_entry *table, uint32_t size, uint8_t *csn, uint8_t block)
+{
+  journal_entry *e;
+  uint32_t h;
+
+  for(h= journal_hash(csn, block) ; ; ++h)
+    {
+    e= &table[h & (size - 1)];
+    if(!e->state || (e->block == block && !memcmp(e->csn, csn, 8)))
+      return e;
+    }
+}
+
+// double the table - return false if OK
+static bool journal_grow(void)
+{
+  journal_entry *table;
+  uint32_t size= Size ? Size * 2 : JOURNAL_MINSIZE, i;
+
+  if(!(table= calloc(size, sizeof(journal_entry))))
+    return true;
+  for(i= 0 ; i < Size ; ++i)
+    if(Table[i].state)
+      *journal_slot(table, size, Table[i].csn, Table[i].block)= Table[i];
+  free(Table);
+  Table= table;
+  Size= size;
+  return false;
+}
+
+static void journal_pack(uint8_t *rec, journal_entry *e)
+{
+  unsigned int crc;
+
+  memset(rec, 0, JOURNAL_RECORD);
+  memcpy(rec, e->csn, 8);
+  memcpy(&rec[8], e->old_key, 8);
+  memcpy(&rec[16], e->new_key, 8);
+  rec[24]= e->block;
+  rec[25]= e->state;
+  crc= iclass_crc16(rec, JOURNAL_RECORD - 2);
+  rec[30]= (crc >> 8) & 0xff;
+  rec[31]= crc & 0xff;
+}
+
+// return false if record is intact
+static bool journal_unpack(uint8_t *rec, journal_entry *e)
+{
+  unsigned int crc= iclass_crc16(rec, JOURNAL_RECORD - 2);
+
+  if(rec[30] != ((crc >> 8) & 0xff) || rec[31] != (crc & 0xff))
+    return true;
+  memcpy(e->csn, rec, 8);
+  memcpy(e->old_key, &rec[8], 8);
+  memcpy(e->new_key, &rec[16], 8);
+  e->block= rec[24];
+  e->state= rec[25];
+  return (e->block != 3 && e->block != 4) || (e->state != JOURNAL_PENDING && e->state != JOURNAL_DONE);
+}
+
+// put entry in table - return false if OK
+static bool journal_apply(journal_entry *e)
+{
+  journal_entry *slot;
+
+  if(Used * 2 >= Size && journal_grow())
+    return true;
+  slot= journal_slot(Table, Size, e->csn, e->block);
+  if(!slot->state)
+    ++Used;
+  *slot= *e;
+  return false;
+}
+
+// append entry to file and table - return false if OK
+static bool journal_append(journal_entry *e, bool sync)
+{
+  uint8_t rec[JOURNAL_RECORD];
+
+  journal_pack(rec, e);
+  if(pwrite(Fd, rec, JOURNAL_RECORD, End) != JOURNAL_RECORD)
+    {
+    // the next record goes over whatever part of this one landed - drop it now in case there is none
+    if(ftruncate(Fd, End) < 0)
+      fprintf(stderr, "\n  Re-key journal has a partial record at the end!\n");
+    return true;
+    }
+  End += JOURNAL_RECORD;
+  if(sync && fdatasync(Fd) < 0)
+    return true;
+  return journal_apply(e);
+}
+
+// open (or create) journal and replay it - return false if OK or true if failed
+bool journal_open(char *filename)
+{
+  uint8_t header[JOURNAL_HEADER], rec[JOURNAL_RECORD];
+  journal_entry e;
+  ssize_t len;
+
+  if((Fd= open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0)
+    return true;
+  if(flock(Fd, LOCK_EX | LOCK_NB) < 0 || journal_grow())
+    goto fail;
+  if(!(len= read(Fd, header, JOURNAL_HEADER)))
+    {
+    memset(header, 0, JOURNAL_HEADER);
+    memcpy(header, "ICJL", 4);
+    header[4]= JOURNAL_VERSION;
+    if(write(Fd, header, JOURNAL_HEADER) != JOURNAL_HEADER || fsync(Fd) < 0)
+      goto fail;
+    End= JOURNAL_HEADER;
+    return false;
+    }
+  if(len != JOURNAL_HEADER || memcmp(header, "ICJL", 4) || header[4] != JOURNAL_VERSION)
+    goto fail;
+  for(End= JOURNAL_HEADER ; read(Fd, rec, JOURNAL_RECORD) == JOURNAL_RECORD ; End += JOURNAL_RECORD)
+    if(!journal_unpack(rec, &e) && journal_apply(&e))
+      goto fail;
+  // cut off a partial record left by a crash so new records stay aligned
+  if(ftruncate(Fd, End) < 0)
+    goto fail;
+  return false;
+
+fail:
+  journal_close();
+  return true;
+}
+
+void journal_close(void)
+{
+  if(Fd >= 0)
+    close(Fd);
+  Fd= -1;
+  free(Table);
+  Table= NULL;
+  Size= Used= 0;
+}
+
+bool journal_active(void)
+{
+  return Fd >= 0;
+}
+
+// count cards in journal and how many of those were interrupted
+void journal_stats(int *cards, int *pending)
+{
+  uint32_t i;
+
+  *cards= *pending= 0;
+  for(i= 0 ; i < Size ; ++i)
+    if(Table[i].state)
+      {
+      ++*cards;
+      if(Table[i].state == JOURNAL_PENDING)
+        ++*pending;
+      }
+}
+
+// return latest entry for csn/block or NULL if none
+journal_entry *journal_find(uint8_t *csn, uint8_t block)
+{
+  journal_entry *e;
+
+  if(!Table)
+    return NULL;
+  e= journal_slot(Table, Size, csn, block);
+  return e->state ? e : NULL;
+}
+
+// record that a key write is about to be sent - return false if safely on disk
+bool journal_begin(uint8_t *csn, uint8_t block, uint8_t *old_key, uint8_t *new_key)
+{
+  journal_entry e;
+
+  memcpy(e.csn, csn, 8);
+  e.block= block;
+  e.state= JOURNAL_PENDING;
+  memcpy(e.old_key, old_key, 8);
+  memcpy(e.new_key, new_key, 8);
+  return journal_append(&e, true);
+}
+
+// record that the card holds the new key - return false if OK
+bool journal_commit(uint8_t *csn, uint8_t block)
+{
+  journal_entry e, *found;
+
+  if(!(found= journal_find(csn, block)))
+    return true;
+  e= *found;
+  e.state= JOURNAL_DONE;
+  return journal_append(&e, false);
+}
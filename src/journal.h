@@ -0,0 +1,77 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file journal.h
+ * @brief write-ahead journal for re-key campaigns
+ */
+
+#ifndef _JOURNAL_H_
+#  define _JOURNAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// journal_entry states
+#define JOURNAL_PENDING		1	// key write about to be sent - card holds old or new key
+#define JOURNAL_DONE		2	// card confirmed holding new key
+
+typedef struct {
+  uint8_t csn[8];
+  uint8_t block;		// key block - 3 (debit) or 4 (credit)
+  uint8_t state;		// JOURNAL_*
+  uint8_t old_key[8];		// diversified
+  uint8_t new_key[8];		// diversified
+} journal_entry;
+
+#ifndef LEAN
+bool journal_open(char *filename);
+void journal_close(void);
+bool journal_active(void);
+void journal_stats(int *cards, int *pending);
+journal_entry *journal_find(uint8_t *csn, uint8_t block);
+bool journal_begin(uint8_t *csn, uint8_t block, uint8_t *old_key, uint8_t *new_key);
+bool journal_commit(uint8_t *csn, uint8_t block);
+#else
+// no campaigns in the lean build - re-keys go straight to the card
+static inline bool journal_active(void) { return false; }
+static inline journal_entry *journal_find(uint8_t *csn, uint8_t block) { return NULL; }
+static inline bool journal_begin(uint8_t *csn, uint8_t block, uint8_t *old_key, uint8_t *new_key) { return true; }
+static inline bool journal_commit(uint8_t *csn, uint8_t block) { return true; }
+#endif // LEAN
+#endif // _JOURNAL_H_
@@ -0,0 +1,263 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file keycache.c
+ * @brief persistent cache of diversified keys, shared between processes
+ *
+ * Maps (master key ID, CSN, ELITE flag) to the diversified key so cards seen
+ * before skip hash1/hash2/DES entirely. The file is an open addressing hash
+ * table that is memory mapped by every process using it:
+ *
+ *   header:  "ICKC" version(1) reserved(3) slots(4) clock(4)
+ *   slot:    keyid(8) csn(8) div_key(8) stamp(4) elite(1) reserved(3)
+ *
+ * A key lives in one of the KEYCACHE_PROBE slots following its hash. When all
+ * of those are taken the one with the oldest stamp is replaced, so the file
+ * never grows. Lookups hold a shared flock() and stores an exclusive one, so
+ * any number of readers can work at once. If the lock can't be had, a lookup
+ * misses and a store is skipped. The master key itself is never
+ * written, only the first 8 bytes of its SHA-256. Diversified keys are secret
+ * though, so the file is created readable by its owner only.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#include "keycache.h"
+
+#define KEYCACHE_VERSION	1
+#define KEYCACHE_HEADER		16
+
+typedef struct {
+  uint8_t keyid[8];
+  uint8_t csn[8];
+  uint8_t div_key[8];
+  uint32_t stamp;		// insert order - 0 == empty
+  uint8_t elite;
+  uint8_t reserved[3];
+} keycache_slot;
+
+static int Cache_fd= -1;
+static uint8_t *Cache= NULL;
+static size_t Cache_size;
+static uint32_t Slots;
+// flock() doesn't keep threads of one process apart
+static pthread_mutex_t Lock= PTHREAD_MUTEX_INITIALIZER;
+
+static keycache_slot *keycache_slot_at(uint32_t i)
+{
+  return (keycache_slot *) &Cache[KEYCACHE_HEADER + (size_t) (i & (Slots - 1)) * sizeof(keycache_slot)];
+}
+
+// FNV-1a over the lookup key
+static uint32_t keycache_hash(uint8_t *keyid, uint8_t *csn, bool elite)
+{
+  uint32_t hash= 2166136261u;
+  int i;
+
+  for(i= 0 ; i < 8 ; ++i)
+    hash= (hash ^ keyid[i]) * 16777619u;
+  for(i= 0 ; i < 8 ; ++i)
+    hash= (hash ^ csn[i]) * 16777619u;
+  return (hash ^ elite) * 16777619u;
+}
+
+static bool keycache_match(keycache_slot *slot, uint8_t *keyid, uint8_t *csn, bool elite)
+{
+  return slot->stamp && slot->elite == elite && !memcmp(slot->csn, csn, 8) && !memcmp(slot->keyid, keyid, 8);
+}
+
+// lock or unlock the cache file, retrying if interrupted - return false if OK or true if failed
+static bool keycache_lock(int op)
+{
+  while(flock(Cache_fd, op) < 0)
+    if(errno != EINTR)
+      return true;
+  return false;
+}
+
+// open (or create with slots entries) cache file - return false if OK or true if failed
+bool keycache_open(char *filename, uint32_t slots)
+{
+  uint8_t header[KEYCACHE_HEADER];
+  struct stat st;
+
+  if(slots & (slots - 1))
+    return true;
+  if((Cache_fd= open(filename, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) < 0)
+    return true;
+
+  // first process in sets the file up
+  if(keycache_lock(LOCK_EX) || fstat(Cache_fd, &st) < 0)
+    goto fail;
+  if(st.st_size == 0)
+    {
+    memset(header, 0x00, sizeof(header));
+    memcpy(header, "ICKC", 4);
+    header[4]= KEYCACHE_VERSION;
+    memcpy(&header[8], &slots, 4);
+    if(write(Cache_fd, header, sizeof(header)) != sizeof(header)
+       || ftruncate(Cache_fd, KEYCACHE_HEADER + (off_t) slots * sizeof(keycache_slot)) < 0)
+      goto fail;
+    }
+  else if(read(Cache_fd, header, sizeof(header)) != sizeof(header) || memcmp(header, "ICKC", 4) || header[4] != KEYCACHE_VERSION)
+    goto fail;
+
+  // size comes from the file, not the caller
+  memcpy(&Slots, &header[8], 4);
+  Cache_size= KEYCACHE_HEADER + (size_t) Slots * sizeof(keycache_slot);
+  if(!Slots || (Slots & (Slots - 1)) || fstat(Cache_fd, &st) < 0 || (size_t) st.st_size < Cache_size)
+    goto fail;
+  if((Cache= mmap(NULL, Cache_size, PROT_READ | PROT_WRITE, MAP_SHARED, Cache_fd, 0)) == MAP_FAILED)
+    {
+    Cache= NULL;
+    goto fail;
+    }
+  keycache_lock(LOCK_UN);
+  return false;
+
+fail:
+  close(Cache_fd);
+  Cache_fd= -1;
+  return true;
+}
+
+void keycache_close(void)
+{
+  if(Cache)
+    munmap(Cache, Cache_size);
+  if(Cache_fd >= 0)
+    close(Cache_fd);
+  Cache= NULL;
+  Cache_fd= -1;
+}
+
+bool keycache_active(void)
+{
+  return Cache != NULL;
+}
+
+// ID a master key by the start of its SHA-256
+void keycache_keyid(uint8_t *key, uint8_t *keyid)
+{
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+
+  SHA256(key, 8, digest);
+  memcpy(keyid, digest, 8);
+}
+
+// return true and fill in div_key if cached
+bool keycache_lookup(uint8_t *keyid, uint8_t *csn, bool elite, uint8_t *div_key)
+{
+  uint32_t hash, i;
+  keycache_slot *slot;
+  bool found= false;
+
+  if(!Cache)
+    return false;
+  hash= keycache_hash(keyid, csn, elite);
+  pthread_mutex_lock(&Lock);
+  // no lock, no lookup - a slot being stored could be read half written
+  if(keycache_lock(LOCK_SH))
+    {
+    pthread_mutex_unlock(&Lock);
+    return false;
+    }
+  for(i= 0 ; i < KEYCACHE_PROBE && !found ; ++i)
+    {
+    slot= keycache_slot_at(hash + i);
+    if((found= keycache_match(slot, keyid, csn, elite)))
+      memcpy(div_key, slot->div_key, 8);
+    }
+  keycache_lock(LOCK_UN);
+  pthread_mutex_unlock(&Lock);
+  return found;
+}
+
+void keycache_store(uint8_t *keyid, uint8_t *csn, bool elite, uint8_t *div_key)
+{
+  uint32_t hash, i, clock;
+  keycache_slot *slot, *victim= NULL;
+
+  if(!Cache)
+    return;
+  hash= keycache_hash(keyid, csn, elite);
+  pthread_mutex_lock(&Lock);
+  // skip the store rather than write a slot another process may be reading
+  if(keycache_lock(LOCK_EX))
+    {
+    pthread_mutex_unlock(&Lock);
+    return;
+    }
+  for(i= 0 ; i < KEYCACHE_PROBE ; ++i)
+    {
+    slot= keycache_slot_at(hash + i);
+    // already there (another process got in first), empty, or oldest so far
+    if(keycache_match(slot, keyid, csn, elite) || !slot->stamp)
+      {
+      victim= slot;
+      break;
+      }
+    if(!victim || slot->stamp < victim->stamp)
+      victim= slot;
+    }
+  memcpy(&clock, &Cache[12], 4);
+  if(++clock == 0)
+    clock= 1;
+  memcpy(&Cache[12], &clock, 4);
+  // stamp goes last so a half written slot never matches
+  victim->stamp= 0;
+  memcpy(victim->keyid, keyid, 8);
+  memcpy(victim->csn, csn, 8);
+  memcpy(victim->div_key, div_key, 8);
+  victim->elite= elite;
+  victim->stamp= clock;
+  keycache_lock(LOCK_UN);
+  pthread_mutex_unlock(&Lock);
+}
@@ -0,0 +1,459 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file keysearch.c
+ * @brief distributed master key search against reader transcripts
+ *
+ * A candidate is a master key: the known bits from -d with the bits of the
+ * candidate number spread over MASK, the unknown bits. Each candidate is
+ * diversified for the CSN of the first transcript record and checked
+ * against its reader MAC. The few that pass are checked against every
+ * record, tag MACs included.
+ *
+ * The coordinator hands out leases of KEYSEARCH_LEASE candidates to workers
+ * over a socket, one at a time, and never searches itself. Leases of workers
+ * that disconnect, or that haven't answered within KEYSEARCH_TIMEOUT, are
+ * issued again before new ones. A late answer still counts. Leases are big
+ * enough that the coordinator is idle nearly all the time, so run one worker
+ * per core on as many hosts as you have.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "keysearch.h"
+#include "audit.h"
+#include "iclass.h"
+#include "mac.h"
+#include "net.h"
+
+// loclass includes
+#include "elite_crack.h"
+
+#define KEYSEARCH_PROGRESS	10	// seconds between progress lines
+
+typedef struct {
+  int fd;
+  uint8_t in[sizeof(keysearch_report)];
+  size_t inlen;
+  bool waiting;			// has no lease
+} keysearch_worker;
+
+// a lease that hasn't been answered
+typedef struct {
+  uint32_t id;
+  uint64_t start;
+  uint32_t count;
+  int owner;			// worker socket, -1 if it needs issuing again
+  time_t issued;
+} keysearch_pending;
+
+static void keysearch_put(uint8_t *p, uint64_t value, int len)
+{
+  while(len--)
+    {
+    p[len]= (uint8_t) value;
+    value >>= 8;
+    }
+}
+
+static uint64_t keysearch_get(const uint8_t *p, int len)
+{
+  uint64_t value= 0;
+
+  while(len--)
+    value= value << 8 | *p++;
+  return value;
+}
+
+// spread the low bits of n over the set bits of mask
+static uint64_t keysearch_spread(uint64_t n, uint64_t mask)
+{
+  uint64_t value= 0, bit;
+
+  for(bit= 1 ; mask && n ; bit <<= 1)
+    if(mask & bit)
+      {
+      if(n & 1)
+        value |= bit;
+      n >>= 1;
+      mask &= ~bit;
+      }
+  return value;
+}
+
+// does key give the reader MAC of the first record, or with all, both MACs of every record?
+static bool keysearch_match(keysearch_task *task, uint8_t *key, bool all)
+{
+  uint8_t keytable[128], div_key[8], calc[4];
+  keysearch_record *rec;
+  iclass_mac_ctx ctx;
+  int i;
+
+  if(task->elite)
+    hash2(key, keytable);
+  for(i= 0 ; i < (all ? task->count : 1) ; ++i)
+    {
+    rec= &task->records[i];
+    if(task->elite)
+      divkey_elite_table(rec->csn, keytable, div_key);
+    else
+      iclass_diversify(rec->csn, key, div_key);
+    iclass_mac_init(&ctx, div_key);
+    iclass_mac_update(&ctx, rec->cc_nr, 12);
+    iclass_mac_final(&ctx, calc);
+    if(memcmp(calc, rec->mac, 4))
+      return false;
+    if(!all)
+      continue;
+    // TMAC carries on from the same cipher state
+    iclass_mac_final(&ctx, calc);
+    if(memcmp(calc, rec->tmac, 4))
+      return false;
+    }
+  return true;
+}
+
+// number of unknown key bits
+int keysearch_bits(keysearch_task *task)
+{
+  uint64_t mask= keysearch_get(task->mask, 8);
+  int bits;
+
+  for(bits= 0 ; mask ; mask &= mask - 1)
+    ++bits;
+  return bits;
+}
+
+// load the first KEYSEARCH_MAXRECORDS records of a transcript file - return false if OK or true if failed
+bool keysearch_load(keysearch_task *task, char *filename)
+{
+  char line[256], *p;
+  uint8_t uid[8];
+  keysearch_record *rec;
+  FILE *f;
+  int i;
+
+  if(!(f= fopen(filename, "r")))
+    return true;
+  task->count= 0;
+  while(task->count < KEYSEARCH_MAXRECORDS && fgets(line, sizeof(line), f))
+    {
+    for(p= line ; *p == ' ' || *p == '\t' ; ++p)
+      ;
+    if(*p == '#' || *p == '\r' || *p == '\n' || !*p)
+      continue;
+    rec= &task->records[task->count];
+    if(audit_parse(p, p + strlen(p), uid, rec->cc_nr, rec->mac, rec->tmac))
+      {
+      fclose(f);
+      return true;
+      }
+    // iClass stores uid LSB first but libnfc reverses it
+    for(i= 0 ; i < 8 ; ++i)
+      rec->csn[i]= uid[7 - i];
+    ++task->count;
+    }
+  fclose(f);
+  return !task->count;
+}
+
+static bool keysearch_send_lease(int fd, uint8_t op, keysearch_pending *p)
+{
+  keysearch_lease lease;
+
+  memset(&lease, 0, sizeof(lease));
+  lease.op= op;
+  if(p)
+    {
+    keysearch_put(lease.lease, p->id, 4);
+    keysearch_put(lease.start, p->start, 8);
+    keysearch_put(lease.count, p->count, 4);
+    }
+  return net_xfer(fd, &lease, sizeof(lease), true);
+}
+
+// tell every worker to stop and close the sockets
+static void keysearch_stop(keysearch_worker *workers, int nworkers, int listen_fd)
+{
+  int i;
+
+  for(i= 0 ; i < nworkers ; ++i)
+    if(workers[i].fd >= 0)
+      {
+      keysearch_send_lease(workers[i].fd, KEYSEARCH_OP_STOP, NULL);
+      close(workers[i].fd);
+      }
+  close(listen_fd);
+}
+
+static double keysearch_elapsed(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// hand out the task on target until the key is found or every candidate is searched
+// return 0 if found, 1 if not or -1 if failed
+int keysearch_coordinate(keysearch_task *task, char *target)
+{
+  static struct pollfd fds[KEYSEARCH_MAXWORKERS + 1];
+  static keysearch_worker workers[KEYSEARCH_MAXWORKERS];
+  static keysearch_pending pending[KEYSEARCH_MAXWORKERS * 2];
+  keysearch_pending *p;
+  keysearch_report *report;
+  keysearch_worker *w;
+  struct timespec start, now;
+  uint64_t total, next= 0, searched= 0;
+  uint32_t lease_id= 0, id;
+  time_t progress;
+  double secs;
+  ssize_t got;
+  int listen_fd, fd, i, j, n, nworkers= 0, npending= 0;
+
+  total= 1ULL << keysearch_bits(task);
+  if((listen_fd= net_socket(target, true, KEYSEARCH_MAXWORKERS)) < 0)
+    return -1;
+  printf("\n  Key search on %s: %d unknown bits, %s key, %d record%s\n", target, keysearch_bits(task),
+    task->elite ? "ELITE" : "standard", task->count, task->count == 1 ? "" : "s");
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  progress= start.tv_sec;
+  for(;;)
+    {
+    if(next >= total && !npending)
+      {
+      printf("\n  Key not found - %llu candidates searched in %.1fs\n", (unsigned long long) total, keysearch_elapsed(&start));
+      keysearch_stop(workers, nworkers, listen_fd);
+      return 1;
+      }
+
+    // leases that need issuing again go first
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(i= 0 ; i < nworkers ; ++i)
+      {
+      w= &workers[i];
+      if(!w->waiting)
+        continue;
+      for(p= NULL, j= 0 ; j < npending && !p ; ++j)
+        if(pending[j].owner < 0)
+          p= &pending[j];
+      if(!p && next < total && npending < KEYSEARCH_MAXWORKERS * 2)
+        {
+        p= &pending[npending++];
+        p->id= lease_id++;
+        p->start= next;
+        p->count= total - next < KEYSEARCH_LEASE ? (uint32_t) (total - next) : KEYSEARCH_LEASE;
+        next += p->count;
+        }
+      // nothing left to hand out - wait for the last leases to come back
+      if(!p)
+        break;
+      p->owner= w->fd;
+      p->issued= now.tv_sec;
+      w->waiting= false;
+      if(keysearch_send_lease(w->fd, KEYSEARCH_OP_LEASE, p))
+        p->owner= -1;
+      }
+
+    fds[0].fd= listen_fd;
+    fds[0].events= nworkers < KEYSEARCH_MAXWORKERS ? POLLIN : 0;
+    for(i= 0 ; i < nworkers ; ++i)
+      {
+      fds[i + 1].fd= workers[i].fd;
+      fds[i + 1].events= POLLIN;
+      }
+    if(poll(fds, nworkers + 1, 1000) < 0)
+      {
+      if(errno == EINTR)
+        continue;
+      keysearch_stop(workers, nworkers, listen_fd);
+      return -1;
+      }
+
+    for(i= 0 ; i < nworkers ; ++i)
+      {
+      w= &workers[i];
+      if(!fds[i + 1].revents)
+        continue;
+      if((got= recv(w->fd, &w->in[w->inlen], sizeof(w->in) - w->inlen, 0)) <= 0)
+        {
+        if(got < 0 && errno == EINTR)
+          continue;
+        for(j= 0 ; j < npending ; ++j)
+          if(pending[j].owner == w->fd)
+            pending[j].owner= -1;
+        close(w->fd);
+        w->fd= -1;
+        continue;
+        }
+      if((w->inlen += got) < sizeof(w->in))
+        continue;
+      w->inlen= 0;
+      report= (keysearch_report *) w->in;
+      if(report->op == KEYSEARCH_OP_HELLO)
+        {
+        if(net_xfer(w->fd, task, sizeof(*task), true))
+          {
+          close(w->fd);
+          w->fd= -1;
+          }
+        else
+          w->waiting= true;
+        continue;
+        }
+      w->waiting= true;
+      // a lease issued twice is counted once, whichever answer comes first
+      id= (uint32_t) keysearch_get(report->lease, 4);
+      for(j= 0 ; j < npending ; ++j)
+        if(pending[j].id == id)
+          {
+          searched += pending[j].count;
+          pending[j]= pending[--npending];
+          break;
+          }
+      if(!report->found)
+        continue;
+      if(!keysearch_match(task, report->key, true))
+        {
+        printf("  Wrong key from worker - ignored\n");
+        continue;
+        }
+      secs= keysearch_elapsed(&start);
+      printf("\n  Key found: %016llX after %.1fs\n", (unsigned long long) keysearch_get(report->key, 8), secs);
+      keysearch_stop(workers, nworkers, listen_fd);
+      return 0;
+      }
+    for(i= n= 0 ; i < nworkers ; ++i)
+      if(workers[i].fd >= 0)
+        workers[n++]= workers[i];
+    nworkers= n;
+
+    if(fds[0].revents & POLLIN && (fd= accept(listen_fd, NULL, NULL)) >= 0)
+      {
+      workers[nworkers].fd= fd;
+      workers[nworkers].inlen= 0;
+      workers[nworkers++].waiting= false;
+      }
+
+    // workers that went quiet lose their lease, but may still answer it
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(j= 0 ; j < npending ; ++j)
+      if(pending[j].owner >= 0 && now.tv_sec - pending[j].issued > KEYSEARCH_TIMEOUT)
+        pending[j].owner= -1;
+    if(now.tv_sec - progress >= KEYSEARCH_PROGRESS)
+      {
+      progress= now.tv_sec;
+      secs= keysearch_elapsed(&start);
+      printf("  %llu of %llu candidates (%.1f%%), %.0f/s, %d worker%s\n", (unsigned long long) searched, (unsigned long long) total,
+        searched * 100.0 / total, searched / secs, nworkers, nworkers == 1 ? "" : "s");
+      fflush(stdout);
+      }
+    }
+}
+
+// search leases from the coordinator at target until told to stop - return false if OK or true if failed
+bool keysearch_work(char *target)
+{
+  static keysearch_task task;
+  keysearch_lease lease;
+  keysearch_report report;
+  uint64_t mask, known, value;
+  uint32_t count, leases= 0;
+  uint8_t key[8];
+  int fd;
+
+  if((fd= net_socket(target, false, 0)) < 0)
+    return true;
+  memset(&report, 0, sizeof(report));
+  report.op= KEYSEARCH_OP_HELLO;
+  if(net_xfer(fd, &report, sizeof(report), true) || net_xfer(fd, &task, sizeof(task), false)
+     || !task.count || task.count > KEYSEARCH_MAXRECORDS)
+    {
+    close(fd);
+    return true;
+    }
+  mask= keysearch_get(task.mask, 8);
+  known= keysearch_get(task.key, 8) & ~mask;
+  printf("\n  Key search worker on %s\n", target);
+  fflush(stdout);
+  report.op= KEYSEARCH_OP_NEXT;
+  for(;;)
+    {
+    if(net_xfer(fd, &lease, sizeof(lease), false) || (lease.op != KEYSEARCH_OP_LEASE && lease.op != KEYSEARCH_OP_STOP))
+      {
+      close(fd);
+      return true;
+      }
+    if(lease.op == KEYSEARCH_OP_STOP)
+      break;
+    memcpy(report.lease, lease.lease, 4);
+    report.found= 0;
+    // step through the masked bits in order by carrying across the known ones
+    value= keysearch_spread(keysearch_get(lease.start, 8), mask);
+    for(count= (uint32_t) keysearch_get(lease.count, 4) ; count-- ; value= ((value | ~mask) + 1) & mask)
+      {
+      keysearch_put(key, known | value, 8);
+      if(keysearch_match(&task, key, false) && keysearch_match(&task, key, true))
+        {
+        report.found= 1;
+        memcpy(report.key, key, 8);
+        break;
+        }
+      }
+    ++leases;
+    if(net_xfer(fd, &report, sizeof(report), true))
+      {
+      close(fd);
+      return true;
+      }
+    }
+  close(fd);
+  printf("  %u lease%s searched\n", leases, leases == 1 ? "" : "s");
+  return false;
+}
@@ -0,0 +1,100 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file keysearch.h
+ * @brief distributed master key search against reader transcripts
+ */
+
+#ifndef _KEYSEARCH_H_
+#  define _KEYSEARCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KEYSEARCH_MAXRECORDS	8	// transcript records in a task
+#define KEYSEARCH_MAXBITS	48	// unknown key bits
+#define KEYSEARCH_LEASE		0x40000	// candidates per lease
+#define KEYSEARCH_TIMEOUT	120	// seconds before a lease is issued again
+#define KEYSEARCH_MAXWORKERS	256
+
+// message ops
+#define KEYSEARCH_OP_HELLO	0	// worker ready - answered with the task and a lease
+#define KEYSEARCH_OP_NEXT	1	// lease done - answered with the next lease
+#define KEYSEARCH_OP_LEASE	2
+#define KEYSEARCH_OP_STOP	3	// search over - worker exits
+
+// all fields are bytes, so the structs are the wire format (numbers are big endian)
+typedef struct {
+  uint8_t csn[8];
+  uint8_t cc_nr[12];
+  uint8_t mac[4];
+  uint8_t tmac[4];
+} keysearch_record;
+
+// sent once to each worker
+typedef struct {
+  uint8_t elite;
+  uint8_t count;		// records used
+  uint8_t reserved[2];
+  uint8_t key[8];		// known bits of the key
+  uint8_t mask[8];		// unknown bits of the key
+  keysearch_record records[KEYSEARCH_MAXRECORDS];
+} keysearch_task;
+
+// coordinator to worker
+typedef struct {
+  uint8_t op;
+  uint8_t reserved[3];
+  uint8_t lease[4];
+  uint8_t start[8];		// first candidate
+  uint8_t count[4];
+} keysearch_lease;
+
+// worker to coordinator
+typedef struct {
+  uint8_t op;
+  uint8_t found;
+  uint8_t reserved[2];
+  uint8_t lease[4];
+  uint8_t key[8];
+} keysearch_report;
+
+int keysearch_bits(keysearch_task *task);
+bool keysearch_load(keysearch_task *task, char *filename);
+int keysearch_coordinate(keysearch_task *task, char *target);
+bool keysearch_work(char *target);
+#endif // _KEYSEARCH_H_
@@ -0,0 +1,439 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file keyservice.c
+ * @brief key service - keeps master keys off reader hosts and does their crypto over a socket
+ *
+ * The service is nfc-iclass run with the master keys and -s. Reader hosts run
+ * with -U and no keys. They send the CSN and the bytes to be MACed, and get back
+ * MACs and, for a re-key, the key block data, so neither master keys nor
+ * diversified keys reach the reader host. Requests and replies are fixed size
+ * (keyservice_request and keyservice_reply), which a client can pipeline.
+ *
+ * The service is one thread and one poll() loop. Each round takes every complete
+ * request from every client as one batch. A (key, CSN) pair is diversified only
+ * once per batch, so the AUTH, UPDATEs and re-key of one card share a derivation.
+ * hash2 of ELITE master keys is done once at start-up, which leaves hash1 and
+ * one DES per card. Each client then gets all its replies in a single send.
+ * Client sockets are non-blocking: replies a client isn't reading yet wait in
+ * its output buffer, and its requests wait until there is room for them, so a
+ * slow reader host never holds up the others.
+ *
+ * There is no client authentication, so the service only listens where the
+ * kernel can vouch for the client: a Unix socket, whose peers must run as the
+ * service's user or group, or TCP on loopback. Remote reader hosts reach it
+ * through a tunnel.
+ */
+
+// struct ucred for SO_PEERCRED
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "keyservice.h"
+#include "net.h"
+#include "iclass.h"
+#include "mac.h"
+#include "metrics.h"
+#include "elite_crack.h"
+
+typedef struct {
+  int fd;
+  uint8_t in[KEYSERVICE_QUEUE * sizeof(keyservice_request)];
+  size_t inlen;
+  uint8_t out[KEYSERVICE_QUEUE * 2 * sizeof(keyservice_reply)];
+  size_t outlen;		// replies not sent yet
+} keyservice_client;
+
+// a card key derived for the current batch
+typedef struct {
+  uint8_t key;
+  uint8_t csn[8];
+  uint8_t div_key[8];
+  iclass_mac_ctx mac;
+} keyservice_card;
+
+// service side
+static uint8_t Keys[KEYSERVICE_KEYS][8];
+static uint8_t Tables[KEYSERVICE_KEYS][128];	// hash2 of ELITE keys
+static bool Have[KEYSERVICE_KEYS], Elite[KEYSERVICE_KEYS];
+static keyservice_client Clients[KEYSERVICE_MAXCLIENTS];
+static int Nclients= 0;
+static keyservice_card Cards[KEYSERVICE_MAXCLIENTS * KEYSERVICE_QUEUE * 2];
+static int Ncards;
+
+// reader side
+static int Service_fd= -1;
+static uint8_t Held;		// bitmap of keys the service has
+static pthread_mutex_t Lock= PTHREAD_MUTEX_INITIALIZER;
+
+// hold master key for a KEYSERVICE_KEY_* slot
+void keyservice_key(int key, uint8_t *master, bool elite)
+{
+  memcpy(Keys[key], master, 8);
+  Elite[key]= elite;
+  Have[key]= true;
+  if(elite)
+    hash2(master, Tables[key]);
+}
+
+// diversified key for csn, derived at most once per batch
+static keyservice_card *keyservice_card_get(uint8_t key, uint8_t *csn)
+{
+  keyservice_card *card;
+  uint64_t start;
+  int i;
+
+  for(i= 0 ; i < Ncards ; ++i)
+    if(Cards[i].key == key && !memcmp(Cards[i].csn, csn, 8))
+      return &Cards[i];
+  card= &Cards[Ncards++];
+  card->key= key;
+  memcpy(card->csn, csn, 8);
+  start= metrics_now();
+  if(Elite[key])
+    divkey_elite_table(csn, Tables[key], card->div_key);
+  else
+    iclass_diversify(csn, Keys[key], card->div_key);
+  metrics_observe(METRIC_CRYPTO_DIVKEY, start);
+  iclass_mac_init(&card->mac, card->div_key);
+  return card;
+}
+
+static void keyservice_answer(keyservice_request *rq, keyservice_reply *reply)
+{
+  keyservice_card *card, *rekey;
+  iclass_mac_ctx ctx;
+  uint8_t frame[9];
+  int i;
+
+  memset(reply, 0, sizeof(*reply));
+  if(rq->op == KEYSERVICE_OP_INFO)
+    {
+    for(i= 0 ; i < KEYSERVICE_KEYS ; ++i)
+      if(Have[i])
+        reply->data[0] |= 1 << i;
+    return;
+    }
+  if(rq->key >= KEYSERVICE_KEYS || !Have[rq->key])
+    {
+    reply->status= KEYSERVICE_NOKEY;
+    return;
+    }
+  card= keyservice_card_get(rq->key, rq->csn);
+  ctx= card->mac;
+  switch(rq->op)
+    {
+    case KEYSERVICE_OP_AUTH:
+      // card MAC carries straight on from the reader MAC
+      iclass_mac_update(&ctx, rq->data, 12);
+      iclass_mac_final(&ctx, reply->data);
+      iclass_mac_final(&ctx, &reply->data[4]);
+      break;
+
+    case KEYSERVICE_OP_UPDATE:
+      iclass_mac_update(&ctx, rq->data, 9);
+      iclass_mac_final(&ctx, reply->data);
+      break;
+
+    case KEYSERVICE_OP_REKEY:
+      // block 3 holds DEBIT and block 4 CREDIT - the new key is written xor'd with the one it replaces
+      if(rq->data[0] != (rq->key == KEYSERVICE_KEY_DEBIT ? 3 : 4) || rq->key == KEYSERVICE_KEY_REKEY)
+        {
+        reply->status= KEYSERVICE_BADOP;
+        break;
+        }
+      if(!Have[KEYSERVICE_KEY_REKEY])
+        {
+        reply->status= KEYSERVICE_NOKEY;
+        break;
+        }
+      rekey= keyservice_card_get(KEYSERVICE_KEY_REKEY, rq->csn);
+      frame[0]= rq->data[0];
+      xorstring(&frame[1], rekey->div_key, card->div_key, 8);
+      iclass_mac_update(&ctx, frame, 9);
+      memcpy(reply->data, &frame[1], 8);
+      iclass_mac_final(&ctx, &reply->data[8]);
+      break;
+
+    default:
+      reply->status= KEYSERVICE_BADOP;
+    }
+}
+
+// send as much of the client's output as it will take now - drop it if it has gone
+static void keyservice_flush(keyservice_client *c)
+{
+  ssize_t sent;
+
+  if(c->fd < 0 || !c->outlen)
+    return;
+  if((sent= send(c->fd, c->out, c->outlen, MSG_NOSIGNAL)) < 0)
+    {
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
+    close(c->fd);
+    c->fd= -1;
+    return;
+    }
+  c->outlen -= sent;
+  memmove(c->out, &c->out[sent], c->outlen);
+}
+
+// answer every complete request from every client that has room for the replies - one send per client
+static void keyservice_batch(void)
+{
+  keyservice_client *c;
+  size_t n, room, i;
+
+  Ncards= 0;
+  for(c= Clients ; c < &Clients[Nclients] ; ++c)
+    {
+    if(c->fd < 0)
+      continue;
+    n= c->inlen / sizeof(keyservice_request);
+    if((room= (sizeof(c->out) - c->outlen) / sizeof(keyservice_reply)) < n)
+      n= room;
+    if(!n)
+      continue;
+    for(i= 0 ; i < n ; ++i)
+      keyservice_answer((keyservice_request *) &c->in[i * sizeof(keyservice_request)], (keyservice_reply *) &c->out[c->outlen + i * sizeof(keyservice_reply)]);
+    c->outlen += n * sizeof(keyservice_reply);
+    // keep requests there was no room for, and the start of one that hasn't all arrived
+    c->inlen -= n * sizeof(keyservice_request);
+    memmove(c->in, &c->in[n * sizeof(keyservice_request)], c->inlen);
+    keyservice_flush(c);
+    }
+}
+
+// is the client on fd one the service may answer? Unix peers must share its user or group
+// (the socket is owner and group only), TCP peers must be local
+static bool keyservice_trusted(int fd)
+{
+  struct sockaddr_storage addr;
+  socklen_t len= sizeof(addr);
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t credlen= sizeof(cred);
+#endif // SO_PEERCRED
+
+  if(getsockname(fd, (struct sockaddr *) &addr, &len))
+    return false;
+  if(addr.ss_family == AF_INET)
+    return (ntohl(((struct sockaddr_in *) &addr)->sin_addr.s_addr) >> 24) == 127;
+  if(addr.ss_family != AF_UNIX)
+    return false;
+#ifdef SO_PEERCRED
+  if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen))
+    return false;
+  return cred.uid == 0 || cred.uid == getuid() || cred.gid == getgid();
+#else
+  return true;
+#endif // SO_PEERCRED
+}
+
+// serve keys on target until killed - return true if failed
+bool keyservice_serve(char *target)
+{
+  static struct pollfd fds[KEYSERVICE_MAXCLIENTS + 1];
+  keyservice_client *c;
+  ssize_t got;
+  int listen_fd, fd, i, n;
+
+  if((listen_fd= net_socket(target, true, KEYSERVICE_MAXCLIENTS)) < 0)
+    return true;
+  // loopback only - a Unix socket is checked per client
+  if(!strncmp(target, "tcp:", 4) && !keyservice_trusted(listen_fd))
+    {
+    close(listen_fd);
+    return true;
+    }
+  printf("\n  Key service on %s:%s%s%s\n", target, Have[KEYSERVICE_KEY_DEBIT] ? " DEBIT" : "",
+    Have[KEYSERVICE_KEY_CREDIT] ? " CREDIT" : "", Have[KEYSERVICE_KEY_REKEY] ? " REKEY" : "");
+  fflush(stdout);
+  for(;;)
+    {
+    fds[0].fd= listen_fd;
+    fds[0].events= Nclients < KEYSERVICE_MAXCLIENTS ? POLLIN : 0;
+    for(i= 0 ; i < Nclients ; ++i)
+      {
+      fds[i + 1].fd= Clients[i].fd;
+      fds[i + 1].events= (Clients[i].inlen < sizeof(Clients[i].in) ? POLLIN : 0) | (Clients[i].outlen ? POLLOUT : 0);
+      }
+    if(poll(fds, Nclients + 1, -1) < 0)
+      {
+      if(errno == EINTR)
+        continue;
+      return true;
+      }
+    for(i= 0 ; i < Nclients ; ++i)
+      {
+      c= &Clients[i];
+      if(fds[i + 1].revents & POLLOUT)
+        keyservice_flush(c);
+      if(c->fd < 0 || !(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      // a full input buffer isn't polled for reading, so that is a hangup or error
+      if(c->inlen < sizeof(c->in) && (got= recv(c->fd, &c->in[c->inlen], sizeof(c->in) - c->inlen, 0)) > 0)
+        c->inlen += got;
+      else if(c->inlen >= sizeof(c->in) || got == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+        close(c->fd);
+        c->fd= -1;
+        }
+      }
+    keyservice_batch();
+    for(i= n= 0 ; i < Nclients ; ++i)
+      if(Clients[i].fd >= 0)
+        Clients[n++]= Clients[i];
+    Nclients= n;
+    if(fds[0].revents & POLLIN && (fd= accept(listen_fd, NULL, NULL)) >= 0)
+      {
+      if(!keyservice_trusted(fd) || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        {
+        close(fd);
+        continue;
+        }
+      Clients[Nclients].fd= fd;
+      Clients[Nclients].inlen= 0;
+      Clients[Nclients++].outlen= 0;
+      }
+    }
+  return false;
+}
+
+// one request and its reply - the pipeline producer and the main thread can both call this
+// return false if OK or true if failed
+static bool keyservice_call(uint8_t op, int key, uint8_t *csn, uint8_t *data, size_t len, keyservice_reply *reply)
+{
+  keyservice_request rq;
+  bool ret;
+
+  memset(&rq, 0, sizeof(rq));
+  rq.op= op;
+  rq.key= key;
+  if(csn)
+    memcpy(rq.csn, csn, 8);
+  if(data)
+    memcpy(rq.data, data, len);
+  pthread_mutex_lock(&Lock);
+  ret= Service_fd < 0 || net_xfer(Service_fd, &rq, sizeof(rq), true) || net_xfer(Service_fd, reply, sizeof(*reply), false);
+  pthread_mutex_unlock(&Lock);
+  return ret || reply->status != KEYSERVICE_OK;
+}
+
+// use key service at target instead of local keys - return false if OK or true if failed
+bool keyservice_connect(char *target)
+{
+  keyservice_reply reply;
+
+  if((Service_fd= net_socket(target, false, 0)) < 0)
+    return true;
+  if(keyservice_call(KEYSERVICE_OP_INFO, 0, NULL, NULL, 0, &reply))
+    {
+    keyservice_close();
+    return true;
+    }
+  Held= reply.data[0];
+  return false;
+}
+
+void keyservice_close(void)
+{
+  if(Service_fd >= 0)
+    close(Service_fd);
+  Service_fd= -1;
+}
+
+bool keyservice_active(void)
+{
+  return Service_fd >= 0;
+}
+
+// return true if the service holds KEYSERVICE_KEY_* key
+bool keyservice_has(int key)
+{
+  return Held & (1 << key);
+}
+
+// reader MAC of CC . NR (12 bytes) in macs[0..3] and the MAC the card should answer with in macs[4..7]
+// return false if OK or true if failed
+bool keyservice_auth(int key, uint8_t *csn, uint8_t *cc_nr, uint8_t *macs)
+{
+  keyservice_reply reply;
+
+  if(keyservice_call(KEYSERVICE_OP_AUTH, key, csn, cc_nr, 12, &reply))
+    return true;
+  memcpy(macs, reply.data, 8);
+  return false;
+}
+
+// MAC of UPDATE block number and data (9 bytes) - return false if OK or true if failed
+bool keyservice_update(int key, uint8_t *csn, uint8_t *block_data, uint8_t *mac)
+{
+  keyservice_reply reply;
+
+  if(keyservice_call(KEYSERVICE_OP_UPDATE, key, csn, block_data, 9, &reply))
+    return true;
+  memcpy(mac, reply.data, 4);
+  return false;
+}
+
+// data (8 bytes) and MAC (4) of the UPDATE of key blockno to the service's REKEY key
+// return false if OK or true if failed
+bool keyservice_rekey(int key, uint8_t *csn, uint8_t blockno, uint8_t *data_mac)
+{
+  keyservice_reply reply;
+
+  if(keyservice_call(KEYSERVICE_OP_REKEY, key, csn, &blockno, 1, &reply))
+    return true;
+  memcpy(data_mac, reply.data, 12);
+  return false;
+}
@@ -0,0 +1,103 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file keyservice.h
+ * @brief key service - keeps master keys off reader hosts and does their crypto over a socket
+ */
+
+#ifndef _KEYSERVICE_H_
+#  define _KEYSERVICE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// keys held by the service
+#define KEYSERVICE_KEY_DEBIT	0
+#define KEYSERVICE_KEY_CREDIT	1
+#define KEYSERVICE_KEY_REKEY	2	// new key for re-keying DEBIT or CREDIT
+#define KEYSERVICE_KEYS		3
+
+// request ops
+#define KEYSERVICE_OP_INFO	0	// bitmap of keys held
+#define KEYSERVICE_OP_AUTH	2	// reader MAC and expected card MAC for CC . NR
+#define KEYSERVICE_OP_UPDATE	3	// MAC for UPDATE of block with data
+#define KEYSERVICE_OP_REKEY	4	// key block data and MAC to change key to REKEY
+
+// reply status
+#define KEYSERVICE_OK		0
+#define KEYSERVICE_NOKEY	1	// key not held
+#define KEYSERVICE_BADOP	2
+
+#define KEYSERVICE_MAXCLIENTS	64
+#define KEYSERVICE_QUEUE	16	// requests read from one client per batch
+
+// all fields are bytes, so the structs are the wire format
+typedef struct {
+  uint8_t op;
+  uint8_t key;			// KEYSERVICE_KEY_*
+  uint8_t reserved[2];
+  uint8_t csn[8];
+  uint8_t data[12];
+} keyservice_request;
+
+typedef struct {
+  uint8_t status;
+  uint8_t reserved[3];
+  uint8_t data[12];
+} keyservice_reply;
+
+#ifndef LEAN
+// service side
+void keyservice_key(int key, uint8_t *master, bool elite);
+bool keyservice_serve(char *target);
+// reader side
+bool keyservice_connect(char *target);
+void keyservice_close(void);
+bool keyservice_active(void);
+bool keyservice_has(int key);
+bool keyservice_auth(int key, uint8_t *csn, uint8_t *cc_nr, uint8_t *macs);
+bool keyservice_update(int key, uint8_t *csn, uint8_t *block_data, uint8_t *mac);
+bool keyservice_rekey(int key, uint8_t *csn, uint8_t blockno, uint8_t *data_mac);
+#else
+// no key service in the lean build - keys are always local
+static inline bool keyservice_active(void) { return false; }
+static inline bool keyservice_auth(int key, uint8_t *csn, uint8_t *cc_nr, uint8_t *macs) { return true; }
+static inline bool keyservice_update(int key, uint8_t *csn, uint8_t *block_data, uint8_t *mac) { return true; }
+static inline bool keyservice_rekey(int key, uint8_t *csn, uint8_t blockno, uint8_t *data_mac) { return true; }
+#endif // LEAN
+#endif // _KEYSERVICE_H_
@@ -0,0 +1,356 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file metrics.c
+ * @brief run statistics exported in OpenMetrics text format
+ *
+ * Counters and latency histograms are plain arrays updated with relaxed atomic
+ * adds, so the RF path and the UPDATE frame producer thread never take a lock.
+ * Readers of the numbers (the exporter) may see one histogram a count behind
+ * another, which doesn't matter for statistics.
+ *
+ * The numbers are exported either as a text file, rewritten after every card
+ * (via a rename, so a collector never sees half of one), or served on a Unix
+ * or localhost TCP socket. The socket answers HTTP GET with a proper header so
+ * Prometheus or curl can scrape it, and anything else with just the text.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+#define METRICS_TEXTMAX		32768	// rendered text (about 13K with every histogram)
+
+uint64_t Metric_counters[METRIC_COUNTERS];
+bool Metrics_enabled= false;
+
+static metric_hist Metric_hists[METRIC_HISTOGRAMS];
+static char *Metrics_file= NULL;	// text file to rewrite, or NULL if serving
+static char Metrics_socket[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static int Listen_fd= -1;
+
+// bucket upper bounds - microseconds for binning, seconds for the le label
+static const uint64_t Bucket_us[METRIC_BUCKETS]= { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000 };
+static const char *Bucket_le[METRIC_BUCKETS]= { "0.00005", "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1.0" };
+
+// whole cards take from a tenth of a second to tens of seconds (bulk write, retries)
+static const uint64_t Card_bucket_us[METRIC_BUCKETS]= { 100000, 250000, 500000, 750000, 1000000, 1500000, 2000000, 3000000, 5000000, 7500000, 10000000, 15000000, 20000000, 30000000 };
+static const char *Card_bucket_le[METRIC_BUCKETS]= { "0.1", "0.25", "0.5", "0.75", "1.0", "1.5", "2.0", "3.0", "5.0", "7.5", "10.0", "15.0", "20.0", "30.0" };
+
+// metric family, label and help - consecutive entries with the same family share TYPE and HELP
+typedef struct {
+  char *family;
+  char *label;
+  char *help;
+} metric_name;
+
+static const metric_name Counter_names[METRIC_COUNTERS]= {
+  { "iclass_cards", NULL, "Cards processed" },
+  { "iclass_cards_failed", NULL, "Cards the job failed on" },
+  { "iclass_auth_failures", "key=\"debit\"", "Authentication failures by key type" },
+  { "iclass_auth_failures", "key=\"credit\"", NULL },
+  { "iclass_read_retries", NULL, "Block re-reads after a bad CRC" },
+  { "iclass_read_failures", NULL, "Blocks that never read clean" },
+  { "iclass_write_failures", NULL, "Block writes not echoed or failing verify" },
+  { "iclass_rf_errors", NULL, "Reader transceive errors" },
+  { "iclass_polls", NULL, "Polls for a new card" },
+};
+
+static const metric_name Histogram_names[METRIC_HISTOGRAMS]= {
+  { "iclass_rf_latency_seconds", "command=\"select\"", "Reader round trip by iClass command" },
+  { "iclass_rf_latency_seconds", "command=\"actall\"", NULL },
+  { "iclass_rf_latency_seconds", "command=\"identify\"", NULL },
+  { "iclass_rf_latency_seconds", "command=\"anticol\"", NULL },
+  { "iclass_rf_latency_seconds", "command=\"readcheck\"", NULL },
+  { "iclass_rf_latency_seconds", "command=\"check\"", NULL },
+  { "iclass_rf_latency_seconds", "command=\"read\"", NULL },
+  { "iclass_rf_latency_seconds", "command=\"read4\"", NULL },
+  { "iclass_rf_latency_seconds", "command=\"update\"", NULL },
+  { "iclass_rf_latency_seconds", "command=\"halt\"", NULL },
+  { "iclass_rf_latency_seconds", "command=\"other\"", NULL },
+  { "iclass_crypto_seconds", "op=\"divkey\"", "Time spent in crypto by operation" },
+  { "iclass_crypto_seconds", "op=\"mac\"", NULL },
+  { "iclass_crypto_seconds", "op=\"3des\"", NULL },
+  { "iclass_card_seconds", NULL, "Time to process a card" },
+};
+
+// record time since start (from metrics_now()) in histogram h
+void metrics_observe(metric_histogram h, uint64_t start)
+{
+  const uint64_t *bucket_us= h == METRIC_CARD ? Card_bucket_us : Bucket_us;
+  struct timespec ts;
+  uint64_t ns;
+  int i;
+
+  if(!start)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns= (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec - start;
+  for(i= 0 ; i < METRIC_BUCKETS && ns > bucket_us[i] * 1000 ; ++i)
+    ;
+  __atomic_fetch_add(&Metric_hists[h].buckets[i], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&Metric_hists[h].count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&Metric_hists[h].sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+static uint64_t metrics_load(uint64_t *p)
+{
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+// append to buf - output that won't fit is dropped whole
+static void metrics_put(char *buf, size_t len, size_t *n, const char *format, ...)
+{
+  va_list ap;
+  int ret;
+
+  va_start(ap, format);
+  ret= vsnprintf(buf + *n, len - *n, format, ap);
+  va_end(ap);
+  if(ret > 0 && (size_t) ret < len - *n)
+    *n += ret;
+  else
+    buf[*n]= '\0';
+}
+
+// print family header if name starts a new family
+static void metrics_family(char *buf, size_t len, size_t *n, const metric_name *name, const metric_name *prev, char *type)
+{
+  if(prev && !strcmp(prev->family, name->family))
+    return;
+  metrics_put(buf, len, n, "# TYPE %s %s\n", name->family, type);
+  if(!strcmp(type, "histogram"))
+    metrics_put(buf, len, n, "# UNIT %s seconds\n", name->family);
+  metrics_put(buf, len, n, "# HELP %s %s.\n", name->family, name->help);
+}
+
+// render everything as OpenMetrics text - return length
+static int metrics_render(char *buf, size_t len)
+{
+  const metric_name *name;
+  const char **bucket_le;
+  metric_hist *h;
+  uint64_t cumulative;
+  size_t n= 0;
+  int i, j;
+
+  for(i= 0 ; i < METRIC_COUNTERS ; ++i)
+    {
+    name= &Counter_names[i];
+    metrics_family(buf, len, &n, name, i ? &Counter_names[i - 1] : NULL, "counter");
+    if(name->label)
+      metrics_put(buf, len, &n, "%s_total{%s} %llu\n", name->family, name->label, (unsigned long long) metrics_load(&Metric_counters[i]));
+    else
+      metrics_put(buf, len, &n, "%s_total %llu\n", name->family, (unsigned long long) metrics_load(&Metric_counters[i]));
+    }
+  for(i= 0 ; i < METRIC_HISTOGRAMS ; ++i)
+    {
+    name= &Histogram_names[i];
+    h= &Metric_hists[i];
+    bucket_le= i == METRIC_CARD ? Card_bucket_le : Bucket_le;
+    metrics_family(buf, len, &n, name, i ? &Histogram_names[i - 1] : NULL, "histogram");
+    cumulative= 0;
+    for(j= 0 ; j <= METRIC_BUCKETS ; ++j)
+      {
+      cumulative += metrics_load(&h->buckets[j]);
+      metrics_put(buf, len, &n, "%s_bucket{%s%sle=\"%s\"} %llu\n", name->family, name->label ? name->label : "", name->label ? "," : "",
+                  j < METRIC_BUCKETS ? bucket_le[j] : "+Inf", (unsigned long long) cumulative);
+      }
+    if(name->label)
+      {
+      metrics_put(buf, len, &n, "%s_count{%s} %llu\n", name->family, name->label, (unsigned long long) metrics_load(&h->count));
+      metrics_put(buf, len, &n, "%s_sum{%s} %.9f\n", name->family, name->label, metrics_load(&h->sum_ns) / 1e9);
+      }
+    else
+      {
+      metrics_put(buf, len, &n, "%s_count %llu\n", name->family, (unsigned long long) metrics_load(&h->count));
+      metrics_put(buf, len, &n, "%s_sum %.9f\n", name->family, metrics_load(&h->sum_ns) / 1e9);
+      }
+    }
+  metrics_put(buf, len, &n, "# EOF\n");
+  return (int) n;
+}
+
+static bool metrics_send(int fd, char *data, size_t len)
+{
+  ssize_t ret;
+
+  while(len)
+    {
+    if((ret= send(fd, data, len, MSG_NOSIGNAL)) <= 0)
+      {
+      if(ret < 0 && errno == EINTR)
+        continue;
+      return true;
+      }
+    data += ret;
+    len -= ret;
+    }
+  return false;
+}
+
+// answer one scrape per connection
+static void *metrics_server(void *arg)
+{
+  static const char *header= "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n\r\n";
+  struct timeval tv= { 1, 0 };
+  char request[1024], text[METRICS_TEXTMAX];
+  ssize_t got;
+  int fd, len;
+
+  for(;;)
+    {
+    if((fd= accept(Listen_fd, NULL, NULL)) < 0)
+      {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return NULL;
+      }
+    // a plain connect (e.g. socat) sends nothing, so don't wait long for a request
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    got= recv(fd, request, sizeof(request), 0);
+    len= metrics_render(text, sizeof(text));
+    if(got < 4 || memcmp(request, "GET ", 4) || !metrics_send(fd, (char *) header, strlen(header)))
+      metrics_send(fd, text, len);
+    close(fd);
+    }
+  return NULL;
+}
+
+// listen on unix:PATH or tcp:PORT (localhost only) - return false if OK or true if failed
+static bool metrics_listen(char *target)
+{
+  struct sockaddr_un un;
+  struct sockaddr_in in;
+  pthread_t thread;
+  int one= 1;
+
+  if(!strncmp(target, "unix:", 5))
+    {
+    if(strlen(target + 5) >= sizeof(un.sun_path))
+      return true;
+    memset(&un, 0, sizeof(un));
+    un.sun_family= AF_UNIX;
+    strcpy(un.sun_path, target + 5);
+    // left over from a previous run
+    unlink(un.sun_path);
+    if((Listen_fd= socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(Listen_fd, (struct sockaddr *) &un, sizeof(un)))
+      return true;
+    strcpy(Metrics_socket, un.sun_path);
+    }
+  else
+    {
+    memset(&in, 0, sizeof(in));
+    in.sin_family= AF_INET;
+    in.sin_port= htons(atoi(target + 4));
+    in.sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+    if(!in.sin_port || (Listen_fd= socket(AF_INET, SOCK_STREAM, 0)) < 0)
+      return true;
+    setsockopt(Listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(Listen_fd, (struct sockaddr *) &in, sizeof(in)))
+      return true;
+    }
+  if(listen(Listen_fd, 4) || pthread_create(&thread, NULL, metrics_server, NULL))
+    return true;
+  pthread_detach(thread);
+  return false;
+}
+
+// export to target - FILE, unix:PATH or tcp:PORT
+// return false if OK or true if failed
+bool metrics_open(char *target)
+{
+  if(!strncmp(target, "unix:", 5) || !strncmp(target, "tcp:", 4))
+    {
+    if(metrics_listen(target))
+      {
+      if(Listen_fd >= 0)
+        close(Listen_fd);
+      Listen_fd= -1;
+      return true;
+      }
+    }
+  else
+    Metrics_file= target;
+  Metrics_enabled= true;
+  return false;
+}
+
+// rewrite the text file, if that's where metrics go
+void metrics_flush(void)
+{
+  char text[METRICS_TEXTMAX], tmp[1024];
+  FILE *f;
+  int len;
+
+  if(!Metrics_file)
+    return;
+  len= metrics_render(text, sizeof(text));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", Metrics_file);
+  if(!(f= fopen(tmp, "w")))
+    return;
+  if(fwrite(text, 1, len, f) != (size_t) len)
+    {
+    fclose(f);
+    unlink(tmp);
+    return;
+    }
+  if(fclose(f) || rename(tmp, Metrics_file))
+    unlink(tmp);
+}
+
+void metrics_close(void)
+{
+  metrics_flush();
+  if(Listen_fd >= 0 && Metrics_socket[0])
+    unlink(Metrics_socket);
+}
@@ -0,0 +1,129 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file metrics.h
+ * @brief run statistics exported in OpenMetrics text format
+ */
+
+#ifndef _METRICS_H_
+#  define _METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// counters - add to Counter_names in metrics.c as well
+typedef enum {
+  METRIC_CARDS,			// cards processed
+  METRIC_CARDS_FAILED,		// cards the job failed on
+  METRIC_AUTH_FAIL_DEBIT,	// authentication failures with DEBIT key (APP1)
+  METRIC_AUTH_FAIL_CREDIT,	// authentication failures with CREDIT key (APP2)
+  METRIC_READ_RETRIES,		// re-reads after a bad CRC
+  METRIC_READ_FAILURES,		// blocks that never read clean
+  METRIC_WRITE_FAILURES,	// UPDATEs not echoed or failing verify
+  METRIC_RF_ERRORS,		// libnfc transceive errors
+  METRIC_POLLS,			// polls for a new card
+  METRIC_COUNTERS
+} metric_counter;
+
+// latency histograms - add to Histogram_names in metrics.c as well
+typedef enum {
+  METRIC_RF_SELECT,		// libnfc select
+  METRIC_RF_ACTALL,
+  METRIC_RF_IDENTIFY,
+  METRIC_RF_ANTICOL,
+  METRIC_RF_READCHECK,
+  METRIC_RF_CHECK,
+  METRIC_RF_READ,
+  METRIC_RF_READ4,
+  METRIC_RF_UPDATE,
+  METRIC_RF_HALT,
+  METRIC_RF_OTHER,
+  METRIC_CRYPTO_DIVKEY,		// key diversification (including key cache)
+  METRIC_CRYPTO_MAC,		// MAC for CHECK and UPDATE
+  METRIC_CRYPTO_DES,		// 3DES for CONFIG cards
+  METRIC_CARD,			// whole card, select to done
+  METRIC_HISTOGRAMS
+} metric_histogram;
+
+#define METRIC_BUCKETS		14	// upper bounds in Bucket_us (Card_bucket_us for METRIC_CARD) in metrics.c, plus +Inf
+
+typedef struct {
+  uint64_t buckets[METRIC_BUCKETS + 1];
+  uint64_t count;
+  uint64_t sum_ns;
+} metric_hist;
+
+#ifndef LEAN
+extern uint64_t Metric_counters[METRIC_COUNTERS];
+extern bool Metrics_enabled;
+
+bool metrics_open(char *target);
+void metrics_close(void);
+void metrics_flush(void);
+void metrics_observe(metric_histogram h, uint64_t start);
+
+// hot path - counters are always kept, timing only when there is somewhere to export it
+static inline void metrics_inc(metric_counter c)
+{
+  __atomic_fetch_add(&Metric_counters[c], 1, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_add(metric_counter c, uint64_t n)
+{
+  __atomic_fetch_add(&Metric_counters[c], n, __ATOMIC_RELAXED);
+}
+
+// start time in ns for metrics_observe(), or 0 if not timing
+static inline uint64_t metrics_now(void)
+{
+  struct timespec ts;
+
+  if(!Metrics_enabled)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#else
+// no metrics in the lean build
+static inline void metrics_inc(metric_counter c) { }
+static inline void metrics_add(metric_counter c, uint64_t n) { }
+static inline uint64_t metrics_now(void) { return 0; }
+static inline void metrics_observe(metric_histogram h, uint64_t start) { }
+static inline void metrics_flush(void) { }
+#endif // LEAN
+#endif // _METRICS_H_
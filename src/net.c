@@ -0,0 +1,151 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file net.c
+ * @brief sockets for the key service and key search
+ *
+ * Targets are unix:PATH, tcp:PORT (localhost) or tcp:HOST:PORT. Both users
+ * send small fixed size messages and wait for the answer, so TCP sockets
+ * have Nagle turned off.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "net.h"
+
+// socket for unix:PATH, tcp:PORT (localhost) or tcp:HOST:PORT - listening if serving, otherwise connected
+// return socket or -1 if failed
+int net_socket(char *target, bool serve, int backlog)
+{
+  struct sockaddr_un un;
+  struct addrinfo hints, *ai;
+  char host[256], *port;
+  int fd, one= 1;
+
+  if(!strncmp(target, "unix:", 5))
+    {
+    if(strlen(target + 5) >= sizeof(un.sun_path) || (fd= socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      return -1;
+    memset(&un, 0, sizeof(un));
+    un.sun_family= AF_UNIX;
+    strcpy(un.sun_path, target + 5);
+    if(serve)
+      {
+      // left over from a previous run
+      unlink(un.sun_path);
+      // clients are let in by group
+      if(bind(fd, (struct sockaddr *) &un, sizeof(un)) || chmod(un.sun_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) || listen(fd, backlog))
+        {
+        close(fd);
+        return -1;
+        }
+      }
+    else if(connect(fd, (struct sockaddr *) &un, sizeof(un)))
+      {
+      close(fd);
+      return -1;
+      }
+    return fd;
+    }
+  if(strncmp(target, "tcp:", 4))
+    return -1;
+  if((port= strrchr(target + 4, ':')))
+    {
+    if((size_t) (port - target - 4) >= sizeof(host))
+      return -1;
+    memcpy(host, target + 4, port - target - 4);
+    host[port++ - target - 4]= '\0';
+    }
+  else
+    {
+    strcpy(host, "127.0.0.1");
+    port= target + 4;
+    }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family= AF_INET;
+  hints.ai_socktype= SOCK_STREAM;
+  if(getaddrinfo(host, port, &hints, &ai))
+    return -1;
+  if((fd= socket(ai->ai_family, ai->ai_socktype, 0)) >= 0)
+    {
+    if(serve)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(serve ? bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, backlog) : connect(fd, ai->ai_addr, ai->ai_addrlen))
+      {
+      close(fd);
+      fd= -1;
+      }
+    else
+      // messages are small and each one waits for its answer
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+  freeaddrinfo(ai);
+  return fd;
+}
+
+// send or receive all of len - return false if OK or true if failed
+bool net_xfer(int fd, void *buf, size_t len, bool sending)
+{
+  uint8_t *p= (uint8_t *) buf;
+  ssize_t ret;
+
+  while(len)
+    {
+    if((ret= sending ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0)) <= 0)
+      {
+      if(ret < 0 && errno == EINTR)
+        continue;
+      return true;
+      }
+    p += ret;
+    len -= ret;
+    }
+  return false;
+}
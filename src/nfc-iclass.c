@@ -54,6 +54,7 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <nfc/nfc.h>
 #include <fcntl.h>
@@ -61,14 +62,39 @@
 #include "nfc-utils.h"
 #include "iclass.h"
 #include "nfc-iclass.h"
+#include "pipeline.h"
+#include "job.h"
+#include "image.h"
+#include "trace.h"
+#include "keycache.h"
+#include "journal.h"
+#include "hex.h"
+#include "metrics.h"
+#include "prefetch.h"
+#include "keyservice.h"
+#include "timing.h"
+#ifndef LEAN
+#include "audit.h"
+#include "credential.h"
+#include "convert.h"
+#include "store.h"
+#include "calibrate.h"
+#include "keysearch.h"
+#endif // LEAN
 
 #include <openssl/des.h>
 
+#ifndef LEAN
 // loclass includes
 #include "elite_crack.h"
+#endif // LEAN
 
 static nfc_device *pnd;
 static nfc_target nt;
+#ifndef LEAN
+static nfc_device *Tpnd; // clone target reader
+static nfc_target Tnt;
+#endif // LEAN
 // unpermuted version of https://github.com/ss23/hid-iclass-key/blob/master/key
 // permuted is 3F90EBF0910F7B6F
 uint8_t *Default_kd= (uint8_t *) "\xAF\xA7\x85\xA7\xDA\xB3\x33\x78"; 
@@ -78,177 +104,1416 @@ static DES_cblock Key1 = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 static DES_cblock Key2 = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 static DES_key_schedule SchKey1,SchKey2;
 
-#define MAXWRITE 2000 // 0xff * 8 byte blocks - 5 * 8 byte reserved blocks
+#define REREAD_BUDGET	32	// bad CRC re-reads allowed per card
+
+#ifdef LEAN
+#define OPTIONS		"c:C:d:hIk:o:R:w:"
+#else
+#define OPTIONS		"a:A:b:B:c:C:d:D:eFg:G:hi:Ij:J:k:K:lm:M:nNo:p:P:q:Q:r:R:s:S:t:T:u:U:w:W:x:X:y:z:"
+#endif // LEAN
+
+// blocks the UPDATE frame producer should build for one application
+typedef struct {
+  int config;			// CONFIG card index or -1 for none
+  uint8_t *kr;			// KEYROLL key for KEYROLL cards
+  int limit;			// last block of CONFIG card
+  unsigned int writeblock;	// first block of user data or 0 for none
+  uint8_t *writedata;
+  int writelen;
+} write_job;
+
+// re-key campaign state for the card being processed
+typedef struct {
+  bool active;			// re-key is journaled
+  uint8_t csn[8];
+  uint8_t block;		// key block being re-keyed
+  uint8_t old_key[8];		// diversified key the card answered to
+  uint8_t new_key[8];		// diversified key being written
+  bool rekeyed;			// card already holds new_key
+} campaign;
+
+// producer: CONFIG card followed by user data, in the order they will be written
+static void build_frames(iclass_framelist *list, void *arg)
+{
+  write_job *wj= (write_job *) arg;
+  uint8_t data[8];
+  char *note;
+  int i;
+
+  if(wj->config >= 0)
+    for(i= 6 ; i <= wj->limit ; ++i)
+      {
+      iclass_config_block(wj->config, i, wj->kr, &SchKey1, &SchKey2, data);
+      note= NULL;
+      if(wj->kr && i == 0x0d)
+        note= "KEYROLL KEY";
+      if(wj->kr && (i == 0x14 || i == 0x15))
+        note= "Partial KEYROLL KEY";
+      if(pipeline_add(list, i, data, note))
+        return;
+      }
+  for(i= 0 ; i < wj->writelen ; i += 8)
+    if(pipeline_add(list, wj->writeblock + i / 8, &wj->writedata[i], NULL))
+      return;
+}
+
+// return true if any block wj would write is locked
+static bool write_locked(write_job *wj, iclass_card_info *info)
+{
+  int i;
+
+  if(wj->config >= 0)
+    for(i= 6 ; i <= wj->limit ; ++i)
+      if(iclass_block_locked(info, i))
+        {
+        printf("    Block 0x%02x: write locked!\n", i);
+        return true;
+        }
+  for(i= 0 ; i < wj->writelen ; i += 8)
+    if(iclass_block_locked(info, wj->writeblock + i / 8))
+      {
+      printf("    Block 0x%02x: write locked!\n", wj->writeblock + i / 8);
+      return true;
+      }
+  return false;
+}
+
+// read back every block written from frames - return false if OK or true if failed
+static bool verify_frames(nfc_device *dev, iclass_framelist *frames)
+{
+  uint8_t buff[8];
+  int i;
+
+  for(i= 0 ; i < frames->count ; ++i)
+    {
+    // keys always read back as FF
+    if(frames->frames[i].blockno == 3 || frames->frames[i].blockno == 4)
+      continue;
+    if(iclass_read(dev, frames->frames[i].blockno, buff) || memcmp(buff, frames->frames[i].data, 8))
+      {
+      metrics_inc(METRIC_WRITE_FAILURES);
+      printf("    Block 0x%02x: verify failed!\n", frames->frames[i].blockno);
+      return true;
+      }
+    }
+  return false;
+}
+
+// write frames built from wj and apply verify policy - return false if OK or true if failed
+static bool write_blocks(write_job *wj, int verify, iclass_card_info *info)
+{
+  static iclass_framelist frames;
+
+  if(write_locked(wj, info))
+    return errorexit("Write failed!\n");
+  if(pipeline_start(&frames, pnd, build_frames, wj))
+    return errorexit("Can't start UPDATE frame builder!\n");
+  if(pipeline_run(pnd, &frames, info->app1_limit) < 0)
+    return errorexit("Write failed!\n");
+#if DEBUG
+  pipeline_print(&frames);
+#endif
+  if(verify == VERIFY_READBACK && verify_frames(pnd, &frames))
+    return true;
+  printf("\n");
+  return false;
+}
+
+// print block as HEX, ASCII and description
+static void print_block(uint8_t block, uint8_t app1_limit, uint8_t *data)
+{
+  int j;
+
+  printf("    Block 0x%02x: ", block);
+  for(j= 0 ; j < 8 ; ++j)
+    printf("%02x", (uint8_t) data[j]);
+  printf("  ");
+  for(j= 0 ; j < 8 ; ++j)
+    printf("%c", isprint(data[j]) ? (char) data[j] : '.');
+  printf("  ");
+  iclass_print_blocktype(block, app1_limit, data);
+}
+
+// show and optionally save header blocks already read by iclass_read_info()
+static bool show_header(iclass_card_info *info, int outfile)
+{
+  int i;
+
+  for(i= 0 ; i < 6 ; ++i)
+    {
+    print_block(i, info->app1_limit, info->header[i]);
+    if(outfile >= 0)
+      if(write(outfile, info->header[i], 8) != 8)
+        return errorexit("Write to output file failed!\n");
+    printf("\n");
+    }
+  printf("\n");
+  return false;
+}
+
+// read, show and optionally save blocks - return false if OK or true if output failed
+// blocks with a bad CRC are re-read while the card's budget lasts, and any that
+// never read clean are counted in bad (and saved as zeros to keep the dump aligned)
+static bool read_blocks(int from, int to, int app1_limit, int outfile, int *budget, int *bad)
+{
+  uint8_t buff[8];
+  int i, retries;
+
+  for(i= from ; i <= to ; ++i)
+    {
+    if((retries= iclass_read_checked(pnd, i, buff, budget)) >= 0)
+      {
+      print_block(i, app1_limit, buff);
+      if(retries)
+        printf(" (re-read %d)", retries);
+      }
+    else
+      {
+      printf("    Block 0x%02x: read failed!", i);
+      memset(buff, 0x00, 8);
+      ++*bad;
+      }
+    if(outfile >= 0)
+      if(write(outfile, buff, 8) != 8)
+        return errorexit("Write to output file failed!\n");
+    printf("\n");
+    }
+  printf("\n");
+  return false;
+}
+
+// set up campaign for the selected card if its re-key is to be journaled
+static void campaign_init(iclass_job *job, campaign *cp, uint8_t *image)
+{
+  int i;
+
+  memset(cp, 0, sizeof(campaign));
+  if(!job->rekey || !journal_active())
+    return;
+  cp->active= true;
+  // iClass stores uid LSB first but libnfc reverses it
+  for(i= 0 ; i < 8 ; ++i)
+    cp->csn[i]= nt.nti.nhi.abtUID[7 - i];
+  cp->block= job->got_kc ? 4 : 3;
+  // pre-staged image holds new key already diversified for this card
+  if(job->image)
+    memcpy(cp->new_key, &image[cp->block * 8], 8);
+  else
+    iclass_divkey(cp->csn, job->krekey, job->rekey_elite, cp->new_key);
+}
+
+// authenticate with key - or, if it's the key a campaign is changing and the journal
+// has seen this card before, with whichever of the two journaled keys the card holds
+// return true if authed
+static bool campaign_auth(iclass_job *job, campaign *cp, uint8_t *key, bool debit_key)
+{
+  journal_entry *e;
+  bool rekeyed;
+
+  if(!cp->active || cp->block != (debit_key ? 3 : 4))
+    return iclass_authenticate(pnd, nt, key, job->elite, true, debit_key);
+  if(!(e= journal_find(cp->csn, cp->block)))
+    {
+    iclass_divkey(cp->csn, key, job->elite, cp->old_key);
+    return iclass_authenticate(pnd, nt, cp->old_key, false, false, debit_key);
+    }
+  printf("  card is in re-key journal (%s) - trying journaled keys\n\n", e->state == JOURNAL_PENDING ? "interrupted" : "done");
+  // newest first - an interrupted write has usually landed
+  if(iclass_authenticate(pnd, nt, e->new_key, false, false, debit_key))
+    {
+    memcpy(cp->old_key, e->new_key, 8);
+    rekeyed= !memcmp(e->new_key, cp->new_key, 8);
+    if(rekeyed && e->state == JOURNAL_PENDING && journal_commit(cp->csn, cp->block))
+      {
+      errorexit("Can't write re-key journal!\n");
+      return false;
+      }
+    cp->rekeyed= rekeyed;
+    return true;
+    }
+  memcpy(cp->old_key, e->old_key, 8);
+  return iclass_authenticate(pnd, nt, e->old_key, false, false, debit_key);
+}
+
+// re-key with a PENDING journal record written first, then prove the new key by
+// authenticating with it, as the UPDATE echo can't show a key block write
+// return false if OK or true if failed
+static bool campaign_rekey(campaign *cp)
+{
+  bool diversified= Key_Diversified, ret;
+
+  if(cp->rekeyed)
+    {
+    printf("\n  Already Re-Keyed\n");
+    return false;
+    }
+  if(journal_begin(cp->csn, cp->block, cp->old_key, cp->new_key))
+    return errorexit("Can't write re-key journal!\n");
+  // campaign has the new key diversified already
+  Key_Diversified= true;
+  ret= iclass_write(pnd, cp->block, cp->new_key);
+  Key_Diversified= diversified;
+  if(ret)
+    return errorexit(cp->block == 4 ? "Re-Key CREDIT failed!\n" : "Re-Key DEBIT failed!\n");
+  if(!iclass_authenticate(pnd, nt, cp->new_key, false, false, cp->block == 3))
+    return errorexit("Re-Key not confirmed by new key!\n");
+  if(journal_commit(cp->csn, cp->block))
+    return errorexit("Can't write re-key journal!\n");
+  printf("\n  Re-Key OK (journaled)\n");
+  return false;
+}
+
+// start deriving keys for a card that has just been selected, while its header is read
+static void prefetch_card(nfc_target *t)
+{
+  uint8_t csn[8];
+  int i;
+
+  // iClass stores uid LSB first but libnfc reverses it
+  for(i= 0 ; i < 8 ; ++i)
+    csn[i]= t->nti.nhi.abtUID[7 - i];
+  prefetch_start(csn);
+}
+
+#ifndef LEAN
+// blocks of a pre-staged image to write to a card in personalisation mode
+typedef struct {
+  uint8_t *image;
+  int last;			// last block to write
+  uint8_t block1[8];		// config block with the fuses the card should end up with
+  bool config;			// this pass writes block 1 only
+} personalise_job;
+
+// producer: keys and data blocks, or on the second pass config block 1, so the card
+// only leaves personalisation mode once everything else is on it and checked
+static void personalise_frames(iclass_framelist *list, void *arg)
+{
+  personalise_job *pj= (personalise_job *) arg;
+  int i;
+
+  if(pj->config)
+    {
+    pipeline_add_plain(list, 1, pj->block1, NULL);
+    return;
+    }
+  for(i= 3 ; i <= pj->last ; ++i)
+    {
+    // leave a blank card's Kc alone if the image has none
+    if(i == 4 && !memcmp(&pj->image[4 * 8], "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 8))
+      continue;
+    if(pipeline_add_plain(list, i, &pj->image[i * 8], NULL))
+      return;
+    }
+}
+
+// write pre-staged image to a blank card in personalisation mode - the mode needs no
+// authentication and no MACs, so it's one UPDATE per block and no crypto at all
+// return false if OK or true if failed
+static bool manufacture_card(iclass_job *job, iclass_card_info *info, uint8_t *image, int imagelen, struct timespec *start)
+{
+  static iclass_framelist frames;
+  personalise_job pj;
+  struct timespec now;
+  int count;
+
+  if(!info->valid || !info->personalisation)
+    return errorexit("Card is not in personalisation mode!\n");
+  // keys read back as FF, so a plain dump has none
+  if(!memcmp(&image[3 * 8], "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 8))
+    return errorexit("Pre-staged image has no DEBIT key (build it with -G)!\n");
+  pj.image= image;
+  pj.last= MIN(MIN(imagelen, IMAGE_MAXSIZE) / 8 - 1, info->app2_limit);
+  memcpy(pj.block1, &image[8], 8);
+  // image may come from a card in application mode - the job decides
+  if(job->manufacture == MANUFACTURE_COMMIT)
+    pj.block1[7] &= ~FUSE_PERSONALISATION;
+  else
+    pj.block1[7] |= FUSE_PERSONALISATION;
+
+  printf("\n  personalising...\n\n");
+  for(pj.config= false, count= 0 ; ; pj.config= true)
+    {
+    if(pipeline_start(&frames, pnd, personalise_frames, &pj))
+      return errorexit("Can't start UPDATE frame builder!\n");
+    if(pipeline_run(pnd, &frames, pj.block1[0]) < 0)
+      return errorexit("Write failed!\n");
+    count += frames.count;
+    // leaving personalisation mode can't be undone, so a commit always checks the
+    // data blocks first - and block 1 itself is always checked
+    if((pj.config || job->verify == VERIFY_READBACK || job->manufacture == MANUFACTURE_COMMIT) && verify_frames(pnd, &frames))
+      return errorexit(pj.config ? "Config block failed!\n" : "Write failed - card left in personalisation mode!\n");
+    if(pj.config)
+      break;
+    }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  printf("\n  %d blocks written in %.1fms, card in %s mode\n", count,
+    (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6,
+    job->manufacture == MANUFACTURE_COMMIT ? "application" : "personalisation");
+  return false;
+}
+
+// golden image verify - checking stops at the first read that differs
+typedef struct {
+  uint8_t *golden;
+  int checked;			// blocks compared
+  int failed[4];		// blocks that differ (at most one read's worth)
+  int nfailed;
+  char reason[32];		// key or read failure
+} verify_job;
+
+// compare count blocks read from the card, starting at block, with the golden image
+// return true if any differ
+static bool verify_blocks(verify_job *vj, int block, int count, uint8_t *data)
+{
+  int i, j;
+
+  for(i= 0 ; i < count ; ++i, ++block, data += 8)
+    {
+    ++vj->checked;
+    if(!memcmp(data, &vj->golden[block * 8], 8))
+      continue;
+    printf("    Block 0x%02x: expected ", block);
+    for(j= 0 ; j < 8 ; ++j)
+      printf("%02x", vj->golden[block * 8 + j]);
+    printf(", card ");
+    for(j= 0 ; j < 8 ; ++j)
+      printf("%02x", data[j]);
+    printf("\n");
+    vj->failed[vj->nfailed++]= block;
+    }
+  return vj->nfailed > 0;
+}
+
+// read and compare blocks from to to of the authenticated application, four per exchange where
+// the reader and card can - return true if any differ or can't be read
+static bool verify_app(verify_job *vj, int from, int to, int *budget)
+{
+  uint8_t data[32];
+  int i;
+
+  for(i= from ; i <= to ; )
+    {
+    if(to - i >= 3 && iclass_has_read4(pnd) && !iclass_read4(pnd, i, data))
+      {
+      if(verify_blocks(vj, i, 4, data))
+        return true;
+      i += 4;
+      continue;
+      }
+    if(iclass_read_checked(pnd, i, data, budget) < 0)
+      {
+      printf("    Block 0x%02x: read failed!\n", i);
+      snprintf(vj->reason, sizeof(vj->reason), "block 0x%02x unreadable", i);
+      return true;
+      }
+    if(verify_blocks(vj, i++, 1, data))
+      return true;
+    }
+  return false;
+}
+
+// authenticate to one application for a verify - a pre-staged image holds the card's own
+// diversified key, where a dump reads back FF - return true if authed
+static bool verify_auth(iclass_job *job, uint8_t *golden, bool debit)
+{
+  uint8_t *key= &golden[(debit ? 3 : 4) * 8];
+
+  if(memcmp(key, "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 8))
+    return iclass_authenticate(pnd, nt, key, false, false, debit);
+  key= debit ? (job->got_kd ? job->kd : Default_kd) : job->kc;
+  return iclass_authenticate(pnd, nt, key, job->elite, true, debit);
+}
+
+// check the card against the golden image up to block last, in the order most likely to show
+// a difference: config and issuer blocks (already read with the header), the keys (by
+// authenticating), the credential in blocks 6 to 9, then the rest of the card
+// return true at the first difference
+static bool verify_run(iclass_job *job, iclass_card_info *info, verify_job *vj, int last)
+{
+  // block 0 is the CSN, so only an image of this very card has it - block 2 is the e-purse,
+  // which changes with use
+  static const uint8_t header[]= { 1, 5, 0 };
+  int i, budget= REREAD_BUDGET;
+  bool debit;
+
+  if(!info->valid)
+    {
+    snprintf(vj->reason, sizeof(vj->reason), "card header unreadable");
+    return true;
+    }
+  for(i= 0 ; i < (strstr(job->golden, "%s") ? 3 : 2) ; ++i)
+    verify_blocks(vj, header[i], 1, info->header[header[i]]);
+  if(vj->nfailed)
+    return true;
+  // APP1 only if APP2 not requested OR APP1 key specifically provided (as for a single card)
+  for(debit= !job->got_kc || job->got_kd ; ; debit= false)
+    {
+    if(!verify_auth(job, vj->golden, debit))
+      {
+      metrics_inc(debit ? METRIC_AUTH_FAIL_DEBIT : METRIC_AUTH_FAIL_CREDIT);
+      snprintf(vj->reason, sizeof(vj->reason), "%s key", debit ? "DEBIT" : "CREDIT");
+      return true;
+      }
+    if(verify_app(vj, debit ? 6 : info->app1_limit + 1, MIN(debit ? info->app1_limit : info->app2_limit, last), &budget))
+      return true;
+    if(!debit || !job->got_kc)
+      break;
+    }
+  return false;
+}
+
+// verify card against golden image and print the result as one line
+// return false if the card matches or true if not
+static bool verify_card(iclass_job *job, iclass_card_info *info, uint8_t *golden, int goldenlen, char *uid, struct timespec *start)
+{
+  verify_job vj;
+  struct timespec now;
+  double ms;
+  bool failed;
+  int i;
+
+  memset(&vj, 0, sizeof(vj));
+  vj.golden= golden;
+  printf("\n  verifying against golden image...\n\n");
+  failed= verify_run(job, info, &vj, goldenlen / 8 - 1);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms= (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+  if(!failed)
+    {
+    printf("\n  VERIFY PASS %s: %d blocks checked in %.1fms\n", uid, vj.checked, ms);
+    return false;
+    }
+  printf("\n  VERIFY FAIL %s: ", uid);
+  if(vj.nfailed)
+    {
+    printf("block%s", vj.nfailed == 1 ? "" : "s");
+    for(i= 0 ; i < vj.nfailed ; ++i)
+      printf(" 0x%02x", vj.failed[i]);
+    }
+  else
+    printf("%s", vj.reason);
+  printf(" (%d blocks checked in %.1fms)\n", vj.checked, ms);
+  return true;
+}
+#endif // LEAN
+
+// run job against one book of the selected card, whose header is in info
+// image is the book's part of a pre-staged image and outfile is at the book's place in the dump
+// return false if OK or true if failed
+static bool run_book(iclass_job *job, iclass_card_info *info, campaign *camp, uint8_t *image, int imagelen, int outfile, int *budget, int *bad)
+{
+  int i, app1_limit= info->app1_limit, app2_limit= info->app2_limit;
+  uint8_t *key;
+  write_job wj;
+
+  printf("\n  reading header blocks...\n\n");
+  if(info->valid)
+    {
+    if(show_header(info, outfile))
+      return true;
+    }
+  else
+    read_blocks(0, 5, app1_limit, outfile, budget, bad);
+
+  // APP1 operations only if APP2 not requested OR APP1 key specifically provided
+  // (this allows you to get past an unknown key for APP1 without causing an auth error)
+  if(!job->got_kc || job->got_kd)
+  {
+     // authenticate with default Debit key if no key provided
+    if(job->got_kd)
+      key= job->kd;
+    else
+      key= Default_kd;
+    if(keyservice_active())
+      printf("  authing to APP1 with key service\n\n");
+    else
+      {
+      printf("  authing to APP1 with key: ");
+      for(i= 0 ; i < 8 ; ++i)
+        printf("%02x", key[i]);
+      printf("\n\n");
+      }
+    if(!campaign_auth(job, camp, key, true))
+    {
+      metrics_inc(METRIC_AUTH_FAIL_DEBIT);
+      ERR("authentication failed\n");
+      return true;
+    }
+
+    // write config card and/or APP1 data if specified
+    wj.config= -1;
+    wj.kr= NULL;
+    wj.writelen= 0;
+    if(job->config >= 0)
+      {
+      wj.config= job->config;
+      wj.limit= app1_limit;
+      // keyroll card
+      if(!strncasecmp(Config_cards[job->config], "KR", 2))
+        {
+        if(!job->got_kr)
+          {
+          printf("\nPlease specify KEYROLL key!\n");
+          return true;
+          }
+        if(app1_limit < 0x16)
+          return errorexit("\nAPP1 too small for KEYROLL!\n");
+        // keyroll cards are 3DES encrypted for block 0x0d upwards
+        DES_set_key_unchecked(&Key1, &SchKey1);
+        DES_set_key_unchecked(&Key2, &SchKey2);
+        wj.kr= job->kr;
+        printf("\n  Writing KEYROLL card: %s\n\n", Config_cards[job->config]);
+        }
+      else
+        printf("\n  Writing CONFIG card: %s\n\n", Config_cards[job->config]);
+      }
+    if(job->image)
+      {
+      // image blocks 6 to end of APP1 (or image)
+      wj.config= -1;
+      wj.writeblock= 6;
+      wj.writedata= &image[6 * 8];
+      wj.writelen= (MIN(app1_limit, imagelen / 8 - 1) - 5) * 8;
+      printf("\n  writing pre-staged image...\n\n");
+      }
+    else if(job->writeblock && job->writeblock <= app1_limit)
+      {
+      wj.writeblock= job->writeblock;
+      wj.writedata= job->writedata;
+      wj.writelen= job->writelen;
+      if(job->config < 0)
+        printf("\n  writing...\n\n");
+      }
+    if(wj.config >= 0 || wj.writelen)
+      if(write_blocks(&wj, job->verify, info))
+        return true;
+
+    // show APP1
+    printf("  reading APP1 blocks...\n\n");
+    if(read_blocks(6, app1_limit, app1_limit, outfile, budget, bad))
+      return true;
+  } // end of APP1 operations
+
+  // show APP2 if requested
+  if(job->got_kc)
+  {
+    key= job->kc;
+    if(keyservice_active())
+      printf("  authing to APP2 with key service\n\n");
+    else
+      {
+      printf("  authing to APP2 with key: ");
+      for(i= 0 ; i < 8 ; ++i)
+        printf("%02x", key[i]);
+      printf("\n\n");
+      }
+    if(!campaign_auth(job, camp, key, false)) {
+      metrics_inc(METRIC_AUTH_FAIL_CREDIT);
+      ERR("authentication failed\n");
+      return true;
+    }
+
+    // write to APP2
+    if(job->image && imagelen / 8 - 1 > app1_limit)
+      {
+      printf("\n  writing pre-staged image...\n\n");
+      wj.config= -1;
+      wj.writeblock= app1_limit + 1;
+      wj.writedata= &image[(app1_limit + 1) * 8];
+      wj.writelen= (MIN(app2_limit, imagelen / 8 - 1) - app1_limit) * 8;
+      if(write_blocks(&wj, job->verify, info))
+        return true;
+      }
+    else if(!job->image && job->writeblock && job->writeblock > app1_limit)
+      {
+      printf("\n  writing...\n\n");
+      wj.config= -1;
+      wj.writeblock= job->writeblock;
+      wj.writedata= job->writedata;
+      wj.writelen= job->writelen;
+      if(write_blocks(&wj, job->verify, info))
+        return true;
+      }
+
+    printf("  reading APP2 blocks:\n\n");
+    if(read_blocks(app1_limit + 1, app2_limit, app1_limit, outfile, budget, bad))
+      return true;
+  }
+
+  // rekey last so we don't have to worry about re-authing
+  if(job->rekey)
+    {
+    Elite_Override= !job->rekey_elite;
+    // pre-staged image holds new key already diversified for this card
+    if(job->image)
+      {
+      Key_Diversified= true;
+      memcpy(job->krekey, &image[(job->got_kc ? 4 : 3) * 8], 8);
+      }
+    if(iclass_block_locked(info, job->got_kc ? 4 : 3))
+      return errorexit("Keys are locked - can't Re-Key!\n");
+    if(camp->active)
+      {
+      if(campaign_rekey(camp))
+        return true;
+      }
+    // block 3 (debit key) or 4 (credit key) writes will be xor'd as appropriate
+    else if(job->got_kc)
+      {
+      if(iclass_write(pnd, 4, job->krekey))
+        return errorexit("Re-Key CREDIT failed!\n");
+      }
+    else
+      {
+      if(iclass_write(pnd, 3, job->krekey))
+        return errorexit("Re-Key DEBIT failed!\n");
+      }
+    if(!camp->active)
+      printf("\n  Re-Key OK\n");
+    }
+
+  return false;
+}
+
+// run job against the selected card - return false if OK or true if failed
+static bool run_card(iclass_job *job)
+{
+  int book, last, outfile= -1;
+  int budget= REREAD_BUDGET, bad= 0;
+  iclass_card_info info;
+  campaign camp;
+  char uid[17], path[1024];
+#ifndef LEAN
+  static uint8_t image[IMAGE_MAXLOAD];
+#else
+  uint8_t *image= NULL;
+#endif // LEAN
+  int imagelen= 0, booklen;
+  struct timespec start;
+  bool ret= false;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  prefetch_reset();
+  prefetch_card(&nt);
+
+  // Get the info from the current tag
+  hex_encode(nt.nti.nhi.abtUID, 8, uid);
+  uid[16]= '\0';
+  printf("Found iClass card with UID: %s\n", uid);
+
+#ifndef LEAN
+  // pre-staged image replaces CONFIG card and WRITE data
+  if(job->image && (imagelen= image_load(job->image, uid, image)) < 0)
+    return errorexit("Can't load pre-staged image!\n");
+  if(job->golden && (imagelen= image_load(job->golden, uid, image)) < 0)
+    return errorexit("Can't load golden image!\n");
+#endif // LEAN
+  campaign_init(job, &camp, image);
+
+  if(job->dumpfile)
+    {
+    job_path(path, sizeof(path), job->dumpfile, uid);
+    if((outfile= open(path, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) < 0)
+      return errorexit("Can't open output file!\n");
+    }
+
+  // one pass over the header - everything below works from this
+  if(iclass_read_info(pnd, &info))
+    printf("  could not determine card type!\n");
+  else
+    iclass_print_info(&info);
+
+#ifndef LEAN
+  if(job->manufacture)
+    {
+    ret= manufacture_card(job, &info, image, imagelen, &start);
+    goto done;
+    }
+  // the book the card came up in - book n of the image starts at block n * ICLASS_BOOK_BLOCKS
+  if(job->golden)
+    {
+    booklen= imagelen - info.book * ICLASS_BOOK_BLOCKS * 8;
+    if(booklen < 6 * 8)
+      ret= errorexit("Golden image has no data for this book!\n");
+    else
+      ret= verify_card(job, &info, &image[info.book * ICLASS_BOOK_BLOCKS * 8], MIN(booklen, ICLASS_BOOK_BLOCKS * 8), uid, &start);
+    goto done;
+    }
+#endif // LEAN
+
+  // 32K card books - the one the card came up in is used as it is, the other is
+  // switched to with PAGESEL rather than a new select
+  book= last= info.book;
+  if(job->book != BOOK_CURRENT)
+    {
+    if(!info.valid || (job->book >= 0 && job->book >= info.books))
+      {
+      ret= errorexit(info.valid ? "Card has no such book!\n" : "Can't select book of unknown card!\n");
+      goto done;
+      }
+    book= job->book == BOOK_ALL ? 0 : job->book;
+    last= job->book == BOOK_ALL ? info.books - 1 : book;
+    }
+  for( ; book <= last ; ++book)
+    {
+    if(book != info.book)
+      {
+      printf("\n  selecting book %d...\n", book);
+      if(iclass_select_book(pnd, book) || iclass_read_info(pnd, &info))
+        {
+        ret= errorexit("Book select failed!\n");
+        goto done;
+        }
+      iclass_print_info(&info);
+      }
+    // book n of a dump or image starts at block n * ICLASS_BOOK_BLOCKS
+    if(outfile >= 0 && lseek(outfile, (off_t) book * ICLASS_BOOK_BLOCKS * 8, SEEK_SET) < 0)
+      {
+      ret= errorexit("Seek in output file failed!\n");
+      goto done;
+      }
+    booklen= imagelen - book * ICLASS_BOOK_BLOCKS * 8;
+    if(job->image && booklen < 6 * 8)
+      {
+      ret= errorexit("Pre-staged image has no data for this book!\n");
+      goto done;
+      }
+    if((ret= run_book(job, &info, &camp, job->image ? &image[book * ICLASS_BOOK_BLOCKS * 8] : NULL, MIN(booklen, ICLASS_BOOK_BLOCKS * 8), outfile, &budget, &bad)))
+      goto done;
+    }
+
+  // don't let a dump with holes in it pass as good
+  if(bad)
+    {
+    printf("\n  %d block%s could not be read cleanly!\n", bad, bad == 1 ? "" : "s");
+    ret= true;
+    }
+
+done:
+  if(outfile >= 0)
+    close(outfile);
+  return ret;
+}
+
+// use the timing profile calibration saved for this reader, if there is one
+static void load_timing(nfc_device *dev)
+{
+  iclass_timing timing;
+
+  if(timing_load(timing_path(), timing_reader(dev), &timing))
+    return;
+  iclass_set_timing(dev, &timing);
+  printf("  timing profile: timeout=%d update=%d typeb=%d read4=%d\n", timing.timeout, timing.update_timeout,
+    timing.typeb_setup, timing.read4);
+}
+
+// run job against the selected card and count it - return false if OK or true if failed
+static bool process_card(iclass_job *job)
+{
+  uint64_t start= metrics_now();
+  bool ret;
+
+  ret= run_card(job);
+  metrics_observe(METRIC_CARD, start);
+  metrics_inc(METRIC_CARDS);
+  if(ret)
+    metrics_inc(METRIC_CARDS_FAILED);
+  metrics_flush();
+  return ret;
+}
+
+// process every card in the field, counting from first - return number processed
+static int process_inventory(iclass_job *job, int first, int *failed)
+{
+  static iclass_tag tags[ICLASS_MAXTAGS];
+  int i, count;
+
+  count= iclass_inventory(pnd, tags, ICLASS_MAXTAGS);
+  printf("  %d card%s in field\n", count, count == 1 ? "" : "s");
+  for(i= 0 ; i < count && (!job->cards || first + i < job->cards) ; ++i)
+    {
+    printf("\n  card %d:\n\n", first + i + 1);
+    if(!iclass_select_tag(pnd, &tags[i], &nt) || process_card(job))
+      {
+      ++*failed;
+      printf("\n  card %d FAILED\n", first + i + 1);
+      }
+    else
+      printf("\n  card %d OK\n", first + i + 1);
+    // done with this one - keep it quiet until it leaves the field
+    iclass_halt(pnd);
+    }
+  return i;
+}
+
+// wait for the card to be selected by the poll loop - return true if a new card is selected
+static bool poll_card(iclass_job *job, long *polls)
+{
+  ++*polls;
+  metrics_inc(METRIC_POLLS);
+  if(job->fast_poll)
+    return iclass_poll(pnd, &nt) == ICLASS_POLL_NEW;
+  return iclass_select(pnd, &nt);
+}
+
+// process cards as they are presented until job card count is reached
+static int process_stream(iclass_job *job)
+{
+  nfc_target last;
+  int n= 0, failed= 0, result;
+  long polls= 0;
+  bool pending= false;
+  struct timespec start, now;
+  double waited= 0.0;
+
+  while(!job->cards || n < job->cards)
+    {
+    printf("\nwaiting for card %d...\n\n", n + 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!pending && !poll_card(job, &polls))
+      {
+      if(trace_replaying())
+        {
+        if(trace_replay_eof())
+          goto out;
+        continue;
+        }
+      if(!job->fast_poll)
+        usleep(100000);
+      }
+    pending= false;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    waited += (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    last= nt;
+    if(job->inventory)
+      n += process_inventory(job, n, &failed);
+    else
+      {
+      if(process_card(job))
+        {
+        ++failed;
+        printf("\n  card %d FAILED\n", n + 1);
+        }
+      else
+        printf("\n  card %d OK\n", n + 1);
+      ++n;
+      }
+    if(job->cards && n >= job->cards)
+      break;
+    // wait for it to go away (halted inventory cards don't answer at all)
+    if(job->fast_poll)
+      {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      do
+        ++polls;
+      while((result= iclass_poll(pnd, &nt)) == ICLASS_POLL_SAME);
+      // next card may already be here
+      pending= result == ICLASS_POLL_NEW;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      waited += (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+      continue;
+      }
+    while(iclass_select(pnd, &nt) && (job->inventory || !memcmp(nt.nti.nhi.abtUID, last.nti.nhi.abtUID, 8)))
+      if(!trace_replaying())
+        usleep(100000);
+    }
+out:
+  printf("\n  %d cards processed, %d failed\n", n, failed);
+  if(job->fast_poll && waited > 0.0)
+    printf("  %ld polls in %.1f seconds (%.0f polls/sec)\n", polls, waited, polls / waited);
+  return failed;
+}
+
+#ifndef LEAN
+// blocks of one application to copy from the source card to the target card
+typedef struct {
+  int from;			// first block to copy
+  int to;			// last block to copy
+  int budget;			// bad CRC re-reads left for the source card
+  int failed;			// block that could not be read from source, or -1
+  uint8_t keyblock;		// key block to re-key once data is written, or 0 for none
+  uint8_t *key;
+} clone_job;
+
+// producer: read source blocks and turn them into target UPDATE frames as they arrive
+static void clone_frames(iclass_framelist *list, void *arg)
+{
+  clone_job *cj= (clone_job *) arg;
+  uint8_t data[8];
+  int i;
+
+  for(i= cj->from ; i <= cj->to ; ++i)
+    {
+    if(iclass_read_checked(pnd, i, data, &cj->budget) < 0)
+      {
+      cj->failed= i;
+      pipeline_fail(list);
+      return;
+      }
+    if(pipeline_add(list, i, data, NULL))
+      return;
+    }
+  // last, so a failed copy leaves the target under its old key
+  if(cj->keyblock)
+    pipeline_add(list, cj->keyblock, cj->key, "Re-Key");
+}
+
+// open reader given as libnfc connstring or as number in device list (1 is first)
+static nfc_device *open_reader(nfc_context *context, char *reader)
+{
+  nfc_connstring devices[8];
+  char *end;
+  long n;
+
+  n= strtol(reader, &end, 10);
+  if(*end || n < 1)
+    return nfc_open(context, reader);
+  if((long) nfc_list_devices(context, devices, 8) < n)
+    return NULL;
+  return nfc_open(context, devices[n - 1]);
+}
+
+// authenticate target card with the source card key, or default Kd if that fails
+// return true if authed
+static bool clone_auth(iclass_job *job, uint8_t *key, bool debit_key)
+{
+  if(iclass_authenticate(Tpnd, Tnt, key, job->elite, true, debit_key))
+    return true;
+  if(debit_key && key != Default_kd)
+    return iclass_authenticate(Tpnd, Tnt, Default_kd, false, true, true);
+  return false;
+}
+
+// copy APP1 (and APP2 with -c) from the card on the source reader to the card on the target reader,
+// re-keying the target last if requested - return false if OK or true if failed
+static bool clone_card(iclass_job *job)
+{
+  static iclass_framelist frames;
+  iclass_card_info sinfo, tinfo;
+  clone_job cj;
+  uint8_t *key;
+  char uid[17];
+  bool debit;
+  int i;
+
+  if(!iclass_select(pnd, &nt))
+    return errorexit("No card on source reader!\n");
+  if(!iclass_select(Tpnd, &Tnt))
+    return errorexit("No card on target reader!\n");
+  prefetch_reset();
+  prefetch_card(&nt);
+  prefetch_card(&Tnt);
+  hex_encode(nt.nti.nhi.abtUID, 8, uid);
+  uid[16]= '\0';
+  printf("Source iClass card UID: %s\n", uid);
+  hex_encode(Tnt.nti.nhi.abtUID, 8, uid);
+  printf("Target iClass card UID: %s\n", uid);
+  if(iclass_read_info(pnd, &sinfo) || iclass_read_info(Tpnd, &tinfo))
+    return errorexit("Can't read card headers!\n");
+  printf("\n  source:\n");
+  iclass_print_info(&sinfo);
+  printf("\n  target:\n");
+  iclass_print_info(&tinfo);
+
+  // APP2 starts after APP1, so copying it needs the same split
+  if(tinfo.app1_limit < sinfo.app1_limit || (job->got_kc && (tinfo.app1_limit != sinfo.app1_limit || tinfo.app2_limit < sinfo.app2_limit)))
+    return errorexit("Target card is too small or laid out differently!\n");
+
+  cj.budget= REREAD_BUDGET;
+  cj.failed= -1;
+  // APP1 only if APP2 not requested OR APP1 key specifically provided (as for a single card)
+  for(debit= !job->got_kc || job->got_kd ; ; debit= false)
+    {
+    key= debit ? (job->got_kd ? job->kd : Default_kd) : job->kc;
+    if(!iclass_authenticate(pnd, nt, key, job->elite, true, debit))
+      {
+      metrics_inc(debit ? METRIC_AUTH_FAIL_DEBIT : METRIC_AUTH_FAIL_CREDIT);
+      return errorexit("Source authentication failed!\n");
+      }
+    if(!clone_auth(job, key, debit))
+      {
+      metrics_inc(debit ? METRIC_AUTH_FAIL_DEBIT : METRIC_AUTH_FAIL_CREDIT);
+      return errorexit("Target authentication failed!\n");
+      }
+
+    // blocks below 6 are card configuration, except the issuer block which is copied if it differs
+    cj.from= debit ? 6 : sinfo.app1_limit + 1;
+    cj.to= debit ? sinfo.app1_limit : sinfo.app2_limit;
+    if(debit && memcmp(sinfo.header[5], tinfo.header[5], 8))
+      cj.from= 5;
+    cj.keyblock= 0;
+    if(job->rekey && (!debit || !job->got_kc))
+      {
+      cj.keyblock= job->got_kc ? 4 : 3;
+      cj.key= job->krekey;
+      Elite_Override= !job->rekey_elite;
+      if(iclass_block_locked(&tinfo, cj.keyblock))
+        return errorexit("Target keys are locked - can't Re-Key!\n");
+      }
+    for(i= cj.from ; i <= cj.to ; ++i)
+      if(iclass_block_locked(&tinfo, i))
+        {
+        printf("    Block 0x%02x: write locked on target!\n", i);
+        return errorexit("Clone failed!\n");
+        }
+
+    printf("\n  cloning APP%d...\n\n", debit ? 1 : 2);
+    if(pipeline_start(&frames, Tpnd, clone_frames, &cj))
+      return errorexit("Can't start UPDATE frame builder!\n");
+    if(pipeline_run(Tpnd, &frames, sinfo.app1_limit) < 0)
+      {
+      if(cj.failed >= 0)
+        printf("    Block 0x%02x: read failed on source!\n", cj.failed);
+      return errorexit("Clone failed!\n");
+      }
+    if(job->verify == VERIFY_READBACK && verify_frames(Tpnd, &frames))
+      return true;
+    if(!debit || !job->got_kc)
+      break;
+    }
+  printf("\n  Clone OK%s\n", job->rekey ? " (target Re-Keyed)" : "");
+  return false;
+}
+
+// clone and count it as one card - return false if OK or true if failed
+static bool process_clone(iclass_job *job)
+{
+  uint64_t start= metrics_now();
+  bool ret;
+
+  ret= clone_card(job);
+  metrics_observe(METRIC_CARD, start);
+  metrics_inc(METRIC_CARDS);
+  if(ret)
+    metrics_inc(METRIC_CARDS_FAILED);
+  metrics_flush();
+  return ret;
+}
+#endif // LEAN
+
 int main(int argc, char **argv)
 {
-  int i, j, c, app1_limit, app2_limit;
-  int infile, outfile, writelen= 0;
-  static uint8_t buff[8], buff2[8], kc[8], kd[8], kr[8], krekey[8], *key, writedata[MAXWRITE];
-  static uint8_t ku[8], kp[8];
-  bool got_kc= false, got_kd= false, got_kr= false, dump= false, config= false, elite= false;
-  bool rekey= false, got_kp= false, got_ku= false;
-  unsigned int tmp, writeblock= 0;
-  uint8_t *configdata[2]; // config card block data
+  int c, failed= 0;
+  int infile;
+  static iclass_job job;
+  bool jobfile= false, ret;
+#ifndef LEAN
+  static uint8_t buff[8], ku[8], kp[8];
+  bool got_kp= false, got_ku= false;
+  int convert= -1, convert_in= -1;
+  char *csnfile= NULL, *auditfile= NULL, *keyfile= NULL, *dumplist= NULL;
+  char *storedir= NULL, *addlist= NULL, *extract= NULL, *target= NULL;
+  char *serve= NULL, *service= NULL, *coordinate= NULL, *worker= NULL;
+  static keysearch_task task;
+  bool got_mask= false, service_rekey= false;
+  int calibrate= 0;
+  iclass_timing timing;
+  bool listing= false;
+  static audit_keyset keyset;
+#endif // LEAN
+  unsigned int tmp;
   uint8_t *configtype; // the config card type requested
   char *p;
 
-  while ((c= getopt(argc, argv, "c:C:d:ehk:no:p:r:R:u:w:")) != -1)
+  job_init(&job);
+  while ((c= getopt(argc, argv, OPTIONS)) != -1)
   {
     switch (c)
       {
       case 'c':
         if(strlen(optarg) != 16)
           return errorexit("\nCredit KEY must be 16 HEX digits!\n");
-        for(i= 0 ; i < 8 ; ++i)
+        if(job_hex(optarg, job.kc, 8))
+          return errorexit("\nInvalid HEX in key!\n");
+	job.got_kc= true;
+        continue;
+
+      case 'C':
+        configtype= optarg;
+        if(*configtype == '?')
+	  {
+          iclass_print_configs();
+	  return 0;
+	  }
+        else if((job.config= iclass_find_config(configtype)) < 0)
           {
-          if(sscanf(&optarg[i * 2], "%02x", &tmp) != 1)
-            return errorexit("\nInvalid HEX in key!\n");
-	  kc[i]= (uint8_t) tmp;
+          printf("\nInvalid CONFIG card!\n");
+          return 1;
           }
-	got_kc= true;
         continue;
 
-      case 'C':
-        configtype= optarg;
-        if(*configtype == '?')
-	  {
-          iclass_print_configs();
-	  return 0;
-	  }
-        else
-          {
-          for(i= 0 ; ; ++i)
-            {
-            if(Config_cards[i] == NULL)
-              break;
-            if(!strncasecmp(configtype, Config_cards[i], strlen(Config_cards[i])))
-              {
-              config= true;
-              configdata[0]= Config_block6[i];
-              configdata[1]= Config_block7[i];
-              break;
-              }
-            }
-          if(!config)
-            {
-            printf("\nInvalid CONFIG card!\n");
-            return 1;
-            }
-          }
+      case 'd':
+        if(strlen(optarg) != 16)
+          return errorexit("\nDebit KEY must be 16 HEX digits!\n");
+        if(job_hex(optarg, job.kd, 8))
+          return errorexit("\nInvalid HEX in key!\n");
+	job.got_kd= true;
+        continue;
+
+      case 'I':
+        job.inventory= true;
+        continue;
+
+      case 'k':
+        if(strlen(optarg) != 16)
+          return errorexit("\nKeyroll KEY must be 16 HEX digits!\n");
+        if(job_hex(optarg, job.kr, 8))
+          return errorexit("\nInvalid HEX in key!\n");
+	job.got_kr= true;
+        continue;
+
+      case 'R':
+        if(strlen(optarg) != 16)
+          return errorexit("\nRe-key KEY must be 16 HEX digits!\n");
+        if(job_hex(optarg, job.krekey, 8))
+          return errorexit("\nInvalid HEX in key!\n");
+	job.rekey= true;
+	job.rekey_elite= false;
+        continue;
+
+        case 'w':
+          // don't allow writing of reserved blocks!
+         if(sscanf(optarg, "%x", &tmp) != 1 || tmp < 5)
+           return errorexit("Can't write - Bad block number! (Lowest valid block is 5)\n");
+         job.writeblock= (int) tmp;
+         continue;
+
+      case 'o':
+        job.dumpfile= optarg;
+	continue;
+
+#ifndef LEAN
+      case 'a':
+        addlist= optarg;
+        continue;
+
+      case 'A':
+        auditfile= optarg;
         continue;
 
-      case 'd':
-        if(strlen(optarg) != 16)
-          return errorexit("\nDebit KEY must be 16 HEX digits!\n");
-        for(i= 0 ; i < 8 ; ++i)
-          {
-          if(sscanf(&optarg[i * 2], "%02x", &tmp) != 1)
-            return errorexit("\nInvalid HEX in key!\n");
-	  kd[i]= (uint8_t) tmp;
-          }
-	got_kd= true;
+      case 'b':
+        if(job_book(optarg, &job.book))
+          return errorexit("\nBOOK must be 0, 1 or all!\n");
+        continue;
+
+      case 'B':
+        if((calibrate= atoi(optarg)) < 1 || calibrate > CALIBRATE_MAXCYCLES)
+          return errorexit("\nCalibration CYCLES must be 1 to 1000!\n");
         continue;
 
       case 'e':
-	elite= true;
+	job.elite= true;
 	continue;
 
-      case 'k':
-        if(strlen(optarg) != 16)
-          return errorexit("\nKeyroll KEY must be 16 HEX digits!\n");
-        for(i= 0 ; i < 8 ; ++i)
-          {
-          if(sscanf(&optarg[i * 2], "%02x", &tmp) != 1)
-            return errorexit("\nInvalid HEX in key!\n");
-	  kr[i]= (uint8_t) tmp;
-          }
-	got_kr= true;
-	// this config card will not work unless you have the HID master 3DES key!
-	if(!memcmp(Key1, "\x00\x00\x00\x00\x00\x00\x00\x00", 8) || !memcmp(Key2, "\x00\x00\x00\x00\x00\x00\x00\x00", 8))
-          return errorexit("Master 3DES KEY required for KEYROLLing! (see source comments)\n");
+      case 'G':
+        csnfile= optarg;
+        continue;
+
+      case 'F':
+        job.fast_poll= true;
+        continue;
+
+      case 'D':
+        job.keycache= optarg;
+        continue;
+
+      case 'g':
+        job.golden= optarg;
+        continue;
+
+      case 'i':
+        job.image= optarg;
+        continue;
+
+      case 'P':
+        if(trace_replay_open(optarg))
+          return errorexit("Can't open TRACE file for replay!\n");
+        atexit(trace_close);
+        continue;
+
+      case 'T':
+        if(trace_open(optarg))
+          return errorexit("Can't open TRACE file!\n");
+        atexit(trace_close);
+        continue;
+
+      case 't':
+        job.template= optarg;
+        continue;
+
+      case 'J':
+        if(job_load(optarg, &job))
+          return errorexit("\nInvalid JOB file!\n");
+        jobfile= true;
+        continue;
+
+      case 'K':
+        keyfile= optarg;
         continue;
 
       case 'p':
         if(strlen(optarg) != 16)
           return errorexit("\nPermute KEY must be 16 HEX digits!\n");
-        for(i= 0 ; i < 8 ; ++i)
-          {
-          if(sscanf(&optarg[i * 2], "%02x", &tmp) != 1)
-            return errorexit("\nInvalid HEX in key!\n");
-	  kp[i]= (uint8_t) tmp;
-          }
+        if(job_hex(optarg, kp, 8))
+          return errorexit("\nInvalid HEX in key!\n");
 	got_kp= true;
         continue;
 
       case 'r':
         if(strlen(optarg) != 16)
           return errorexit("\nRe-key KEY must be 16 HEX digits!\n");
-        for(i= 0 ; i < 8 ; ++i)
-          {
-          if(sscanf(&optarg[i * 2], "%02x", &tmp) != 1)
-            return errorexit("\nInvalid HEX in key!\n");
-	  krekey[i]= (uint8_t) tmp;
-          }
-	rekey= true;
-        continue;
-
-      case 'R':
-        if(strlen(optarg) != 16)
-          return errorexit("\nRe-key KEY must be 16 HEX digits!\n");
-        for(i= 0 ; i < 8 ; ++i)
-          {
-          if(sscanf(&optarg[i * 2], "%02x", &tmp) != 1)
-            return errorexit("\nInvalid HEX in key!\n");
-	  krekey[i]= (uint8_t) tmp;
-          }
-	rekey= true;
-	Elite_Override= true;
+        if(job_hex(optarg, job.krekey, 8))
+          return errorexit("\nInvalid HEX in key!\n");
+	job.rekey= true;
         continue;
 
       case 'u':
         if(strlen(optarg) != 16)
           return errorexit("\nUnpermute KEY must be 16 HEX digits!\n");
-        for(i= 0 ; i < 8 ; ++i)
+        if(job_hex(optarg, ku, 8))
+          return errorexit("\nInvalid HEX in key!\n");
+	got_ku= true;
+        continue;
+
+      case 'W':
+        dumplist= optarg;
+        continue;
+
+      case 'j':
+        job.journal= optarg;
+        continue;
+
+      case 'l':
+        listing= true;
+        continue;
+
+      case 'm':
+        if(job_manufacture(optarg, &job.manufacture))
+          return errorexit("\nMODE must be keep or commit!\n");
+        continue;
+
+      case 'M':
+        job.metrics= optarg;
+        continue;
+
+      case 'q':
+        coordinate= optarg;
+        continue;
+
+      case 'Q':
+        worker= optarg;
+        continue;
+
+      case 's':
+        serve= optarg;
+        continue;
+
+      case 'S':
+        storedir= optarg;
+        continue;
+
+      case 'N':
+        service_rekey= true;
+        continue;
+
+      case 'U':
+        service= optarg;
+        continue;
+
+      case 'X':
+        extract= optarg;
+        continue;
+
+      case 'x':
+        // [IN:]OUT - IN is worked out from the data if not given
+        if((p= strchr(optarg, ':')))
           {
-          if(sscanf(&optarg[i * 2], "%02x", &tmp) != 1)
-            return errorexit("\nInvalid HEX in key!\n");
-	  ku[i]= (uint8_t) tmp;
+          *p++= '\0';
+          if((convert_in= convert_format(optarg)) < 0)
+            return errorexit("\nInvalid dump format! (bin, hex, eml or json)\n");
           }
-	got_ku= true;
+        if((convert= convert_format(p ? p : optarg)) < 0)
+          return errorexit("\nInvalid dump format! (bin, hex, eml or json)\n");
         continue;
 
-        case 'w':
-          // don't allow writing of reserved blocks!
-         if(sscanf(optarg, "%x", &tmp) != 1 || tmp < 5)
-           return errorexit("Can't write - Bad block number! (Lowest valid block is 5)\n");
-         writeblock= (int) tmp;
-         continue;
+      case 'y':
+        target= optarg;
+        continue;
 
-      case 'o':
-        if((outfile= open(optarg, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) <= 0)
-          return errorexit("Can't open output file!\n");
-	dump= true;
-	continue;
+      case 'z':
+        if(strlen(optarg) != 16)
+          return errorexit("\nMASK must be 16 HEX digits!\n");
+        if(job_hex(optarg, task.mask, 8))
+          return errorexit("\nInvalid HEX in MASK!\n");
+        got_mask= true;
+        continue;
+#endif // LEAN
 
       case 'h':
       default:
+#ifdef LEAN
+        printf("\nUsage: %s [options] [BINARY FILE|HEX DATA]\n", argv[0]);
+        printf("\n  Options (lean build):\n\n");
+        printf("\t-c <KEY>      Use CREDIT KEY Kc / APP2 (default is DEBIT KEY Kd / APP1)\n");
+        printf("\t-C <?|CARD>   Create CONFIG card (? prints list of config cards)\n");
+        printf("\t-d <KEY>      Use non-default DEBIT KEY for APP1\n");
+        printf("\t-h            You're looking at it\n");
+        printf("\t-I            Process every card in the field (inventory)\n");
+        printf("\t-k <KEY>      Keyroll KEY for CONFIG card\n");
+        printf("\t-o <FILE>     Write TAG data to FILE\n");
+        printf("\t-R <KEY>      Re-Key to non-ELITE\n");
+        printf("\t-w <BLOCK>    WRITE to tag starting from BLOCK (specify # in HEX)\n");
+        return 1;
+#else
         printf("\nUsage: %s [options] [BINARY FILE|HEX DATA]\n", argv[0]);
         printf("\n  Options:\n\n");
+        printf("\t-a <FILE>     Add dumps listed in FILE to STORE (offline)\n");
+        printf("\t-A <FILE>     Verify reader transcripts in FILE against keys (offline)\n");
+        printf("\t-b <BOOK>     Use BOOK of 32K card: 0, 1 or all (default is current book)\n");
+        printf("\t-B <CYCLES>   Calibrate reader timing with CYCLES per setting and save profile\n");
         printf("\t-c <KEY>      Use CREDIT KEY Kc / APP2 (default is DEBIT KEY Kd / APP1)\n");
         printf("\t-C <?|CARD>   Create CONFIG card (? prints list of config cards)\n");
         printf("\t-d <KEY>      Use non-default DEBIT KEY for APP1\n");
+        printf("\t-D <FILE>     Cache ELITE diversified keys in FILE\n");
         printf("\t-e            AUTH KEY is ELITE\n");
+        printf("\t-F            Fast polling for JOB files (reader set up once, cached CSN)\n");
+        printf("\t-g <FILE>     Verify card against golden image FILE, stopping at the first difference\n");
+        printf("\t-G <FILE>     Generate pre-staged image for each UID in FILE (needs -t and -o)\n");
         printf("\t-h            You're looking at it\n");
+        printf("\t-i <FILE>     WRITE pre-staged image FILE\n");
+        printf("\t-I            Process every card in the field (inventory)\n");
+        printf("\t-j <FILE>     Journal Re-Keys to FILE (resumable campaign)\n");
+        printf("\t-J <FILE>     Run JOB file against each card presented\n");
         printf("\t-k <KEY>      Keyroll KEY for CONFIG card\n");
+        printf("\t-K <FILE>     KEY file for -A (default is -d/-c keys)\n");
+        printf("\t-l            List dumps in STORE (offline)\n");
+        printf("\t-m <MODE>     Write -i image to blank card in personalisation mode, MODE keep or commit\n");
+        printf("\t-M <TARGET>   Export OpenMetrics to FILE, unix:PATH or tcp:PORT (localhost)\n");
         printf("\t-n            Do not DIVERSIFY key\n");
+        printf("\t-N            Re-Key with the key service's new key (with -U)\n");
         printf("\t-o <FILE>     Write TAG data to FILE\n");
         printf("\t-p <KEY>      Permute KEY\n");
+        printf("\t-P <FILE>     Replay TRACE file instead of using a reader\n");
+        printf("\t-q <TARGET>   Coordinate search for -d KEY bits in -z MASK against -A transcripts (offline)\n");
+        printf("\t-Q <TARGET>   Work on key search from coordinator at TARGET (offline)\n");
         printf("\t-r <KEY>      Re-Key with KEY (assumes new key is ELITE)\n");
         printf("\t-R <KEY>      Re-Key to non-ELITE\n");
+        printf("\t-s <TARGET>   Serve keys to readers on unix:PATH or tcp:PORT (localhost only)\n");
+        printf("\t-S <DIR>      Deduplicated dump STORE for -a, -l, -X and -W\n");
+        printf("\t-t <FILE>     TEMPLATE image for -G\n");
+        printf("\t-T <FILE>     Record all card traffic to TRACE file\n");
         printf("\t-u <KEY>      Unpermute KEY\n");
+        printf("\t-U <TARGET>   Use key service at unix:PATH, tcp:PORT (localhost) or tcp:HOST:PORT\n");
         printf("\t-w <BLOCK>    WRITE to tag starting from BLOCK (specify # in HEX)\n");
+        printf("\t-W <FILE>     Decode credentials from dumps listed in FILE (offline)\n");
+        printf("\t-x <[IN:]OUT> Convert dump IN to OUT, formats bin, hex, eml or json (offline)\n");
+        printf("\t-X <NAME>     Extract dump NAME from STORE to -o FILE or stdout (offline)\n");
+        printf("\t-y <READER>   Clone card to target READER (connstring or device number, 1 is first)\n");
+        printf("\t-z <MASK>     Unknown bits of KEY for -q\n");
         printf("\n");
         printf("\tIf no KEY is specified, default HID Kd (APP1) will be used\n");
+        printf("\tOptions given after -J override the JOB file\n");
+        printf("\t'%%s' in -o or -i FILE is replaced by card UID\n");
         printf("\n");
         printf("  Examples:\n\n");
 	printf("    Use non-default key for APP1:\n\n");
@@ -259,10 +1524,27 @@ int main(int argc, char **argv)
 	printf("\t%s -w 8 aabbccddaabbccddaabbccddaabbccdd\n\n", argv[0]);
 	printf("      or\n\n");
 	printf("\t%s -w 8 /tmp/iclass-8-9-dump.icd\n\n", argv[0]);
+	printf("    Dump both books of a 32K card:\n\n");
+	printf("\t%s -b all -o /tmp/iclass-%%s.icd\n\n", argv[0]);
+	printf("    Audit installed cards against their golden images:\n\n");
+	printf("\t%s -J audit.job -g /var/lib/iclass/golden/%%s.icd\n\n", argv[0]);
+	printf("    Personalise blank cards from pre-staged images and commit them:\n\n");
+	printf("\t%s -J batch.job -i /tmp/staged/%%s.icd -m commit\n\n", argv[0]);
+	printf("    Search 32 unknown bits of an ELITE key, with workers on this and other hosts:\n\n");
+	printf("\t%s -q tcp:0.0.0.0:7700 -A site-logs.txt -e -d DEADBEEF00000000 -z 00000000FFFFFFFF\n", argv[0]);
+	printf("\t%s -Q tcp:coordinator:7700\n\n", argv[0]);
+	printf("    Clone APP1 to card on second reader and Re-Key it:\n\n");
+	printf("\t%s -y 2 -R DEADBEEFCAFEF00D\n\n", argv[0]);
         return 1;
+#endif // LEAN
       }
   }
 
+  // this config card will not work unless you have the HID master 3DES key!
+  if(job.got_kr && (!memcmp(Key1, "\x00\x00\x00\x00\x00\x00\x00\x00", 8) || !memcmp(Key2, "\x00\x00\x00\x00\x00\x00\x00\x00", 8)))
+    return errorexit("Master 3DES KEY required for KEYROLLing! (see source comments)\n");
+
+#ifndef LEAN
   // do non-tag related stuff first
   if(got_kp)
     {
@@ -277,13 +1559,14 @@ int main(int argc, char **argv)
     permutekey_rev(ku, buff);
     printf("  Unpermuted key:  %02x%02x%02x%02x%02x%02x%02x%02x\n", buff[0], buff[1], buff[2], buff[3], buff[4], buff[5], buff[6], buff[7]);
     }
+#endif // LEAN
 
   // check for conflicting args
-  if(writeblock && config)
+  if(job.writeblock && job.config >= 0)
     printf("*** WARNING! WRITE may overwrite CONFIG blocks! ***");
 
-  // prepare data for writing
-  if(writeblock)
+  // prepare data for writing (JOB file may already have provided it)
+  if(job.writeblock && !job.writelen)
     {
     if(optind >= argc)
       return errorexit("Can't write - No data!\n");
@@ -291,26 +1574,232 @@ int main(int argc, char **argv)
     // is it a file?
     if((infile= open(p, O_RDONLY)) > 0)
       {
-      if((writelen= read(infile, writedata, MAXWRITE)) <= 0)
+      if((job.writelen= read(infile, job.writedata, MAXWRITE)) <= 0)
         return errorexit("\nRead failed!\n");
+      close(infile);
       }
     else
       {
-      writelen= strlen(p) / 2;
-      for(i= 0 ; i < writelen && i < MAXWRITE ; ++i, p += 2)
-        {
-        if(sscanf(p, "%02x", &tmp) != 1)
-          return errorexit("\nInvalid HEX in data!\n");
-        writedata[i]= (char) tmp;
-        }
-      close(infile);
+      if(strlen(p) > MAXWRITE * 2)
+        return errorexit("Can't write - Data too long!\n");
+      if((job.writelen= hex_decode(p, strlen(p), job.writedata)) < 0)
+        return errorexit("\nInvalid HEX in data!\n");
       }
-    if(writelen > MAXWRITE)
+    if(job.writelen > MAXWRITE)
       return errorexit("Can't write - Data too long!\n");
-    if(writelen % 8)
+    if(job.writelen % 8)
       return errorexit("Can't write - Data must be 8 byte blocks!\n");
     }
 
+#ifndef LEAN
+  // offline distributed key search - the coordinator only hands out work
+  if(coordinate)
+    {
+    if(!auditfile || !got_mask)
+      return errorexit("\n-q needs -A and -z!\n");
+    // DES ignores the parity bit of each key byte, so only ELITE keys (hashed first) need them searched
+    if(!job.elite)
+      {
+      int i, parity= 0;
+
+      for(i= 0 ; i < 8 ; ++i)
+        if(task.mask[i] & 0x01)
+          {
+          task.mask[i] &= 0xfe;
+          ++parity;
+          }
+      if(parity)
+        printf("\n  Skipping %d DES parity bit%s in MASK\n", parity, parity == 1 ? "" : "s");
+      }
+    if(keysearch_bits(&task) > KEYSEARCH_MAXBITS)
+      return errorexit("\nMASK can't have more than 48 bits!\n");
+    if(job.got_kd)
+      memcpy(task.key, job.kd, 8);
+    task.elite= job.elite;
+    if(keysearch_load(&task, auditfile))
+      return errorexit("\nCan't load transcripts!\n");
+    if((failed= keysearch_coordinate(&task, coordinate)) < 0)
+      return errorexit("Can't open key search socket!\n");
+    return failed;
+    }
+  if(worker)
+    {
+    if(keysearch_work(worker))
+      return errorexit("Can't reach key search coordinator (or lost it)!\n");
+    return 0;
+    }
+
+  // offline transcript audit - keys from file or command line
+  if(auditfile)
+    {
+    if(keyfile && audit_load_keys(&keyset, keyfile))
+      return errorexit("Can't load KEY file!\n");
+    if(!keyfile)
+      {
+      audit_add_key(&keyset, job.got_kd ? job.kd : Default_kd, job.elite, "DEBIT");
+      if(job.got_kc)
+        audit_add_key(&keyset, job.kc, job.elite, "CREDIT");
+      }
+    return audit_transcripts(&keyset, auditfile) != 0;
+    }
+
+  // offline dump conversion - IN and OUT ('-' for stdin/stdout) are the last arguments
+  if(convert >= 0)
+    {
+    if(optind != argc - 2)
+      return errorexit("\nConvert needs IN and OUT files!\n");
+    if(convert_dump(argv[optind], argv[optind + 1], convert_in, convert))
+      return errorexit("\nConvert failed!\n");
+    return 0;
+    }
+
+  // offline dump store - -W reads the dumps it lists from the store too
+  if(storedir)
+    {
+    if(!addlist && !listing && !extract && !dumplist)
+      return errorexit("\nSTORE needs -a, -l, -X or -W!\n");
+    if(store_open(storedir, addlist != NULL))
+      return errorexit("\nCan't open dump STORE (or in use)!\n");
+    atexit(store_close);
+    if(addlist)
+      return store_add_list(addlist) != 0;
+    if(listing)
+      {
+      store_list();
+      return 0;
+      }
+    if(extract)
+      {
+      static uint8_t image[STORE_MAXBLOCKS * 8];
+      int len, outfile= STDOUT_FILENO;
+
+      if((len= store_get(extract, strlen(extract), image, sizeof(image))) < 0)
+        return errorexit("\nDump not in STORE!\n");
+      if(job.dumpfile && (outfile= open(job.dumpfile, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) < 0)
+        return errorexit("Can't open output file!\n");
+      if(write(outfile, image, len) != len)
+        return errorexit("Write to output file failed!\n");
+      return 0;
+      }
+    }
+
+  // offline credential decode - transport key is the master 3DES key if we have it
+  if(dumplist)
+    {
+    if(memcmp(Key1, "\x00\x00\x00\x00\x00\x00\x00\x00", 8) && memcmp(Key2, "\x00\x00\x00\x00\x00\x00\x00\x00", 8))
+      {
+      DES_set_key_unchecked(&Key1, &SchKey1);
+      DES_set_key_unchecked(&Key2, &SchKey2);
+      return credential_decode(dumplist, &SchKey1, &SchKey2) != 0;
+      }
+    return credential_decode(dumplist, NULL, NULL) != 0;
+    }
+
+  // offline pre-staging doesn't need a reader
+  if(csnfile)
+    {
+    if(job.config >= 0)
+      {
+      DES_set_key_unchecked(&Key1, &SchKey1);
+      DES_set_key_unchecked(&Key2, &SchKey2);
+      }
+    return image_generate(&job, csnfile, Default_kd, &SchKey1, &SchKey2) != 0;
+    }
+
+  if(job.keycache)
+    {
+    if(keycache_open(job.keycache, KEYCACHE_SLOTS))
+      return errorexit("Can't open KEY cache file!\n");
+    atexit(keycache_close);
+    }
+  if(job.journal)
+    {
+    int cards, pending;
+
+    if(journal_open(job.journal))
+      return errorexit("Can't open re-key journal (or in use)!\n");
+    atexit(journal_close);
+    journal_stats(&cards, &pending);
+    printf("\n  Re-key journal: %d card%s, %d interrupted\n", cards, cards == 1 ? "" : "s", pending);
+    }
+  if(job.metrics)
+    {
+    if(metrics_open(job.metrics))
+      return errorexit("Can't open metrics FILE or socket!\n");
+    atexit(metrics_close);
+    }
+
+  // key service - this process holds the keys and does the crypto for reader hosts
+  if(serve)
+    {
+    keyservice_key(KEYSERVICE_KEY_DEBIT, job.got_kd ? job.kd : Default_kd, job.elite);
+    if(job.got_kc)
+      keyservice_key(KEYSERVICE_KEY_CREDIT, job.kc, job.elite);
+    if(job.rekey)
+      keyservice_key(KEYSERVICE_KEY_REKEY, job.krekey, job.rekey_elite);
+    if(keyservice_serve(serve))
+      return errorexit("Can't open key service socket (unix:PATH or localhost only)!\n");
+    return 0;
+    }
+  // reader host without keys - the keys the service holds decide what is read, but
+  // this host has to ask for a re-key
+  if(service_rekey && !service)
+    return errorexit("\n-N needs -U!\n");
+  if(service)
+    {
+    if(job.got_kd || job.got_kc || job.rekey || job.journal || job.image)
+      return errorexit("\nKeys, -j and -i can't be used with the key service!\n");
+    if(keyservice_connect(service))
+      return errorexit("Can't connect to key service!\n");
+    atexit(keyservice_close);
+    job.got_kd= true;
+    job.got_kc= keyservice_has(KEYSERVICE_KEY_CREDIT);
+    if(service_rekey && !keyservice_has(KEYSERVICE_KEY_REKEY))
+      return errorexit("Key service has no new key to Re-Key with!\n");
+    job.rekey= service_rekey;
+    }
+
+  // blank cards get the whole pre-staged image and nothing else
+  if(job.manufacture && (!job.image || job.writeblock || job.config >= 0 || job.rekey || job.dumpfile || job.book != BOOK_CURRENT || target || service))
+    return errorexit("\n-m needs -i and can't be combined with -w, -C, -r, -R, -o, -b, -y or -U!\n");
+  // golden image verify only reads
+  if(job.golden && (job.writeblock || job.config >= 0 || job.image || job.rekey || job.dumpfile || job.book != BOOK_CURRENT || target))
+    return errorexit("\n-g can't be combined with -w, -C, -i, -r, -R, -o, -b or -y!\n");
+  // journal records are per card, not per book
+  if(job.book != BOOK_CURRENT && job.journal)
+    return errorexit("\n-b can't be combined with -j!\n");
+  if(target && (trace_replaying() || job.inventory || job.writeblock || job.config >= 0 || job.image || job.book != BOOK_CURRENT))
+    return errorexit("\nClone can't be combined with -P, -I, -w, -C, -i or -b!\n");
+  // blank clone targets answer to the default Kd
+  if(target && !service)
+    prefetch_key(Default_kd, false);
+#endif // LEAN
+
+  // keys this run authenticates or re-keys with - derived for each card as soon as it is selected
+  // (a key service derives its own)
+  if(!keyservice_active() && !job.manufacture)
+    {
+    if(!job.got_kc || job.got_kd)
+      prefetch_key(job.got_kd ? job.kd : Default_kd, job.elite);
+    if(job.got_kc)
+      prefetch_key(job.kc, job.elite);
+    if(job.rekey && !job.image)
+      prefetch_key(job.krekey, job.rekey_elite);
+    }
+  atexit(prefetch_reset);
+
+  // replay needs no reader - recorded responses stand in for the card
+  if(trace_replaying())
+    {
+    if(jobfile)
+      ret= process_stream(&job) != 0;
+    else if(job.inventory)
+      ret= !process_inventory(&job, 0, &failed) || failed;
+    else
+      ret= !iclass_select(pnd, &nt) || process_card(&job);
+    exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
   nfc_context *context;
   nfc_init(&context);
   if (context == NULL) {
@@ -335,289 +1824,67 @@ int main(int argc, char **argv)
 
   printf("\nNFC device: %s opened\n", nfc_device_get_name(pnd));
 
-  // Try to find an iClass
-  if (!iclass_select(pnd, &nt)) {
-    ERR("no tag was found\n");
+#ifndef LEAN
+  // sweep reader settings on the card in the field and keep the best for later runs
+  if(calibrate)
+    {
+    if((ret= calibrate_reader(pnd, job.got_kd ? job.kd : Default_kd, job.elite, calibrate, &timing)))
+      printf("\n  No setting worked every time - profile not saved\n");
+    else if((ret= timing_save(timing_path(), timing_reader(pnd), nfc_device_get_name(pnd), &timing)))
+      printf("\n  Can't save timing profile!\n");
+    else
+      printf("\n  Saved profile timeout=%d update=%d typeb=%d read4=%d to %s\n", timing.timeout, timing.update_timeout,
+        timing.typeb_setup, timing.read4, timing_path());
     nfc_close(pnd);
     nfc_exit(context);
-    exit(EXIT_FAILURE);
-  }
-
-  // Get the info from the current tag
-  printf("Found iClass card with UID: ");
-  size_t  szPos;
-  for (szPos = 0; szPos < 8; szPos++) {
-    printf("%02x", nt.nti.nhi.abtUID[szPos]);
-  }
-  printf("\n");
-
-  if(!(app1_limit= (int) iclass_print_type(pnd, &app2_limit)))
-    {
-    printf("  could not determine card type!\n");
-    app1_limit= 0xff;
+    exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
     }
+#endif // LEAN
+  load_timing(pnd);
 
-  printf("\n  reading header blocks...\n\n");
-  for(i= 0 ; i < 6 ; ++i)
+#ifndef LEAN
+  // clone copies source to target in one pass, so both readers are open together
+  if(target)
     {
-    printf("    Block 0x%02x: ", i);
-    if(!iclass_read(pnd, i, buff))
+    if(!(Tpnd= open_reader(context, target)) || nfc_initiator_init(Tpnd) < 0)
       {
-      for(j= 0 ; j < 8 ; ++j)
-        printf("%02x", (uint8_t) buff[j]);
-      printf("  ");
-      for(j= 0 ; j < 8 ; ++j)
-	printf("%c", isprint(buff[j]) ? (char) buff[j] : '.');    
-      printf("  ");
-      iclass_print_blocktype(i, app1_limit, buff);
-      if(dump)
-        if(write(outfile, buff, 8) != 8)
-          errorexit("Write to output file failed!\n");
-      }
-    else
-      printf("read failed!");
-    printf("\n");
-    }
-  printf("\n");
-
-  // APP1 operations only if APP2 not requested OR APP1 key specifically provided
-  // (this allows you to get past an unknown key for APP1 without causing an auth error)
-  if(!got_kc || got_kd)
-  {
-     // authenticate with default Debit key if no key provided
-    if(got_kd)
-      key= kd;
-    else
-      key= Default_kd;
-    printf("  authing to APP1 with key: ");
-    for(i= 0 ; i < 8 ; ++i)
-      printf("%02x", key[i]);
-    printf("\n\n");
-    if(!iclass_authenticate(pnd, nt, key, elite, true, true))
-    {
-      ERR("authentication failed\n");
-       nfc_close(pnd);
+      ERR("Error opening target NFC device");
+      if(Tpnd)
+        nfc_close(Tpnd);
+      nfc_close(pnd);
       nfc_exit(context);
-      // carry on if we wanted to read APP2
       exit(EXIT_FAILURE);
-    }
-
-    // write config card if specified
-    if(config)
-      {
-      // keyroll card
-      if(!strncasecmp(configtype, "KR", 2))
-        {
-        if(!got_kr)
-          {
-          printf("\nPlease specify KEYROLL key!\n");
-          return 1;
-          }
-        if(app1_limit < 0x16)
-          return errorexit("\nAPP1 too small for KEYROLL!\n");
-        printf("\n  Writing KEYROLL card: %s\n\n", configtype);
-          for(i= 0 ; i < 2 ; ++i)
-            {
-            if(iclass_write(pnd, i +6, configdata[i]))
-              return errorexit("Write failed!\n");
-            else
-              printf("    Written block %02x\n", i + 6);
-            }
-          for(i= 0x08 ; i < 0x0d ; ++i)
-            if(iclass_write(pnd, i, Config_block_other))
-              return errorexit("Write failed!\n");
-            else
-              printf("    Written block %02x\n", i);
-          // update keyroll blocks
-          // keyroll cards are 3DES encrypted for block 0x0d upwards
-          DES_set_key_unchecked(&Key1, &SchKey1);
-          DES_set_key_unchecked(&Key2, &SchKey2);
-          DES_ecb2_encrypt((unsigned char (*)[8]) kr, (unsigned char (*)[8]) buff, &SchKey1, &SchKey2, DES_ENCRYPT);
-          if(iclass_write(pnd, 0x0d, buff))
-            return errorexit("Write failed!\n");
-          else
-            printf("    Written block 0d (KEYROLL KEY)\n");
-          DES_ecb2_encrypt((unsigned char (*)[8]) Config_block_other, (unsigned char (*)[8]) buff, &SchKey1, &SchKey2, DES_ENCRYPT);
-          for(i= 0x0e ; i < 0x14 ; ++i)
-            if(iclass_write(pnd, i, buff))
-              return errorexit("Write failed!\n");
-            else
-              printf("    Written block %02x\n", i);
-          buff2[0]= 0x15;
-          memcpy(&buff2[1], kr, 7);
-          DES_ecb2_encrypt((unsigned char (*)[8]) buff2, (unsigned char (*)[8]) buff, &SchKey1, &SchKey2, DES_ENCRYPT);
-          if(iclass_write(pnd, 0x14, buff))
-            return errorexit("Write failed!\n");
-          else
-            printf("    Written block 14 (Partial KEYROLL KEY)\n");
-          memset(buff2, 0xff, 8);
-          buff2[0]= kr[7];
-          DES_ecb2_encrypt((unsigned char (*)[8]) buff2, (unsigned char (*)[8]) buff, &SchKey1, &SchKey2, DES_ENCRYPT);
-          if(iclass_write(pnd, 0x15, buff))
-            return errorexit("Write failed!\n");
-          else
-            printf("    Written block 15 (Partial KEYROLL KEY)\n");
-          DES_ecb2_encrypt((unsigned char (*)[8]) Config_block_other, (unsigned char (*)[8]) buff, &SchKey1, &SchKey2, DES_ENCRYPT);
-          for(i= 0x16 ; i <= app1_limit ; ++i)
-            if(iclass_write(pnd, i, buff))
-              return errorexit("Write failed!\n");
-            else
-              printf("    Written block %02x\n", i);
-          }
-      else
-        {
-        //standard config card
-        printf("\n  Writing CONFIG card: %s\n\n", configtype);
-        for(i= 0 ; i < 2 ; ++i)
-          if(iclass_write(pnd, i + 6, configdata[i]))
-            return errorexit("Write failed!\n");
-          else
-            printf("    Written block %02x\n", i + 6);
-          for(i= 0x08 ; i <= app1_limit ; ++i)
-            if(iclass_write(pnd, i, Config_block_other))
-              return errorexit("Write failed!\n");
-            else
-              printf("    Written block %02x\n", i);
-        }
-      printf("\n");
-      }
-
-    // write to APP1
-    if(writeblock && writeblock <= app1_limit)
-      {
-      printf("\n  writing...\n\n");
-      for(i= 0 ; i < writelen ; i += 8, writeblock++)
-        {
-        if(iclass_write(pnd, writeblock, &writedata[i]))
-           return errorexit("Write failed!\n");
-        else
-           {
-           printf("    Block 0x%02x: ", writeblock);
-           for(j= i ; j < i + 8 ; ++j)
-             printf("%02x", (uint8_t) writedata[j]);
-           printf("  ");
-           for(j= i ; j < i + 8 ; ++j)
-             printf("%c", isprint(writedata[j]) ? (char) writedata[j] : '.');
-           printf("  ");
-           iclass_print_blocktype(writeblock, app1_limit, writedata);
-           }
-        printf("\n");
-        }
-      printf("\n");
-      }
-
-    // show APP1
-    printf("  reading APP1 blocks...\n\n");
-    for(i= 6 ; i <= app1_limit ; ++i)
-    {
-      printf("    Block 0x%02x: ", i);
-      if(!iclass_read(pnd, i, buff))
-      {
-        for(j= 0 ; j < 8 ; ++j)
-          printf("%02x", (uint8_t) buff[j]);
-        printf("  ");
-        for(j= 0 ; j < 8 ; ++j)
-          printf("%c", isprint(buff[j]) ? (char) buff[j] : '.');    
-        printf("  ");
-        iclass_print_blocktype(i, app1_limit, buff);
-        if(dump)
-          if(write(outfile, buff, 8) != 8)
-            return errorexit("Write to output file failed!\n");
       }
-      else
-        printf("read failed!");
-      printf("\n");
-    }
+    printf("NFC device: %s opened (clone target)\n", nfc_device_get_name(Tpnd));
+    load_timing(Tpnd);
     printf("\n");
-  } // end of APP1 operations
+    ret= process_clone(&job);
+    nfc_close(Tpnd);
+    nfc_close(pnd);
+    nfc_exit(context);
+    exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+#endif // LEAN
 
-  // show APP2 if requested
-  if(got_kc)
-  {
-    printf("  authing to APP2 with key: ");
-    key= kc;
-    for(i= 0 ; i < 8 ; ++i)
-      printf("%02x", key[i]);
-    printf("\n\n");
-    if(!iclass_authenticate(pnd, nt, key, elite, true, false)) {
-      ERR("authentication failed\n");
+  if(jobfile)
+    ret= process_stream(&job) != 0;
+  else if(job.inventory)
+    ret= !process_inventory(&job, 0, &failed) || failed;
+  else
+    {
+    // Try to find an iClass
+    if (!iclass_select(pnd, &nt)) {
+      ERR("no tag was found\n");
       nfc_close(pnd);
       nfc_exit(context);
       exit(EXIT_FAILURE);
     }
-
-    // write to APP2
-    if(writeblock && writeblock > app1_limit)
-      {
-      printf("\n  writing...\n\n");
-      for(i= 0 ; i < writelen ; i += 8, writeblock++)
-        {
-        if(iclass_write(pnd, writeblock, &writedata[i]))
-           return errorexit("Write failed!\n");
-        else
-           {
-           printf("    Block 0x%02x: ", writeblock);
-           for(j= 0 ; j < 8 ; ++j)
-             printf("%02x", (uint8_t) writedata[j]);
-           printf("  ");
-           for(j= 0 ; j < 8 ; ++j)
-             printf("%c", isprint(writedata[j]) ? (char) writedata[j] : '.');
-           printf("  ");
-           iclass_print_blocktype(writeblock, app1_limit, writedata);
-           }
-        printf("\n");
-        }
-      printf("\n");
-      }
-
-    printf("  reading APP2 blocks:\n\n");
-    for(i= app1_limit + 1 ; i <= app2_limit ; ++i)
-    {
-      printf("    Block 0x%02x: ", i);
-      if(!iclass_read(pnd, i, buff))
-      {
-        for(j= 0 ; j < 8 ; ++j)
-          printf("%02x", (uint8_t) buff[j]);
-        printf("  ");
-        for(j= 0 ; j < 8 ; ++j)
-  	printf("%c", isprint(buff[j]) ? (char) buff[j] : '.');    
-        printf("  ");
-        iclass_print_blocktype(i, app1_limit, buff);
-        if(dump)
-          if(write(outfile, buff, 8) != 8)
-            return errorexit("Write to output file failed!\n");
-      }
-      else
-        printf("read failed!");
-      printf("\n");
-    }
-  printf("\n");
-  }
-
-
-  if(dump)
-    close(outfile);
-
-   // rekey last so we don't have to worry about re-authing
-  if(rekey)
-    {
-    // block 3 (debit key) or 4 (credit key) writes will be xor'd as appropriate
-    if(got_kc)
-      {
-      if(iclass_write(pnd, 4, krekey))
-      return errorexit("Re-Key CREDIT failed!\n");
-      }
-    else
-      {
-      if(iclass_write(pnd, 3, krekey))
-        return errorexit("Re-Key DEBIT failed!\n");
-      }
-      printf("\n  Re-Key OK\n");
+    ret= process_card(&job);
     }
 
   nfc_close(pnd);
   nfc_exit(context);
-  exit(EXIT_SUCCESS);
+  exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 char errorexit(char *message)
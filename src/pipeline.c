@@ -0,0 +1,197 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file pipeline.c
+ * @brief build UPDATE frames on a worker thread while earlier frames are sent to the card
+ *
+ * MAC and 3DES work for a whole card is done by the producer thread, and the
+ * consumer only has to stream ready-made frames to the reader, so crypto time
+ * is hidden behind RF latency. The frame list is kept after the run so it can
+ * be inspected or sent again. For a clone the producer reads the data from the
+ * source card on another reader, so reading and writing overlap as well.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "pipeline.h"
+#include "iclass.h"
+
+static void *pipeline_thread(void *arg)
+{
+  iclass_framelist *list= (iclass_framelist *) arg;
+
+  list->build(list, list->arg);
+  pthread_mutex_lock(&list->lock);
+  list->done= true;
+  pthread_cond_signal(&list->ready);
+  pthread_mutex_unlock(&list->lock);
+  return NULL;
+}
+
+// start producer of frames for the card on pnd - return false if OK or true if failed
+bool pipeline_start(iclass_framelist *list, nfc_device *pnd, iclass_producer build, void *arg)
+{
+  list->pnd= pnd;
+  list->count= 0;
+  list->done= false;
+  list->failed= false;
+  list->build= build;
+  list->arg= arg;
+  pthread_mutex_init(&list->lock, NULL);
+  pthread_cond_init(&list->ready, NULL);
+  if(pthread_create(&list->thread, NULL, pipeline_thread, list))
+    return true;
+  return false;
+}
+
+// make frame f visible to the consumer
+static void pipeline_publish(iclass_framelist *list, iclass_frame *f, uint8_t blockno, uint8_t *data, char *note)
+{
+  f->blockno= blockno;
+  f->note= note;
+  memcpy(f->data, data, 8);
+  // publish frame
+  pthread_mutex_lock(&list->lock);
+  list->count++;
+  pthread_cond_signal(&list->ready);
+  pthread_mutex_unlock(&list->lock);
+}
+
+// called by producer - return false if OK or true if frame could not be built
+bool pipeline_add(iclass_framelist *list, uint8_t blockno, uint8_t *data, char *note)
+{
+  iclass_frame *f;
+
+  f= &list->frames[list->count];
+  if(list->count >= PIPELINE_MAXFRAMES || iclass_update_frame(list->pnd, blockno, data, f->frame))
+    {
+    pipeline_fail(list);
+    return true;
+    }
+  pipeline_publish(list, f, blockno, data, note);
+  return false;
+}
+
+// called by producer for a card in personalisation mode - no MAC, so nothing can fail but space
+bool pipeline_add_plain(iclass_framelist *list, uint8_t blockno, uint8_t *data, char *note)
+{
+  if(list->count >= PIPELINE_MAXFRAMES)
+    {
+    pipeline_fail(list);
+    return true;
+    }
+  iclass_personalise_frame(blockno, data, list->frames[list->count].frame);
+  pipeline_publish(list, &list->frames[list->count], blockno, data, note);
+  return false;
+}
+
+// called by producer - stop the run, as a frame could not be built or its data could not be got
+void pipeline_fail(iclass_framelist *list)
+{
+  pthread_mutex_lock(&list->lock);
+  list->failed= true;
+  pthread_cond_signal(&list->ready);
+  pthread_mutex_unlock(&list->lock);
+}
+
+// send frames to card as the producer makes them available
+// return number of blocks written or -1 if failed
+int pipeline_run(nfc_device *pnd, iclass_framelist *list, uint8_t app1_limit)
+{
+  iclass_frame *f;
+  int i, j, ret= 0;
+
+  for(i= 0 ; ; ++i)
+    {
+    pthread_mutex_lock(&list->lock);
+    while(i >= list->count && !list->done && !list->failed)
+      pthread_cond_wait(&list->ready, &list->lock);
+    if(i >= list->count)
+      {
+      pthread_mutex_unlock(&list->lock);
+      break;
+      }
+    pthread_mutex_unlock(&list->lock);
+
+    f= &list->frames[i];
+    if(iclass_write_frame(pnd, f->frame, f->data))
+      {
+      ret= -1;
+      break;
+      }
+    printf("    Block 0x%02x: ", f->blockno);
+    for(j= 0 ; j < 8 ; ++j)
+      printf("%02x", f->data[j]);
+    printf("  ");
+    for(j= 0 ; j < 8 ; ++j)
+      printf("%c", isprint(f->data[j]) ? (char) f->data[j] : '.');
+    printf("  ");
+    if(f->note)
+      printf("%s", f->note);
+    else
+      iclass_print_blocktype(f->blockno, app1_limit, f->data);
+    printf("\n");
+    ++ret;
+    }
+
+  pthread_join(list->thread, NULL);
+  pthread_mutex_destroy(&list->lock);
+  pthread_cond_destroy(&list->ready);
+  if(list->failed)
+    return -1;
+  return ret;
+}
+
+// show frames exactly as they will be (or were) sent
+void pipeline_print(iclass_framelist *list)
+{
+  int i, j;
+
+  for(i= 0 ; i < list->count ; ++i)
+    {
+    printf("    UPDATE: ");
+    for(j= 0 ; j < 16 ; ++j)
+      printf("%02X", list->frames[i].frame[j]);
+    printf("\n");
+    }
+}
@@ -0,0 +1,84 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file pipeline.h
+ * @brief build UPDATE frames on a worker thread while earlier frames are sent to the card
+ */
+
+#ifndef _PIPELINE_H_
+#  define _PIPELINE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <nfc/nfc.h>
+
+#define PIPELINE_MAXFRAMES	0x100 // can't address more blocks than this
+
+typedef struct {
+  uint8_t blockno;
+  uint8_t data[8];	// block contents as they should read back
+  uint8_t frame[16];	// complete UPDATE command
+  char *note;		// optional description for output
+} iclass_frame;
+
+typedef struct iclass_framelist iclass_framelist;
+
+// producer builds frames by calling pipeline_add() - it runs on its own thread
+typedef void (*iclass_producer)(iclass_framelist *list, void *arg);
+
+struct iclass_framelist {
+  iclass_frame frames[PIPELINE_MAXFRAMES];
+  int count;		// frames built so far
+  bool done;		// producer has finished
+  bool failed;		// producer could not build a frame
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_t thread;
+  iclass_producer build;
+  void *arg;
+  nfc_device *pnd;	// reader of the card the frames are for
+};
+
+bool pipeline_start(iclass_framelist *list, nfc_device *pnd, iclass_producer build, void *arg);
+bool pipeline_add(iclass_framelist *list, uint8_t blockno, uint8_t *data, char *note);
+bool pipeline_add_plain(iclass_framelist *list, uint8_t blockno, uint8_t *data, char *note);
+void pipeline_fail(iclass_framelist *list);
+int pipeline_run(nfc_device *pnd, iclass_framelist *list, uint8_t app1_limit);
+void pipeline_print(iclass_framelist *list);
+#endif // _PIPELINE_H_
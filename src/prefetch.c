@@ -0,0 +1,179 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file prefetch.c
+ * @brief derive a card's keys on a worker thread while its header is read
+ *
+ * The CSN is known as soon as a card is selected, but its keys used to be
+ * diversified only when authenticating, after the header had been read, which
+ * put ELITE diversification (hash1, hash2 and DES) on the critical path. Every
+ * key a job can use is registered once with prefetch_key(). prefetch_start()
+ * queues them all for a newly selected CSN, and a worker thread derives them
+ * while the main thread reads the header. iclass_divkey() takes the results
+ * from here and only waits if the worker hasn't got to a key yet.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <string.h>
+#include <pthread.h>
+
+#include "prefetch.h"
+#include "iclass.h"
+
+typedef struct {
+  uint8_t csn[8];
+  uint8_t key[8];
+  bool elite;
+  bool done;			// div_key is ready
+  uint8_t div_key[8];
+} prefetch_entry;
+
+static uint8_t Keys[PREFETCH_MAXKEYS][8];
+static bool Elite[PREFETCH_MAXKEYS];
+static int Nkeys= 0;
+static prefetch_entry Queue[PREFETCH_MAXKEYS * PREFETCH_MAXCARDS];
+static int Queued= 0;		// entries in Queue
+static int Next= 0;		// first entry the worker hasn't started
+static bool Running= false;	// worker thread is going
+static pthread_mutex_t Lock= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Done= PTHREAD_COND_INITIALIZER;
+
+// register key to be derived for every card selected
+void prefetch_key(uint8_t *key, bool elite)
+{
+  int i;
+
+  for(i= 0 ; i < Nkeys ; ++i)
+    if(Elite[i] == elite && !memcmp(Keys[i], key, 8))
+      return;
+  if(Nkeys == PREFETCH_MAXKEYS)
+    return;
+  memcpy(Keys[Nkeys], key, 8);
+  Elite[Nkeys++]= elite;
+}
+
+static prefetch_entry *prefetch_find(uint8_t *csn, uint8_t *key, bool elite)
+{
+  int i;
+
+  for(i= 0 ; i < Queued ; ++i)
+    if(Queue[i].elite == elite && !memcmp(Queue[i].csn, csn, 8) && !memcmp(Queue[i].key, key, 8))
+      return &Queue[i];
+  return NULL;
+}
+
+// entries are not changed once queued, so they can be read without the lock
+static void *prefetch_thread(void *arg)
+{
+  prefetch_entry *e;
+  uint8_t div_key[8];
+
+  pthread_mutex_lock(&Lock);
+  while(Next < Queued)
+    {
+    e= &Queue[Next++];
+    pthread_mutex_unlock(&Lock);
+    iclass_divkey_now(e->csn, e->key, e->elite, div_key);
+    pthread_mutex_lock(&Lock);
+    memcpy(e->div_key, div_key, 8);
+    e->done= true;
+    pthread_cond_broadcast(&Done);
+    }
+  Running= false;
+  pthread_cond_broadcast(&Done);
+  pthread_mutex_unlock(&Lock);
+  return NULL;
+}
+
+// start deriving the registered keys for a selected card
+void prefetch_start(uint8_t *csn)
+{
+  pthread_t thread;
+  int i;
+
+  pthread_mutex_lock(&Lock);
+  for(i= 0 ; i < Nkeys && Queued < PREFETCH_MAXKEYS * PREFETCH_MAXCARDS ; ++i)
+    if(!prefetch_find(csn, Keys[i], Elite[i]))
+      {
+      memcpy(Queue[Queued].csn, csn, 8);
+      memcpy(Queue[Queued].key, Keys[i], 8);
+      Queue[Queued].elite= Elite[i];
+      Queue[Queued++].done= false;
+      }
+  // if there's no thread the keys are simply derived when asked for
+  if(!Running && Next < Queued && !pthread_create(&thread, NULL, prefetch_thread, NULL))
+    {
+    pthread_detach(thread);
+    Running= true;
+    }
+  pthread_mutex_unlock(&Lock);
+}
+
+// drop keys of previous cards - work the worker hasn't started is abandoned
+void prefetch_reset(void)
+{
+  pthread_mutex_lock(&Lock);
+  Next= Queued;
+  while(Running)
+    pthread_cond_wait(&Done, &Lock);
+  Queued= Next= 0;
+  pthread_mutex_unlock(&Lock);
+}
+
+// get key derived for csn, waiting for the worker if need be
+// return true if div_key was prefetched or false if caller must derive it
+bool prefetch_take(uint8_t *csn, uint8_t *key, bool elite, uint8_t *div_key)
+{
+  prefetch_entry *e;
+  bool ret;
+
+  pthread_mutex_lock(&Lock);
+  if(!(e= prefetch_find(csn, key, elite)))
+    {
+    pthread_mutex_unlock(&Lock);
+    return false;
+    }
+  while(!e->done && Running)
+    pthread_cond_wait(&Done, &Lock);
+  if((ret= e->done))
+    memcpy(div_key, e->div_key, 8);
+  pthread_mutex_unlock(&Lock);
+  return ret;
+}
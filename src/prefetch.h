@@ -0,0 +1,64 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file prefetch.h
+ * @brief derive a card's keys on a worker thread while its header is read
+ */
+
+#ifndef _PREFETCH_H_
+#  define _PREFETCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PREFETCH_MAXKEYS	4	// debit, credit, re-key and default Kd for a clone target
+#define PREFETCH_MAXCARDS	2	// cards selected at once (clone source and target)
+
+#ifndef LEAN
+void prefetch_key(uint8_t *key, bool elite);
+void prefetch_start(uint8_t *csn);
+void prefetch_reset(void);
+bool prefetch_take(uint8_t *csn, uint8_t *key, bool elite, uint8_t *div_key);
+#else
+// no ELITE keys in the lean build, and plain diversification is a single DES
+static inline void prefetch_key(uint8_t *key, bool elite) { }
+static inline void prefetch_start(uint8_t *csn) { }
+static inline void prefetch_reset(void) { }
+static inline bool prefetch_take(uint8_t *csn, uint8_t *key, bool elite, uint8_t *div_key) { return false; }
+#endif // LEAN
+#endif // _PREFETCH_H_
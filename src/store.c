@@ -0,0 +1,563 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file store.c
+ * @brief content-addressed store for card dumps
+ *
+ * Most of a dump archive is the same few blocks over and over: the FF key
+ * blocks, the application issuer block, CONFIG blocks and the padding that
+ * fills the rest of the card. The store keeps every distinct 8 byte block once
+ * and each dump as a small manifest of references to them. A STORE directory
+ * holds two append-only files:
+ *
+ *   chunks:     "ICCS" version(1) reserved(3), then distinct blocks (8 bytes each)
+ *   manifests:  "ICMF" version(1) reserved(3), then records of
+ *               varint(namelen) name varint(codelen) code
+ *
+ * A block's chunk number is its position in the chunks file, found by a hash
+ * of its contents. code is a run of varint(chunk << 1 | repeat) entries, where
+ * repeat is followed by varint(count) for a block repeated count times, so a
+ * 2K dump usually takes a few dozen bytes plus the blocks that are unique to
+ * the card (CSN, e-purse, credential).
+ *
+ * Both files are read into memory on open, which also makes the in-memory
+ * copies the write buffers: new chunks and records are appended there and
+ * flushed chunks first, so a manifest on disk never refers to a chunk that
+ * isn't. A record that is torn, or refers past the end of the chunks file,
+ * ends the replay and is cut off. Adding a name again replaces the dump.
+ * Only one process can add at a time, and readers wait for it to finish.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "store.h"
+
+#define STORE_VERSION		1
+#define STORE_HEADER		8
+#define STORE_MINSIZE		1024	// initial hash table size (power of 2)
+#define STORE_FLUSH		0x10000	// unwritten bytes before a flush
+#define STORE_MAXCODE		(STORE_MAXBLOCKS * 10)	// two 5 byte varints per block at worst
+
+static int Chunk_fd= -1, Manifest_fd= -1;
+static bool Writable= false;
+
+// distinct blocks - chunk number is the index
+static uint8_t (*Chunks)[8]= NULL;
+static uint32_t Chunk_count= 0, Chunk_alloc= 0, Chunk_written= 0;
+static uint32_t *Chunk_table= NULL, Chunk_size= 0;	// chunk + 1, 0 for empty
+
+// manifest records as in the file, less header
+static uint8_t *Manifests= NULL;
+static size_t Manifest_len= 0, Manifest_alloc= 0, Manifest_written= 0;
+static uint32_t *Name_table= NULL, Name_size= 0, Name_used= 0;	// record offset + 1, 0 for empty
+
+static int store_put_varint(uint8_t *p, uint32_t v)
+{
+  int n= 0;
+
+  while(v >= 0x80)
+    {
+    p[n++]= (v & 0x7f) | 0x80;
+    v >>= 7;
+    }
+  p[n++]= v;
+  return n;
+}
+
+// return pointer past varint or NULL if it runs past end
+static const uint8_t *store_get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+  int shift;
+
+  *v= 0;
+  for(shift= 0 ; p < end && shift < 35 ; shift += 7)
+    {
+    *v |= (uint32_t) (*p & 0x7f) << shift;
+    if(!(*p++ & 0x80))
+      return p;
+    }
+  return NULL;
+}
+
+static uint32_t store_block_hash(const uint8_t *block)
+{
+  uint64_t v;
+
+  memcpy(&v, block, 8);
+  v *= 0x9e3779b97f4a7c15ULL;
+  return (uint32_t) (v >> 32);
+}
+
+static uint32_t store_name_hash(const uint8_t *name, uint32_t len)
+{
+  uint32_t h= 2166136261U;
+
+  while(len--)
+    h= (h ^ *name++) * 16777619U;
+  return h;
+}
+
+// parse record at off - return offset of the next one, or 0 if torn
+static size_t store_record(size_t off, const uint8_t **name, uint32_t *namelen, const uint8_t **code, uint32_t *codelen)
+{
+  const uint8_t *p= Manifests + off, *end= Manifests + Manifest_len;
+
+  if(!(p= store_get_varint(p, end, namelen)) || *namelen > (uint32_t) (end - p))
+    return 0;
+  *name= p;
+  p += *namelen;
+  if(!(p= store_get_varint(p, end, codelen)) || *codelen > (uint32_t) (end - p))
+    return 0;
+  *code= p;
+  return p + *codelen - Manifests;
+}
+
+// expand code into image, stopping after max bytes - return dump length or -1 if bad
+static int store_decode(const uint8_t *code, uint32_t codelen, uint8_t *image, int max)
+{
+  const uint8_t *end= code + codelen;
+  uint32_t entry, count;
+  int blocks= 0;
+
+  while(code < end)
+    {
+    if(!(code= store_get_varint(code, end, &entry)))
+      return -1;
+    count= 1;
+    if((entry & 1) && !(code= store_get_varint(code, end, &count)))
+      return -1;
+    if((entry >> 1) >= Chunk_count || count > (uint32_t) (STORE_MAXBLOCKS - blocks))
+      return -1;
+    for( ; count ; --count, ++blocks)
+      if((blocks + 1) * 8 <= max)
+        memcpy(&image[blocks * 8], Chunks[entry >> 1], 8);
+    }
+  return blocks * 8;
+}
+
+// return slot for chunk with contents block - matching or empty
+static uint32_t *store_chunk_slot(uint32_t *table, uint32_t size, const uint8_t *block)
+{
+  uint32_t h, *slot;
+
+  for(h= store_block_hash(block) ; ; ++h)
+    {
+    slot= &table[h & (size - 1)];
+    if(!*slot || !memcmp(Chunks[*slot - 1], block, 8))
+      return slot;
+    }
+}
+
+static uint32_t *store_name_slot(uint32_t *table, uint32_t size, const uint8_t *name, uint32_t namelen)
+{
+  const uint8_t *n, *code;
+  uint32_t h, *slot, len, codelen;
+
+  for(h= store_name_hash(name, namelen) ; ; ++h)
+    {
+    slot= &table[h & (size - 1)];
+    if(!*slot)
+      return slot;
+    store_record(*slot - 1, &n, &len, &code, &codelen);
+    if(len == namelen && !memcmp(n, name, len))
+      return slot;
+    }
+}
+
+// double a table - return false if OK
+static bool store_grow_chunks(void)
+{
+  uint32_t size= Chunk_size ? Chunk_size * 2 : STORE_MINSIZE, *table, i;
+
+  if(!(table= calloc(size, sizeof(uint32_t))))
+    return true;
+  for(i= 0 ; i < Chunk_count ; ++i)
+    *store_chunk_slot(table, size, Chunks[i])= i + 1;
+  free(Chunk_table);
+  Chunk_table= table;
+  Chunk_size= size;
+  return false;
+}
+
+static bool store_grow_names(void)
+{
+  uint32_t size= Name_size ? Name_size * 2 : STORE_MINSIZE, *table, i;
+  const uint8_t *name, *code;
+  uint32_t namelen, codelen;
+
+  if(!(table= calloc(size, sizeof(uint32_t))))
+    return true;
+  for(i= 0 ; i < Name_size ; ++i)
+    if(Name_table[i])
+      {
+      store_record(Name_table[i] - 1, &name, &namelen, &code, &codelen);
+      *store_name_slot(table, size, name, namelen)= Name_table[i];
+      }
+  free(Name_table);
+  Name_table= table;
+  Name_size= size;
+  return false;
+}
+
+// make record at off the one for its name - return false if OK
+static bool store_index_name(size_t off)
+{
+  const uint8_t *name, *code;
+  uint32_t namelen, codelen, *slot;
+
+  if(Name_used * 2 >= Name_size && store_grow_names())
+    return true;
+  store_record(off, &name, &namelen, &code, &codelen);
+  slot= store_name_slot(Name_table, Name_size, name, namelen);
+  if(!*slot)
+    ++Name_used;
+  *slot= off + 1;
+  return false;
+}
+
+// find or add chunk for block - return chunk number or UINT32_MAX if out of memory
+static uint32_t store_chunk(const uint8_t *block)
+{
+  uint8_t (*chunks)[8];
+  uint32_t *slot;
+
+  if(Chunk_count * 2 >= Chunk_size && store_grow_chunks())
+    return UINT32_MAX;
+  slot= store_chunk_slot(Chunk_table, Chunk_size, block);
+  if(*slot)
+    return *slot - 1;
+  if(Chunk_count == Chunk_alloc)
+    {
+    if(!(chunks= realloc(Chunks, (Chunk_alloc ? Chunk_alloc * 2 : STORE_MINSIZE) * 8)))
+      return UINT32_MAX;
+    Chunks= chunks;
+    Chunk_alloc= Chunk_alloc ? Chunk_alloc * 2 : STORE_MINSIZE;
+    }
+  memcpy(Chunks[Chunk_count], block, 8);
+  *slot= ++Chunk_count;
+  return Chunk_count - 1;
+}
+
+static bool store_write(int fd, const void *data, size_t len)
+{
+  const uint8_t *p= data;
+  ssize_t ret;
+
+  while(len)
+    {
+    if((ret= write(fd, p, len)) <= 0)
+      return true;
+    p += ret;
+    len -= ret;
+    }
+  return false;
+}
+
+// write out new chunks, then the records that use them - return false if OK
+static bool store_flush(void)
+{
+  if(store_write(Chunk_fd, Chunks[Chunk_written], (size_t) (Chunk_count - Chunk_written) * 8))
+    return true;
+  Chunk_written= Chunk_count;
+  if(store_write(Manifest_fd, Manifests + Manifest_written, Manifest_len - Manifest_written))
+    return true;
+  Manifest_written= Manifest_len;
+  return false;
+}
+
+// open file in dir, creating it with header if writable, and optionally lock it
+// return contents less header (caller frees)
+static uint8_t *store_load(char *dir, char *file, char *magic, bool lock, int *fd, size_t *len)
+{
+  char path[PATH_MAX];
+  uint8_t header[STORE_HEADER], *data;
+  struct stat st;
+  size_t got;
+  ssize_t ret;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  if((*fd= open(path, Writable ? O_RDWR | O_CREAT : O_RDONLY, S_IRUSR | S_IWUSR)) < 0)
+    return NULL;
+  // a reader waits for a writer to finish, a second writer gives up
+  if(lock && flock(*fd, Writable ? LOCK_EX | LOCK_NB : LOCK_SH) < 0)
+    return NULL;
+  if(fstat(*fd, &st) < 0)
+    return NULL;
+  if(!st.st_size && Writable)
+    {
+    memset(header, 0, STORE_HEADER);
+    memcpy(header, magic, 4);
+    header[4]= STORE_VERSION;
+    if(store_write(*fd, header, STORE_HEADER))
+      return NULL;
+    st.st_size= STORE_HEADER;
+    }
+  if(st.st_size < STORE_HEADER || pread(*fd, header, STORE_HEADER, 0) != STORE_HEADER
+     || memcmp(header, magic, 4) || header[4] != STORE_VERSION)
+    return NULL;
+  *len= st.st_size - STORE_HEADER;
+  if(!(data= malloc(*len ? *len : 1)))
+    return NULL;
+  for(got= 0 ; got < *len ; got += ret)
+    if((ret= pread(*fd, data + got, *len - got, STORE_HEADER + got)) <= 0)
+      {
+      free(data);
+      return NULL;
+      }
+  return data;
+}
+
+// open (or create, if writable) STORE directory - return false if OK or true if failed
+bool store_open(char *dir, bool writable)
+{
+  const uint8_t *name, *code;
+  uint32_t namelen, codelen;
+  size_t len, off, next;
+
+  Writable= writable;
+  if(writable)
+    mkdir(dir, S_IRWXU);
+  // the lock on the manifests file guards both
+  if(!(Manifests= store_load(dir, "manifests", "ICMF", true, &Manifest_fd, &Manifest_len)))
+    goto fail;
+  if(!(Chunks= (uint8_t (*)[8]) store_load(dir, "chunks", "ICCS", false, &Chunk_fd, &len)))
+    goto fail;
+  Manifest_alloc= Manifest_len;
+  Chunk_alloc= len / 8;
+  for(Chunk_count= 0 ; Chunk_count < len / 8 ; ++Chunk_count)
+    {
+    if(Chunk_count * 2 >= Chunk_size && store_grow_chunks())
+      goto fail;
+    *store_chunk_slot(Chunk_table, Chunk_size, Chunks[Chunk_count])= Chunk_count + 1;
+    }
+  for(off= 0 ; off < Manifest_len ; off= next)
+    {
+    if(!(next= store_record(off, &name, &namelen, &code, &codelen)) || store_decode(code, codelen, NULL, 0) <= 0)
+      break;
+    if(store_index_name(off))
+      goto fail;
+    }
+  Manifest_len= off;
+  Chunk_written= Chunk_count;
+  Manifest_written= Manifest_len;
+  // cut off anything torn by a crash
+  if(writable && (ftruncate(Chunk_fd, STORE_HEADER + (off_t) Chunk_count * 8) < 0 || lseek(Chunk_fd, 0, SEEK_END) < 0
+     || ftruncate(Manifest_fd, STORE_HEADER + (off_t) Manifest_len) < 0 || lseek(Manifest_fd, 0, SEEK_END) < 0))
+    goto fail;
+  return false;
+
+fail:
+  Writable= false;
+  store_close();
+  return true;
+}
+
+void store_close(void)
+{
+  if(Writable)
+    if(store_flush() || fdatasync(Chunk_fd) < 0 || fdatasync(Manifest_fd) < 0)
+      fprintf(stderr, "Can't write dump store!\n");
+  if(Chunk_fd >= 0)
+    close(Chunk_fd);
+  if(Manifest_fd >= 0)
+    close(Manifest_fd);
+  Chunk_fd= Manifest_fd= -1;
+  free(Chunks);
+  free(Chunk_table);
+  free(Manifests);
+  free(Name_table);
+  Chunks= NULL;
+  Chunk_table= Name_table= NULL;
+  Manifests= NULL;
+  Chunk_count= Chunk_alloc= Chunk_written= Chunk_size= 0;
+  Manifest_len= Manifest_alloc= Manifest_written= 0;
+  Name_size= Name_used= 0;
+  Writable= false;
+}
+
+bool store_active(void)
+{
+  return Manifest_fd >= 0;
+}
+
+// add dump (len bytes, whole blocks) as name - return false if OK or true if failed
+bool store_add(const char *name, int namelen, uint8_t *image, int len)
+{
+  uint8_t code[STORE_MAXCODE], *manifests;
+  const uint8_t *oldname, *oldcode;
+  uint32_t chunk, oldnamelen, oldcodelen, *slot;
+  int i, j, n= 0, blocks= len / 8;
+  size_t need;
+
+  if(!Writable || len <= 0 || len % 8 || blocks > STORE_MAXBLOCKS || namelen <= 0)
+    return true;
+  for(i= 0 ; i < blocks ; i= j)
+    {
+    for(j= i + 1 ; j < blocks && !memcmp(&image[j * 8], &image[i * 8], 8) ; ++j)
+      ;
+    if((chunk= store_chunk(&image[i * 8])) == UINT32_MAX)
+      return true;
+    n += store_put_varint(&code[n], chunk << 1 | (j - i > 1));
+    if(j - i > 1)
+      n += store_put_varint(&code[n], j - i);
+    }
+  // same dump under the same name is already here
+  if(Name_size && *(slot= store_name_slot(Name_table, Name_size, (const uint8_t *) name, namelen)))
+    {
+    store_record(*slot - 1, &oldname, &oldnamelen, &oldcode, &oldcodelen);
+    if(oldcodelen == (uint32_t) n && !memcmp(oldcode, code, n))
+      return false;
+    }
+  need= Manifest_len + 10 + namelen + n;
+  if(need > Manifest_alloc)
+    {
+    if(!(manifests= realloc(Manifests, need * 2)))
+      return true;
+    Manifests= manifests;
+    Manifest_alloc= need * 2;
+    }
+  i= Manifest_len;
+  Manifest_len += store_put_varint(Manifests + Manifest_len, namelen);
+  memcpy(Manifests + Manifest_len, name, namelen);
+  Manifest_len += namelen;
+  Manifest_len += store_put_varint(Manifests + Manifest_len, n);
+  memcpy(Manifests + Manifest_len, code, n);
+  Manifest_len += n;
+  if(store_index_name(i))
+    return true;
+  if(Manifest_len - Manifest_written + (size_t) (Chunk_count - Chunk_written) * 8 >= STORE_FLUSH)
+    return store_flush();
+  return false;
+}
+
+// copy up to max bytes of dump name into image - return dump length or -1 if not found
+// (safe to call from many threads as long as nothing is being added)
+int store_get(const char *name, int namelen, uint8_t *image, int max)
+{
+  const uint8_t *recname, *code;
+  uint32_t recnamelen, codelen, *slot;
+
+  if(!Name_size)
+    return -1;
+  slot= store_name_slot(Name_table, Name_size, (const uint8_t *) name, namelen);
+  if(!*slot)
+    return -1;
+  store_record(*slot - 1, &recname, &recnamelen, &code, &codelen);
+  return store_decode(code, codelen, image, max);
+}
+
+// add every dump listed in listfile (one path per line) - return number that couldn't be read or -1 if failed
+int store_add_list(char *listfile)
+{
+  static uint8_t image[STORE_MAXBLOCKS * 8 + 1];
+  char line[PATH_MAX + 2], *p, *q;
+  unsigned long added= 0, unchanged= 0, bad= 0;
+  unsigned long long in= 0;
+  size_t before;
+  FILE *list;
+  int fd, len;
+
+  if(!(list= fopen(listfile, "r")))
+    return -1;
+  while(fgets(line, sizeof(line), list))
+    {
+    for(p= line ; isspace((unsigned char) *p) ; ++p)
+      ;
+    for(q= p + strlen(p) ; q > p && isspace((unsigned char) q[-1]) ; --q)
+      ;
+    *q= '\0';
+    if(q == p || *p == '#')
+      continue;
+    len= -1;
+    if((fd= open(p, O_RDONLY)) >= 0)
+      {
+      len= (int) read(fd, image, sizeof(image));
+      close(fd);
+      }
+    if(len <= 0 || len % 8 || len > STORE_MAXBLOCKS * 8)
+      {
+      fprintf(stderr, "  %s: not a dump\n", p);
+      ++bad;
+      continue;
+      }
+    before= Manifest_len;
+    if(store_add(p, (int) (q - p), image, len))
+      {
+      fclose(list);
+      return -1;
+      }
+    in += len;
+    if(Manifest_len == before)
+      ++unchanged;
+    else
+      ++added;
+    }
+  fclose(list);
+  if(store_flush())
+    return -1;
+  fprintf(stderr, "\n  %lu dumps added, %lu unchanged, %lu unreadable\n", added, unchanged, bad);
+  fprintf(stderr, "  %llu bytes of dumps, store now %llu bytes (%u distinct blocks, %u dumps)\n", in,
+          (unsigned long long) (2 * STORE_HEADER + (size_t) Chunk_count * 8 + Manifest_len), Chunk_count, Name_used);
+  return (int) (bad > 0x7fffffff ? 0x7fffffff : bad);
+}
+
+// print the name of every dump in the store, oldest first
+void store_list(void)
+{
+  const uint8_t *name, *code;
+  uint32_t namelen, codelen;
+  size_t off, next;
+
+  for(off= 0 ; off < Manifest_len && (next= store_record(off, &name, &namelen, &code, &codelen)) ; off= next)
+    if(*store_name_slot(Name_table, Name_size, name, namelen) == off + 1)
+      {
+      fwrite(name, 1, namelen, stdout);
+      putchar('\n');
+      }
+}
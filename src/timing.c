@@ -0,0 +1,193 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file timing.c
+ * @brief per-reader timing profiles written by calibration and loaded by normal runs
+ *
+ * One line per reader, keyed by libnfc connstring, so two readers of the same
+ * model on different ports can have different profiles:
+ *
+ *   pn532_uart:/dev/ttyUSB0 timeout=50 update=100 typeb=1 read4=1 # PN532 board
+ *
+ * A USB connstring holds the bus and device number, which change when the
+ * reader is plugged in again, so USB readers are keyed by driver and device
+ * name instead (spaces become '_'):
+ *
+ *   pn53x_usb:SCM_Micro_/_SCL3711-NFC&RW timeout=20 update=-1 typeb=0 read4=1 # SCM Micro / SCL3711-NFC&RW
+ *
+ * Lines starting with '#' are comments. A line for a reader is replaced when
+ * it is calibrated again.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <nfc/nfc.h>
+
+#include "timing.h"
+
+#define TIMING_LINEMAX		1024
+
+// profile file - return path or NULL if there's nowhere to keep one
+char *timing_path(void)
+{
+  static char path[1024];
+  char *p;
+
+  if((p= getenv("NFC_ICLASS_TIMING")))
+    return p;
+  if(!(p= getenv("HOME")))
+    return NULL;
+  snprintf(path, sizeof(path), "%s/%s", p, TIMING_FILE);
+  return path;
+}
+
+// key of the profile for dev - connstring, or for USB readers driver and device name
+const char *timing_reader(nfc_device *dev)
+{
+  static char key[256];
+  const char *conn= nfc_device_get_connstring(dev);
+  const char *colon= strchr(conn, ':');
+  char *p;
+
+  if(!colon || colon - conn < 4 || strncmp(colon - 4, "_usb", 4))
+    return conn;
+  snprintf(key, sizeof(key), "%.*s:%s", (int) (colon - conn), conn, nfc_device_get_name(dev));
+  for(p= key ; *p ; ++p)
+    if(*p == ' ' || *p == '\t')
+      *p= '_';
+  return key;
+}
+
+// return true if line is the profile of reader
+static bool timing_match(char *line, const char *reader)
+{
+  size_t len= strlen(reader);
+
+  return !strncmp(line, reader, len) && (line[len] == ' ' || line[len] == '\t');
+}
+
+// parse line as the profile of reader - return false if it is or true if not
+static bool timing_parse(char *line, const char *reader, iclass_timing *timing)
+{
+  int typeb, read4;
+
+  if(!timing_match(line, reader)
+    || sscanf(line + strlen(reader), " timeout=%d update=%d typeb=%d read4=%d",
+         &timing->timeout, &timing->update_timeout, &typeb, &read4) != 4)
+    return true;
+  timing->typeb_setup= typeb;
+  timing->read4= read4;
+  return false;
+}
+
+// load profile of reader - return false if OK or true if there isn't one
+// reads with open()/read() into a static buffer so the lean build stays off the heap
+bool timing_load(char *path, const char *reader, iclass_timing *timing)
+{
+  static char buf[TIMING_LINEMAX + 1];
+  size_t len= 0;
+  ssize_t got;
+  char *line, *nl;
+  bool ret= true;
+  int fd;
+
+  if(!path || (fd= open(path, O_RDONLY)) < 0)
+    return true;
+  while(ret && (got= read(fd, buf + len, TIMING_LINEMAX - len)) > 0)
+    {
+    len += got;
+    buf[len]= '\0';
+    for(line= buf ; ret && (nl= strchr(line, '\n')) ; line= nl + 1)
+      {
+      *nl= '\0';
+      ret= timing_parse(line, reader, timing);
+      }
+    // overlong line - take it in pieces, as fgets() would
+    if(ret && line == buf && len == TIMING_LINEMAX)
+      {
+      ret= timing_parse(line, reader, timing);
+      line += len;
+      }
+    len -= line - buf;
+    memmove(buf, line, len);
+    }
+  // last line without a newline
+  if(ret && len)
+    {
+    buf[len]= '\0';
+    ret= timing_parse(buf, reader, timing);
+    }
+  close(fd);
+  return ret;
+}
+
+// save profile of reader, replacing any it had - return false if OK or true if failed
+bool timing_save(char *path, const char *reader, const char *name, const iclass_timing *timing)
+{
+  char line[TIMING_LINEMAX], tmp[1024];
+  FILE *in, *out;
+
+  if(!path)
+    return true;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if(!(out= fopen(tmp, "w")))
+    return true;
+  if((in= fopen(path, "r")))
+    {
+    while(fgets(line, sizeof(line), in))
+      if(!timing_match(line, reader))
+        fputs(line, out);
+    fclose(in);
+    }
+  else
+    fprintf(out, "# nfc-iclass reader timing profiles - written by -B\n");
+  fprintf(out, "%s timeout=%d update=%d typeb=%d read4=%d # %s\n", reader, timing->timeout,
+    timing->update_timeout, timing->typeb_setup, timing->read4, name);
+  if(fclose(out) || rename(tmp, path))
+    {
+    unlink(tmp);
+    return true;
+    }
+  return false;
+}
@@ -0,0 +1,304 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+/**
+ * @file trace.c
+ * @brief record RF traffic to a binary trace file and replay it without a reader
+ *
+ * Recording copies each frame into an in-memory ring buffer, and a writer
+ * thread streams the ring to disk, so the RF path never waits on file I/O.
+ * The writer batches frames but writes any it holds within TRACE_FLUSH_MS, so
+ * a ^C or crash loses no more than the last few.
+ *
+ * File format (all values little endian):
+ *
+ *   header:  "ICTR" version(1) reserved(3)
+ *   record:  usec(8) type(1) result(2, signed) length(1) data(length)
+ *
+ * usec is the time since the trace was opened. On replay, frames we send are
+ * checked against the recorded TX records (any difference is reported), and
+ * the recorded responses are returned in place of the card's, so the protocol
+ * code can be run repeatedly without hardware.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif // HAVE_CONFIG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define TRACE_VERSION		1
+#define TRACE_HEADER		12
+#define TRACE_RING		0x10000
+#define TRACE_FLUSH_MS		50	// longest a record waits in the ring
+
+// recording
+static bool Recording= false;
+static int Trace_fd= -1;
+static uint8_t Ring[TRACE_RING];
+static size_t Head, Tail;		// free running - index is modulo ring size
+static bool Stop;
+static pthread_t Writer;
+static pthread_mutex_t Lock= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Filled= PTHREAD_COND_INITIALIZER, Drained= PTHREAD_COND_INITIALIZER;
+static struct timespec Start;
+
+// replay
+static FILE *Replay= NULL;
+static bool Replay_eof= false;
+static unsigned long Replayed, Diverged;
+
+static uint64_t trace_usec(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) (now.tv_sec - Start.tv_sec) * 1000000 + (now.tv_nsec - Start.tv_nsec) / 1000;
+}
+
+static void *trace_writer(void *arg)
+{
+  struct timespec deadline;
+  size_t len;
+
+  (void) arg;
+  pthread_mutex_lock(&Lock);
+  for(;;)
+    {
+    while(Head == Tail && !Stop)
+      pthread_cond_wait(&Filled, &Lock);
+    if(Head == Tail)
+      break;
+    // let a batch build up, but not for longer than TRACE_FLUSH_MS
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+      {
+      ++deadline.tv_sec;
+      deadline.tv_nsec -= 1000000000L;
+      }
+    while(Head - Tail < TRACE_RING / 2 && !Stop && pthread_cond_timedwait(&Filled, &Lock, &deadline) != ETIMEDOUT)
+      ;
+    // write contiguous part of ring
+    len= Head - Tail;
+    if(len > TRACE_RING - Tail % TRACE_RING)
+      len= TRACE_RING - Tail % TRACE_RING;
+    pthread_mutex_unlock(&Lock);
+    if(write(Trace_fd, &Ring[Tail % TRACE_RING], len) != (ssize_t) len)
+      fprintf(stderr, "trace: write failed!\n");
+    pthread_mutex_lock(&Lock);
+    Tail += len;
+    pthread_cond_signal(&Drained);
+    }
+  pthread_mutex_unlock(&Lock);
+  return NULL;
+}
+
+// start recording - return false if OK or true if failed
+bool trace_open(char *filename)
+{
+  uint8_t header[8]= { 'I', 'C', 'T', 'R', TRACE_VERSION, 0, 0, 0 };
+
+  if((Trace_fd= open(filename, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) < 0)
+    return true;
+  if(write(Trace_fd, header, sizeof(header)) != sizeof(header))
+    return true;
+  clock_gettime(CLOCK_MONOTONIC, &Start);
+  Head= Tail= 0;
+  Stop= false;
+  if(pthread_create(&Writer, NULL, trace_writer, NULL))
+    return true;
+  Recording= true;
+  return false;
+}
+
+// start replay - return false if OK or true if failed
+bool trace_replay_open(char *filename)
+{
+  uint8_t header[8];
+
+  if(!(Replay= fopen(filename, "rb")))
+    return true;
+  if(fread(header, 1, sizeof(header), Replay) != sizeof(header) || memcmp(header, "ICTR", 4) || header[4] != TRACE_VERSION)
+    {
+    fclose(Replay);
+    Replay= NULL;
+    return true;
+    }
+  Replay_eof= false;
+  Replayed= Diverged= 0;
+  return false;
+}
+
+bool trace_replaying(void)
+{
+  return Replay != NULL;
+}
+
+bool trace_replay_eof(void)
+{
+  return Replay_eof;
+}
+
+// flush and close recording, or report on replay
+void trace_close(void)
+{
+  if(Recording)
+    {
+    pthread_mutex_lock(&Lock);
+    Stop= true;
+    pthread_cond_signal(&Filled);
+    pthread_mutex_unlock(&Lock);
+    pthread_join(Writer, NULL);
+    close(Trace_fd);
+    Recording= false;
+    }
+  if(Replay)
+    {
+    printf("\n  trace: %lu records replayed, %lu diverged\n", Replayed, Diverged);
+    fclose(Replay);
+    Replay= NULL;
+    }
+}
+
+void trace_record(uint8_t type, int result, const uint8_t *data, size_t len)
+{
+  uint8_t header[TRACE_HEADER];
+  uint64_t usec;
+  size_t i, pos;
+
+  if(!Recording)
+    return;
+  if(len > 0xff)
+    len= 0xff;
+  usec= trace_usec();
+  for(i= 0 ; i < 8 ; ++i)
+    header[i]= (usec >> (i * 8)) & 0xff;
+  header[8]= type;
+  header[9]= result & 0xff;
+  header[10]= (result >> 8) & 0xff;
+  header[11]= (uint8_t) len;
+
+  pthread_mutex_lock(&Lock);
+  // only waits if the disk can't keep up with the reader
+  while(TRACE_RING - (Head - Tail) < TRACE_HEADER + len)
+    pthread_cond_wait(&Drained, &Lock);
+  // wake the writer to start its flush timer, or to write a half full ring now
+  if(Head == Tail)
+    pthread_cond_signal(&Filled);
+  for(i= 0, pos= Head ; i < TRACE_HEADER ; ++i, ++pos)
+    Ring[pos % TRACE_RING]= header[i];
+  for(i= 0 ; i < len ; ++i, ++pos)
+    Ring[pos % TRACE_RING]= data[i];
+  Head= pos;
+  if(Head - Tail >= TRACE_RING / 2)
+    pthread_cond_signal(&Filled);
+  pthread_mutex_unlock(&Lock);
+}
+
+// read next record - return false if OK or true at end of trace
+static bool trace_next(uint8_t *type, int *result, uint8_t *data, size_t *len)
+{
+  uint8_t header[TRACE_HEADER];
+
+  if(Replay_eof || fread(header, 1, TRACE_HEADER, Replay) != TRACE_HEADER)
+    {
+    Replay_eof= true;
+    return true;
+    }
+  *type= header[8];
+  *result= (int16_t) (header[9] | header[10] << 8);
+  *len= header[11];
+  if(fread(data, 1, *len, Replay) != *len)
+    {
+    Replay_eof= true;
+    return true;
+    }
+  ++Replayed;
+  return false;
+}
+
+// replay one exchange - returns recorded result
+int trace_replay_transceive(const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen)
+{
+  uint8_t type, data[0x100];
+  size_t len;
+  int result;
+
+  if(trace_next(&type, &result, data, &len) || type != TRACE_TX)
+    {
+    ++Diverged;
+    return -1;
+    }
+  if(len != txlen || memcmp(data, tx, len))
+    {
+    ++Diverged;
+    printf("\n  trace: TX differs from recording at record %lu\n", Replayed);
+    }
+  if(trace_next(&type, &result, data, &len) || type != TRACE_RX)
+    {
+    ++Diverged;
+    return -1;
+    }
+  memcpy(rx, data, len < rxlen ? len : rxlen);
+  return result;
+}
+
+// replay select - returns recorded result and fills uid
+int trace_replay_select(uint8_t *uid)
+{
+  uint8_t type, data[0x100];
+  size_t len;
+  int result;
+
+  if(trace_next(&type, &result, data, &len) || type != TRACE_SELECT)
+    {
+    if(!Replay_eof)
+      ++Diverged;
+    return -1;
+    }
+  memcpy(uid, data, len < 8 ? len : 8);
+  return result;
+}
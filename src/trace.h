@@ -0,0 +1,72 @@
+/*-
+ * Free/Libre Near Field Communication (NFC) library
+ *
+ * Libnfc historical contributors:
+ * Copyright (C) 2009      Roel Verdult
+ * Copyright (C) 2009-2013 Romuald Conty
+ * Copyright (C) 2010-2012 Romain Tartière
+ * Copyright (C) 2010-2013 Philippe Teuwen
+ * Copyright (C) 2012-2013 Ludovic Rousseau
+ * See AUTHORS file for a more comprehensive list of contributors.
+ * Additional contributors of this file:
+ * Copyright (C) 2020      Adam Laurie
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *  1) Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  2 )Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Note that this license only applies on the examples, NFC library itself is under LGPL
+ *
+ */
+
+/**
+ * @file trace.h
+ * @brief record RF traffic to a binary trace file and replay it without a reader
+ */
+
+#ifndef _TRACE_H_
+#  define _TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// record types
+#define TRACE_TX		0x01	// frame sent to card
+#define TRACE_RX		0x02	// response (result is byte count or libnfc error)
+#define TRACE_SELECT		0x03	// select (data is libnfc UID)
+
+#ifndef LEAN
+bool trace_open(char *filename);
+bool trace_replay_open(char *filename);
+void trace_close(void);
+bool trace_replaying(void);
+bool trace_replay_eof(void);
+void trace_record(uint8_t type, int result, const uint8_t *data, size_t len);
+int trace_replay_transceive(const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen);
+int trace_replay_select(uint8_t *uid);
+#else
+// no tracing in the lean build - calls in the RF path compile away
+static inline bool trace_replaying(void) { return false; }
+static inline bool trace_replay_eof(void) { return true; }
+static inline void trace_record(uint8_t type, int result, const uint8_t *data, size_t len) { }
+static inline int trace_replay_transceive(const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen) { return -1; }
+static inline int trace_replay_select(uint8_t *uid) { return -1; }
+#endif // LEAN
+#endif // _TRACE_H_